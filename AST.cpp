@@ -1,16 +1,45 @@
 #include "AST.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <tuple>
 #include <vector>
 #include <string>
 #include <fmt/core.h>
 #include <fmt/format.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Operator.h>
 #include "CodeGen.h"
 
 using namespace llvm;
 using namespace AST;
 using namespace CodeGen;
 
+// Follow type names (type row = array ...) to the declaration they stand for.
+static TypeDecl *ResolveType(CodeGenContext &context, TypeDecl *t) {
+  while (t && t->type == TypeDecl::T_SIMPLE_TYPE_DECLARE && t->simpleTypeDecl->type == SimpleTypeDecl::T_TYPE_NAME) {
+    auto b = context.isType(t->simpleTypeDecl->name);
+    if (!b || b->types[t->simpleTypeDecl->name] == t)
+      break;
+    t = b->types[t->simpleTypeDecl->name];
+  }
+  return t;
+}
+
+// array of T: a handle to a block holding the bounds setlength gave it, followed by the elements.
+static bool IsDynamicArray(CodeGenContext &context, TypeDecl *t) {
+  t = ResolveType(context, t);
+  return t && t->type == TypeDecl::T_ARRAY_TYPE_DECLARE && !t->arrayTypeDecl->range;
+}
+
+static LoadInst *CreateLoad(CodeGenContext &context, Value *ptr) {
+  return context.builder.CreateLoad(ptr->getType()->getPointerElementType(), ptr);
+}
+
 static Value *GetRecordRef(CodeGenContext &context, const std::string &id, const std::string &recordId) {
   auto p = context.blocksStack.top();
   std::vector<llvm::Value *> idxList;
@@ -22,8 +51,9 @@ static Value *GetRecordRef(CodeGenContext &context, const std::string &id, const
     if (p->locals[id] == nullptr) {
       fmt::print("Uninitialize variable: {}\n", id);
     }
-    assert(p->varTypes[id]->type == TypeDecl::T_RECORD_TYPE_DECLARE);
-    FieldDeclList *fieldDeclList = p->varTypes[id]->recordTypeDecl->fieldDeclList;
+    TypeDecl *recordType = ResolveType(context, p->varTypes[id]);
+    assert(recordType->type == TypeDecl::T_RECORD_TYPE_DECLARE);
+    FieldDeclList *fieldDeclList = recordType->recordTypeDecl->fieldDeclList;
     int i = 0;
     bool flag = false;
     while (fieldDeclList && !flag) {
@@ -49,22 +79,231 @@ static Value *GetRecordRef(CodeGenContext &context, const std::string &id, const
 
     Value *ptr;
     if (context.isReference(id)) {
-      ptr = new llvm::LoadInst(p->locals[id], "", false, context.currentBlock());
+      ptr = CreateLoad(context, p->locals[id]);
     } else {
       ptr = p->locals[id];
     }
     Type *t = p->varTypes[id]->getType(context, id);
-    GetElementPtrInst *elePtr = GetElementPtrInst::Create(nullptr, ptr, makeArrayRef(idxList), "",
-                                                          context.currentBlock());
-    return elePtr;
+    return context.builder.CreateGEP(ptr->getType()->getPointerElementType(), ptr, makeArrayRef(idxList));
   }
   return nullptr;
 }
 
 
-static Value *GetArrayRef(CodeGenContext &context, const std::string &id, Expression *index) {
-  auto idxList = std::vector<llvm::Value *>();
-  idxList.push_back(llvm::ConstantInt::get(MyContext, llvm::APInt(32, 0, false)));
+// Peel `count` array dimensions off `type`, leaving the remaining element type behind.
+static std::vector<ArrayTypeDecl *> GetArrayDims(CodeGenContext &context, const std::string &id, size_t count,
+                                                 TypeDecl *&type) {
+  std::vector<ArrayTypeDecl *> dims;
+  for (size_t k = 0; k < count; k++) {
+    type = ResolveType(context, type);
+    if (!type || type->type != TypeDecl::T_ARRAY_TYPE_DECLARE) {
+      std::cerr << "too many indices for array " << id << std::endl;
+      std::exit(1);
+    }
+    dims.push_back(type->arrayTypeDecl);
+    type = type->arrayTypeDecl->elementType;
+  }
+  return dims;
+}
+
+static void RecordBoundsCheck(CodeGenContext &context, decltype(BoundsCheck::kind) kind, const std::string &id,
+                              int dimension) {
+  std::string routine = context.blocksStack.top()->function->getName().str();
+  context.boundsChecks.push_back({kind, routine, id, dimension});
+}
+
+// The values v can take, as far as constants, for-loop control variables with constant bounds
+// and nsw arithmetic on them tell.
+static bool GetValueRange(CodeGenContext &context, Value *v, int64_t &lo, int64_t &hi) {
+  if (auto c = llvm::dyn_cast<ConstantInt>(v)) {
+    lo = hi = c->getSExtValue();
+    return true;
+  }
+  for (auto &l : context.loopVariables) {
+    if (l.second.induction != v)
+      continue;
+    auto first = llvm::dyn_cast<ConstantInt>(l.second.first);
+    auto last = llvm::dyn_cast<ConstantInt>(l.second.last);
+    if (!first || !last)
+      return false;
+    lo = std::min(first->getSExtValue(), last->getSExtValue());
+    hi = std::max(first->getSExtValue(), last->getSExtValue());
+    return true;
+  }
+  auto op = llvm::dyn_cast<llvm::BinaryOperator>(v);
+  int64_t lo0, hi0, lo1, hi1;
+  if (!op || !GetValueRange(context, op->getOperand(0), lo0, hi0) ||
+      !GetValueRange(context, op->getOperand(1), lo1, hi1))
+    return false;
+  switch (op->getOpcode()) {
+    case llvm::Instruction::Add:
+      lo = lo0 + lo1, hi = hi0 + hi1;
+      return true;
+    case llvm::Instruction::Sub:
+      lo = lo0 - hi1, hi = hi0 - lo1;
+      return true;
+    case llvm::Instruction::Mul:
+      lo = std::min({lo0 * lo1, lo0 * hi1, hi0 * lo1, hi0 * hi1});
+      hi = std::max({lo0 * lo1, lo0 * hi1, hi0 * lo1, hi0 * hi1});
+      return true;
+    default:
+      return false;
+  }
+}
+
+// if (unsigned)(index - lower) >= count, report the bad index and stop; execution continues in a fresh block
+static void EmitBoundsCheck(CodeGenContext &context, const std::string &id, Value *index, Value *lower,
+                            Value *count) {
+  Function *currentFunction = context.blocksStack.top()->function;
+  auto offset = context.builder.CreateSub(index, lower);
+  Value *inRange = context.builder.CreateICmp(llvm::CmpInst::ICMP_ULT, offset, count);
+  BasicBlock *bok = BasicBlock::Create(MyContext, "boundsOk", currentFunction);
+  BasicBlock *bfail = BasicBlock::Create(MyContext, "boundsFail", currentFunction);
+  llvm::MDBuilder weights(MyContext);
+  context.builder.CreateCondBr(inRange, bok, bfail)
+      ->setMetadata(llvm::LLVMContext::MD_prof, weights.createBranchWeights(1 << 20, 1));
+
+  Constant *&nameRef = context.arrayNames[id];
+  if (!nameRef) {
+    auto name = ConstantDataArray::getString(MyContext, id, true);
+    auto nameVar = new GlobalVariable(*context.module, name->getType(), true, GlobalValue::PrivateLinkage, name,
+                                      ".str");
+    nameVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    nameRef = ConstantExpr::getInBoundsGetElementPtr(name->getType(), nameVar,
+                                                     ArrayRef<Constant *>({context.builder.getInt32(0),
+                                                                           context.builder.getInt32(0)}));
+  }
+  context.builder.SetInsertPoint(bfail);
+  Type *i32 = Type::getInt32Ty(MyContext);
+  Value *last = context.builder.CreateAdd(lower, count);
+  Value *upper = context.builder.CreateSub(last, ConstantInt::get(count->getType(), 1));
+  context.builder.CreateCall(context.boundsErrorFunc(), {nameRef, context.builder.CreateSExtOrTrunc(index, i32),
+                                                         context.builder.CreateSExtOrTrunc(lower, i32),
+                                                         context.builder.CreateSExtOrTrunc(upper, i32)});
+  context.builder.CreateUnreachable();
+
+  context.builder.SetInsertPoint(bok);
+}
+
+static void EmitBoundsCheck(CodeGenContext &context, const std::string &id, ArrayTypeDecl *dim, Value *index) {
+  Type *type = index->getType();
+  EmitBoundsCheck(context, id, index, ConstantInt::get(type, dim->getLowerBound(context.constTable), true),
+                  ConstantInt::get(type, dim->range->getRange(context.constTable)));
+}
+
+// Bounds check for dimension k of an access to id: decided at compile time when the index range is known,
+// skipped when its loop already checked it, emitted otherwise.
+static void CheckIndex(CodeGenContext &context, const std::string &id, int k, ArrayTypeDecl *dim,
+                       Expression *expr, Value *index) {
+  if (context.hoistedBoundsChecks.count(expr))
+    return;
+  int64_t lo, hi;
+  int64_t lower = dim->getLowerBound(context.constTable);
+  int64_t upper = lower + dim->range->getRange(context.constTable) - 1;
+  if (GetValueRange(context, index, lo, hi)) {
+    if (lo >= lower && hi <= upper) {
+      RecordBoundsCheck(context, llvm::isa<ConstantInt>(index) ? BoundsCheck::T_CONSTANT : BoundsCheck::T_RANGE,
+                        id, k);
+      return;
+    }
+    if (llvm::isa<ConstantInt>(index)) {
+      std::cerr << "index out of range " << lower << ".." << upper << " of array " << id << std::endl;
+      std::exit(1);
+    }
+  }
+  RecordBoundsCheck(context, BoundsCheck::T_RUNTIME, id, k);
+  EmitBoundsCheck(context, id, dim, index);
+}
+
+static bool IsBooleanType(CodeGenContext &context, TypeDecl *t) {
+  t = ResolveType(context, t);
+  if (!t || t->type != TypeDecl::T_SIMPLE_TYPE_DECLARE)
+    return false;
+  SimpleTypeDecl *s = t->simpleTypeDecl;
+  return (s->type == SimpleTypeDecl::T_SYS_TYPE && s->sysType == "boolean") ||
+         (s->type == SimpleTypeDecl::T_TYPE_NAME && s->name == "boolean");
+}
+
+// Number of elements of a packed array of booleans, nested arrays included; 0 if it is not bit-packed.
+static int64_t BitPackedSize(CodeGenContext &context, ArrayTypeDecl *array) {
+  if (!array->packed || !array->range)
+    return 0;
+  int64_t bits = 1;
+  TypeDecl *t;
+  for (;;) {
+    bits *= array->range->getRange(context.constTable);
+    t = ResolveType(context, array->elementType);
+    if (!t || t->type != TypeDecl::T_ARRAY_TYPE_DECLARE)
+      break;
+    array = t->arrayTypeDecl;
+  }
+  return IsBooleanType(context, t) ? bits : 0;
+}
+
+// Calls into runtime/arena.c, which allocates the blocks of dynamic arrays.
+static Value *CallArrayRuntime(CodeGenContext &context, const std::string &name, Type *result,
+                               ArrayRef<Value *> args) {
+  std::vector<Type *> types;
+  for (Value *arg : args)
+    types.push_back(arg->getType());
+  auto type = llvm::FunctionType::get(result, types, false);
+  return context.builder.CreateCall(context.module->getOrInsertFunction(name, type), args);
+}
+
+static Value *GetElementSize(CodeGenContext &context, Type *handleType) {
+  auto header = llvm::cast<StructType>(handleType->getPointerElementType());
+  Type *element = header->getElementType(2)->getArrayElementType();
+  return ConstantInt::get(Type::getInt64Ty(MyContext), context.module->getDataLayout().getTypeAllocSize(element));
+}
+
+// Field 0 (lower bound) or 1 (length) of the header of a dynamic array. The empty array has a null
+// handle, read as a header of zeros.
+static Value *LoadArrayHeader(CodeGenContext &context, Value *handle, unsigned field) {
+  Type *i64 = Type::getInt64Ty(MyContext);
+  GlobalVariable *empty = context.module->getNamedGlobal("spl.array.empty");
+  if (!empty) {
+    Type *type = StructType::get(MyContext, {i64, i64});
+    empty = new GlobalVariable(*context.module, type, true, GlobalValue::PrivateLinkage,
+                               Constant::getNullValue(type), "spl.array.empty");
+  }
+  Value *header = context.builder.CreateSelect(context.builder.CreateIsNull(handle),
+                                               context.builder.CreateBitCast(empty, handle->getType()), handle);
+  return CreateLoad(context, context.builder.CreateStructGEP(handle->getType()->getPointerElementType(), header,
+                                                             field));
+}
+
+// a[i] of a dynamic array kept in storage: element i - lower bound of its block, checked against the
+// header with --check-bounds.
+static Value *GetDynamicArrayRef(CodeGenContext &context, const std::string &id, Value *storage,
+                                 ExpressionList *indices) {
+  if (!indices || indices->preList) {
+    std::cerr << "dynamic array takes a single index: " << id << std::endl;
+    std::exit(1);
+  }
+  Value *index = indices->expression->codeGen(context);
+  if (!index->getType()->isIntegerTy(32)) {
+    std::cerr << "array index must be an integer: " << id << std::endl;
+    std::exit(1);
+  }
+  index = context.builder.CreateSExt(index, Type::getInt64Ty(MyContext));
+  Value *handle = CreateLoad(context, storage);
+  Value *lower = LoadArrayHeader(context, handle, 0);
+  if (context.options.checkBounds) {
+    RecordBoundsCheck(context, BoundsCheck::T_RUNTIME, id, 0);
+    EmitBoundsCheck(context, id, index, lower, LoadArrayHeader(context, handle, 1));
+  }
+  Value *offset = context.builder.CreateNSWSub(index, lower);
+  Type *i32 = Type::getInt32Ty(MyContext);
+  return context.builder.CreateInBoundsGEP(handle->getType()->getPointerElementType(), handle,
+                                           {ConstantInt::get(i32, 0), ConstantInt::get(i32, 2), offset});
+}
+
+// a[i, j] and a[i][j] address nested arrays as one row-major block: a single GEP on the element type,
+// with the lower-bound bias of every dimension folded into the base pointer.
+// Inside a bit-packed boolean array the remaining indices select a bit instead: the word holding it
+// is returned and its position stored in *bit. Callers that need a real address pass no bit.
+static Value *GetArrayRef(CodeGenContext &context, const std::string &id, ExpressionList *indices,
+                          Value **bit = nullptr) {
   auto p = context.blocksStack.top();
   while (p) {
     if (p->locals.find(id) == p->locals.end()) {
@@ -76,24 +315,696 @@ static Value *GetArrayRef(CodeGenContext &context, const std::string &id, Expres
     }
     Value *ptr;
     if (context.isReference(id)) {
-      ptr = new llvm::LoadInst(p->locals[id], "", false, context.currentBlock());
+      ptr = CreateLoad(context, p->locals[id]);
     } else {
       ptr = p->locals[id];
     }
+    if (IsDynamicArray(context, p->varTypes[id]))
+      return GetDynamicArrayRef(context, id, ptr, indices);
     Type *t = p->varTypes[id]->getType(context, id);
-    Value *lowerBound = llvm::ConstantInt::get(MyContext, llvm::APInt(32,
-                                                                      p->varTypes[id]->arrayTypeDecl->range->getLowerBound(
-                                                                              context.constTable), false));
-    auto second = llvm::BinaryOperator::Create(llvm::Instruction::Sub, index->codeGen(context),
-                                               lowerBound, "", context.currentBlock());
-    idxList.push_back(second);
-    GetElementPtrInst *elePtr = GetElementPtrInst::Create(t, ptr, makeArrayRef(idxList), "",
-                                                          context.currentBlock());
-    return elePtr;
+
+    std::vector<Expression *> exprs;
+    for (ExpressionList *l = indices; l; l = l->preList)
+      exprs.insert(exprs.begin(), l->expression);
+    TypeDecl *elementType = p->varTypes[id];
+    std::vector<ArrayTypeDecl *> dims = GetArrayDims(context, id, exprs.size(), elementType);
+    // dimensions from `outer` on belong to a bitset
+    size_t outer = dims.size();
+    for (size_t k = 0; k < dims.size() && outer == dims.size(); k++)
+      if (BitPackedSize(context, dims[k]))
+        outer = k;
+    if (outer < dims.size()) {
+      auto leaf = ResolveType(context, elementType);
+      if (leaf && leaf->type == TypeDecl::T_ARRAY_TYPE_DECLARE) {
+        std::cerr << "packed boolean array must be indexed down to an element: " << id << std::endl;
+        std::exit(1);
+      }
+      if (!bit) {
+        std::cerr << "element of packed boolean array cannot be passed by reference: " << id << std::endl;
+        std::exit(1);
+      }
+    }
+    std::vector<int64_t> strides(dims.size(), 1);
+    for (size_t k = dims.size() - 1; k > 0; k--)
+      if (k != outer)
+        strides[k - 1] = strides[k] * dims[k]->range->getRange(context.constTable);
+
+    Value *linear = nullptr, *bitLinear = nullptr;
+    int64_t bias = 0, bitBias = 0;
+    for (size_t k = 0; k < dims.size(); k++) {
+      Value *index = exprs[k]->codeGen(context);
+      if (!index->getType()->isIntegerTy(32)) {
+        std::cerr << "array index must be an integer: " << id << std::endl;
+        std::exit(1);
+      }
+      if (context.options.checkBounds)
+        CheckIndex(context, id, k, dims[k], exprs[k], index);
+      if (strides[k] != 1)
+        index = context.builder.CreateNSWMul(index, ConstantInt::get(index->getType(), strides[k]));
+      Value *&sum = k < outer ? linear : bitLinear;
+      sum = sum ? context.builder.CreateNSWAdd(sum, index) : index;
+      (k < outer ? bias : bitBias) += dims[k]->getLowerBound(context.constTable) * strides[k];
+    }
+
+    std::vector<Value *> zeros(outer + 1, ConstantInt::get(Type::getInt32Ty(MyContext), 0));
+    Type *elementTy = outer < dims.size() ? dims[outer]->getType(context) : elementType->getType(context, "");
+    Value *base = context.builder.CreateGEP(t, ptr, zeros);
+    if (bias != 0)
+      base = context.builder.CreateGEP(elementTy, base, ConstantInt::get(Type::getInt64Ty(MyContext), -bias, true));
+    if (linear)
+      base = context.builder.CreateGEP(elementTy, base, linear);
+    if (outer == dims.size())
+      return base;
+
+    if (bitBias != 0)
+      bitLinear = context.builder.CreateNSWSub(bitLinear, ConstantInt::get(bitLinear->getType(), bitBias, true));
+    Value *position = context.builder.CreateZExt(bitLinear, Type::getInt64Ty(MyContext));
+    Value *word = context.builder.CreateLShr(position, ConstantInt::get(position->getType(), 6));
+    *bit = context.builder.CreateAnd(position, ConstantInt::get(position->getType(), 63));
+    return context.builder.CreateGEP(elementTy, base, {ConstantInt::get(Type::getInt32Ty(MyContext), 0), word});
   }
   return nullptr;
 }
 
+static Value *LoadPackedBit(CodeGenContext &context, Value *word, Value *bit) {
+  Value *v = CreateLoad(context, word);
+  v = context.builder.CreateLShr(v, bit);
+  return context.builder.CreateTrunc(v, Type::getInt1Ty(MyContext));
+}
+
+static Value *StorePackedBit(CodeGenContext &context, Value *word, Value *bit, Value *v) {
+  Type *wordTy = Type::getInt64Ty(MyContext);
+  Value *old = CreateLoad(context, word);
+  Value *mask = context.builder.CreateShl(ConstantInt::get(wordTy, 1), bit);
+  Value *cleared = context.builder.CreateAnd(old, context.builder.CreateNot(mask));
+  Value *set = context.builder.CreateShl(context.builder.CreateZExt(v, wordTy), bit);
+  Value *merged = context.builder.CreateOr(cleared, set);
+  return context.builder.CreateStore(merged, word);
+}
+
+static bool IsPackedRecord(CodeGenContext &context, const std::string &id) {
+  CodeGenBlock *b = context.isVariable(id);
+  TypeDecl *t = b ? ResolveType(context, b->varTypes[id]) : nullptr;
+  return t && t->type == TypeDecl::T_RECORD_TYPE_DECLARE && t->recordTypeDecl->packed;
+}
+
+// Sets hold ordinals 0..255 as bitsets of type <W x i64>, W = max / 64 + 1: ordinal v is bit v % 64 of word v / 64.
+// Sets of different widths meet by zero-extending the narrower one, so [..] needs no type of its own.
+static const int64_t MaxSetOrdinal = 255;
+
+static bool IsSet(Value *v) {
+  return v->getType()->isVectorTy();
+}
+
+static unsigned SetWords(Value *set) {
+  return set->getType()->getPrimitiveSizeInBits() / 64;
+}
+
+static Constant *GetSetConstant(const std::vector<uint64_t> &words) {
+  std::vector<Constant *> elements;
+  for (auto w : words)
+    elements.push_back(ConstantInt::get(Type::getInt64Ty(MyContext), w));
+  return ConstantVector::get(elements);
+}
+
+static Value *ResizeSet(CodeGenContext &context, Value *set, unsigned words) {
+  unsigned have = SetWords(set);
+  if (have == words)
+    return set;
+  if (auto c = llvm::dyn_cast<Constant>(set)) {
+    std::vector<uint64_t> bits(words, 0);
+    for (unsigned i = 0; i < std::min(have, words); i++)
+      bits[i] = llvm::cast<ConstantInt>(c->getAggregateElement(i))->getZExtValue();
+    return GetSetConstant(bits);
+  }
+  // words past the end of `set` come from the zero vector
+  std::vector<Constant *> mask;
+  for (unsigned i = 0; i < words; i++)
+    mask.push_back(ConstantInt::get(Type::getInt32Ty(MyContext), i < have ? i : have));
+  return context.builder.CreateShuffleVector(set, Constant::getNullValue(set->getType()),
+                                             ConstantVector::get(mask));
+}
+
+static Value *CoerceSet(CodeGenContext &context, Value *v, Type *type) {
+  if (IsSet(v) && type->isVectorTy())
+    return ResizeSet(context, v, type->getPrimitiveSizeInBits() / 64);
+  return v;
+}
+
+// a op b, or a op not b, on sets widened to the same size; the builder folds constant sets
+static Value *CreateSetOp(CodeGenContext &context, llvm::Instruction::BinaryOps op, Value *a, Value *b,
+                          bool complement) {
+  if (!IsSet(a) || !IsSet(b)) {
+    std::cerr << "set operation on a value that is not a set" << std::endl;
+    std::exit(1);
+  }
+  unsigned words = std::max(SetWords(a), SetWords(b));
+  a = ResizeSet(context, a, words);
+  b = ResizeSet(context, b, words);
+  if (complement)
+    b = context.builder.CreateNot(b);
+  return context.builder.CreateBinOp(op, a, b);
+}
+
+static Value *SetIsEmpty(CodeGenContext &context, Value *set) {
+  Type *wide = llvm::IntegerType::get(MyContext, SetWords(set) * 64);
+  Value *bits = context.builder.CreateBitCast(set, wide);
+  return context.builder.CreateICmp(llvm::CmpInst::ICMP_EQ, bits, Constant::getNullValue(wide));
+}
+
+static Value *CompareSets(CodeGenContext &context, decltype(Expression::type) type, Value *a, Value *b) {
+  switch (type) {
+    case Expression::T_EQ:
+    case Expression::T_NE: {
+      Value *diff = CreateSetOp(context, llvm::Instruction::Xor, a, b, false);
+      Value *equal = SetIsEmpty(context, diff);
+      if (type == Expression::T_EQ)
+        return equal;
+      return context.builder.CreateNot(equal);
+    }
+    case Expression::T_LE:
+      return SetIsEmpty(context, CreateSetOp(context, llvm::Instruction::And, a, b, true));
+    case Expression::T_GE:
+      return SetIsEmpty(context, CreateSetOp(context, llvm::Instruction::And, b, a, true));
+    default:
+      std::cerr << "sets can only be compared with =, <>, <= and >=" << std::endl;
+      std::exit(1);
+  }
+}
+
+static Value *OrdinalToWord(CodeGenContext &context, Value *v) {
+  Type *t = v->getType();
+  if (!t->isIntegerTy()) {
+    std::cerr << "set element must be an ordinal value" << std::endl;
+    std::exit(1);
+  }
+  // integers are signed, so a negative one lands far outside 0..255; chars and booleans are unsigned
+  return context.builder.CreateIntCast(v, Type::getInt64Ty(MyContext), t->isIntegerTy(32));
+}
+
+static uint64_t LowMask(int64_t n) {
+  return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+// the bits lo..hi of word w, for run-time lo and hi; an empty or out-of-range run gives 0
+static Value *RangeMask(CodeGenContext &context, Value *lo, Value *hi, unsigned w) {
+  Type *wordTy = Type::getInt64Ty(MyContext);
+  auto clamp = [&](Value *v) -> Value * {
+    Value *below = context.builder.CreateICmp(llvm::CmpInst::ICMP_SLT, v, ConstantInt::get(wordTy, 0));
+    v = context.builder.CreateSelect(below, ConstantInt::get(wordTy, 0), v);
+    Value *above = context.builder.CreateICmp(llvm::CmpInst::ICMP_SGT, v, ConstantInt::get(wordTy, 64));
+    return context.builder.CreateSelect(above, ConstantInt::get(wordTy, 64), v);
+  };
+  auto lowMask = [&](Value *n) -> Value * {
+    Value *full = context.builder.CreateICmp(llvm::CmpInst::ICMP_EQ, n, ConstantInt::get(wordTy, 64));
+    Value *bit = context.builder.CreateShl(ConstantInt::get(wordTy, 1), n);
+    Value *mask = context.builder.CreateSub(bit, ConstantInt::get(wordTy, 1));
+    return context.builder.CreateSelect(full, Constant::getAllOnesValue(wordTy), mask);
+  };
+  Value *base = ConstantInt::get(wordTy, 64 * w);
+  Value *from = clamp(context.builder.CreateSub(lo, base));
+  Value *to = context.builder.CreateSub(hi, base);
+  to = clamp(context.builder.CreateAdd(to, ConstantInt::get(wordTy, 1)));
+  Value *upTo = lowMask(to);
+  Value *below = context.builder.CreateNot(lowMask(from));
+  Value *mask = context.builder.CreateAnd(upTo, below);
+  Value *empty = context.builder.CreateICmp(llvm::CmpInst::ICMP_SGE, from, to);
+  return context.builder.CreateSelect(empty, ConstantInt::get(wordTy, 0), mask);
+}
+
+// [a, b..c]: constant elements become one constant bitset, run-time ones are or'ed in word by word
+static Value *SetConstructor(CodeGenContext &context, SetElementList *elements) {
+  std::vector<uint64_t> bits(MaxSetOrdinal / 64 + 1, 0);
+  unsigned words = 1;
+  std::vector<std::pair<Value *, Value *>> ranges;
+  for (SetElementList *e = elements; e; e = e->preList) {
+    Value *lo = OrdinalToWord(context, e->lower->codeGen(context));
+    Value *hi = e->upper ? OrdinalToWord(context, e->upper->codeGen(context)) : lo;
+    auto clo = llvm::dyn_cast<ConstantInt>(lo), chi = llvm::dyn_cast<ConstantInt>(hi);
+    if (!clo || !chi) {
+      ranges.emplace_back(lo, hi);
+      words = bits.size();
+      continue;
+    }
+    int64_t first = clo->getSExtValue(), last = chi->getSExtValue();
+    if (first > last)
+      continue;
+    if (first < 0 || last > MaxSetOrdinal) {
+      std::cerr << "set element out of range 0.." << MaxSetOrdinal << std::endl;
+      std::exit(1);
+    }
+    for (int64_t w = first / 64; w <= last / 64; w++)
+      bits[w] |= LowMask(last - 64 * w + 1) & ~LowMask(std::max<int64_t>(first - 64 * w, 0));
+    words = std::max<unsigned>(words, last / 64 + 1);
+  }
+  bits.resize(words);
+  Value *set = GetSetConstant(bits);
+  for (auto &range : ranges) {
+    Value *part = Constant::getNullValue(set->getType());
+    for (unsigned w = 0; w < words; w++)
+      part = context.builder.CreateInsertElement(part, RangeMask(context, range.first, range.second, w),
+                                                 ConstantInt::get(Type::getInt32Ty(MyContext), w));
+    set = context.builder.CreateOr(set, part);
+  }
+  return set;
+}
+
+// x in s. Against a constant set whose members lie within 64 consecutive ordinals this is one shift
+// of a 64-bit mask, which is what character-class tests like c in ['a'..'z', '_'] come down to.
+static Value *SetMembership(CodeGenContext &context, Value *x, Value *set) {
+  if (!IsSet(set)) {
+    std::cerr << "right operand of in must be a set" << std::endl;
+    std::exit(1);
+  }
+  Type *wordTy = Type::getInt64Ty(MyContext);
+  Value *v = OrdinalToWord(context, x);
+  Value *base = nullptr, *mask = nullptr;
+  uint64_t limit = 64 * SetWords(set);
+  if (auto c = llvm::dyn_cast<Constant>(set)) {
+    std::vector<uint64_t> bits;
+    for (unsigned i = 0; i < SetWords(set); i++)
+      bits.push_back(llvm::cast<ConstantInt>(c->getAggregateElement(i))->getZExtValue());
+    int64_t first = -1, last = -1;
+    for (int64_t i = 0; i < (int64_t) limit; i++) {
+      if (bits[i / 64] >> (i % 64) & 1) {
+        if (first < 0)
+          first = i;
+        last = i;
+      }
+    }
+    if (first < 0)
+      return ConstantInt::getFalse(MyContext);
+    if (last - first < 64) {
+      uint64_t m = 0;
+      for (int64_t i = first; i <= last; i++)
+        m |= (bits[i / 64] >> (i % 64) & 1) << (i - first);
+      base = ConstantInt::get(wordTy, first);
+      mask = ConstantInt::get(wordTy, m);
+      limit = 64;
+    }
+  }
+  Value *offset = v;
+  if (base)
+    offset = context.builder.CreateSub(v, base);
+  Value *inRange = context.builder.CreateICmp(llvm::CmpInst::ICMP_ULT, offset, ConstantInt::get(wordTy, limit));
+  Value *word = mask;
+  if (!word) {
+    Value *index = context.builder.CreateLShr(offset, ConstantInt::get(wordTy, 6));
+    index = context.builder.CreateSelect(inRange, index, ConstantInt::get(wordTy, 0));
+    word = context.builder.CreateExtractElement(set, index);
+    offset = context.builder.CreateAnd(offset, ConstantInt::get(wordTy, 63));
+  }
+  // the shift is meaningless when offset is out of range, but then the select does not pick it
+  Value *shifted = context.builder.CreateLShr(word, offset);
+  Value *bit = context.builder.CreateTrunc(shifted, Type::getInt1Ty(MyContext));
+  return context.builder.CreateSelect(inRange, bit, ConstantInt::getFalse(MyContext));
+}
+
+// Strings are immutable values of type { i8* data, i32 length, [20 x i8] }. Literals point into read-only data
+// and are never copied; built strings of up to 20 bytes are kept in the value itself with a null data pointer,
+// longer ones on the heap. The first inline byte, unused then, is 1 when the value owns its heap bytes. Every
+// string in memory, a variable, parameter, element or field, owns its value: a store frees the old one, and a
+// routine frees those of its own variables when it returns.
+static const int StringInlineCapacity = 20;
+// The longest word read into a string at once.
+static const int StringReadCapacity = 255;
+
+static StructType *GetStringType(CodeGenContext &context) {
+  if (auto t = context.module->getTypeByName("spl.string"))
+    return t;
+  std::vector<Type *> fields = {Type::getInt8PtrTy(MyContext), Type::getInt32Ty(MyContext),
+                                llvm::ArrayType::get(Type::getInt8Ty(MyContext), StringInlineCapacity)};
+  return StructType::create(MyContext, fields, "spl.string");
+}
+
+static bool IsString(CodeGenContext &context, Type *t) {
+  return t == GetStringType(context);
+}
+
+static AllocaInst *CreateEntryAlloca(CodeGenContext &context, Type *type) {
+  BasicBlock &entry = context.blocksStack.top()->function->getEntryBlock();
+  IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+  return builder.CreateAlloca(type);
+}
+
+static Constant *GetStringLiteral(CodeGenContext &context, const std::string &text) {
+  auto found = context.stringLiterals.find(text);
+  if (found != context.stringLiterals.end())
+    return found->second;
+  auto data = ConstantDataArray::getString(MyContext, text, false);
+  auto var = new GlobalVariable(*context.module, data->getType(), true, GlobalValue::PrivateLinkage, data, ".str");
+  var->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  auto zero = ConstantInt::get(Type::getInt32Ty(MyContext), 0);
+  std::vector<Constant *> fields = {
+          llvm::ConstantExpr::getGetElementPtr(data->getType(), var, ArrayRef<Constant *>({zero, zero})),
+          ConstantInt::get(Type::getInt32Ty(MyContext), text.size()),
+          Constant::getNullValue(GetStringType(context)->getElementType(2))};
+  return context.stringLiterals[text] = ConstantStruct::get(GetStringType(context), fields);
+}
+
+static bool GetLiteralText(CodeGenContext &context, Value *v, std::string &text) {
+  if (auto c = llvm::dyn_cast<ConstantInt>(v)) {
+    text = std::string(1, (char) c->getZExtValue());
+    return c->getType()->isIntegerTy(8);
+  }
+  for (auto &literal : context.stringLiterals) {
+    if (literal.second == v) {
+      text = literal.first;
+      return true;
+    }
+  }
+  return false;
+}
+
+static Value *StringLength(CodeGenContext &context, Value *s) {
+  if (auto c = llvm::dyn_cast<Constant>(s))
+    return c->getAggregateElement(1u);
+  return context.builder.CreateExtractValue(s, {1});
+}
+
+static Value *StringData(CodeGenContext &context, Value *s) {
+  if (auto c = llvm::dyn_cast<Constant>(s)) {
+    if (!c->getAggregateElement(0u)->isNullValue())
+      return c->getAggregateElement(0u);
+  }
+  // a short string's bytes are only addressable once the value is in memory
+  Value *data = context.builder.CreateExtractValue(s, {0});
+  AllocaInst *slot = CreateEntryAlloca(context, s->getType());
+  context.builder.CreateStore(s, slot);
+  auto zero = ConstantInt::get(Type::getInt32Ty(MyContext), 0);
+  Value *inlineData = context.builder.CreateGEP(s->getType(), slot,
+                                                {zero, ConstantInt::get(Type::getInt32Ty(MyContext), 2), zero});
+  Value *isInline = context.builder.CreateIsNull(data);
+  return context.builder.CreateSelect(isInline, inlineData, data);
+}
+
+// The heap bytes the value owns, or null.
+static Value *StringHeapData(CodeGenContext &context, Value *s) {
+  Value *data = context.builder.CreateExtractValue(s, {0});
+  Value *flag = context.builder.CreateExtractValue(s, {2, 0});
+  Value *owns = context.builder.CreateAnd(context.builder.CreateIsNotNull(data), context.builder.CreateIsNotNull(flag));
+  return context.builder.CreateSelect(owns, data, Constant::getNullValue(data->getType()));
+}
+
+static void FreeString(CodeGenContext &context, Value *s) {
+  if (llvm::isa<Constant>(s))
+    return;
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  llvm::FunctionCallee free = context.module->getOrInsertFunction(
+          "free", llvm::FunctionType::get(Type::getVoidTy(MyContext), {bytes}, false));
+  context.builder.CreateCall(free, {StringHeapData(context, s)});
+}
+
+// The value with heap bytes of its own when s owns its bytes, which stay with s; s itself otherwise.
+static Value *CopyString(CodeGenContext &context, Value *s) {
+  if (llvm::isa<Constant>(s))
+    return s;
+  Type *i64 = Type::getInt64Ty(MyContext), *bytes = Type::getInt8PtrTy(MyContext);
+  Function *currentFunction = context.blocksStack.top()->function;
+  Value *heap = StringHeapData(context, s);
+  BasicBlock *bshared = context.currentBlock();
+  BasicBlock *bcopy = BasicBlock::Create(MyContext, "stringCopy", currentFunction);
+  BasicBlock *bdone = BasicBlock::Create(MyContext, "stringCopied", currentFunction);
+  context.builder.CreateCondBr(context.builder.CreateIsNull(heap), bdone, bcopy);
+  context.builder.SetInsertPoint(bcopy);
+  Value *length = context.builder.CreateZExt(StringLength(context, s), i64);
+  llvm::FunctionCallee malloc = context.module->getOrInsertFunction(
+          "malloc", llvm::FunctionType::get(bytes, {i64}, false));
+  Value *copy = context.builder.CreateCall(malloc, {length});
+  Function *memcpy = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::memcpy, {bytes, bytes, i64});
+  context.builder.CreateCall(memcpy, {copy, heap, length, ConstantInt::getFalse(MyContext)});
+  context.builder.CreateBr(bdone);
+  context.builder.SetInsertPoint(bdone);
+  PHINode *data = context.builder.CreatePHI(bytes, 2);
+  data->addIncoming(context.builder.CreateExtractValue(s, {0}), bshared);
+  data->addIncoming(copy, bcopy);
+  return context.builder.CreateInsertValue(s, data, {0});
+}
+
+// Whether the factor calls a function: with arguments, or by the bare name of one without parameters
+// that no variable in scope hides.
+static bool IsFunctionCall(CodeGenContext &context, Factor *f) {
+  if (f->type == Factor::T_NAME_ARGS)
+    return true;
+  if (f->type != Factor::T_NAME || context.isVariable(f->name) || !context.funcParams.count(f->name))
+    return false;
+  Function *function = context.module->getFunction(f->name);
+  return function && !function->getReturnType()->isVoidTy() &&
+         function->arg_size() == context.funcParams[f->name].captures.size();
+}
+
+// Whether an expression yields a string nothing else holds: a concatenation or a function result.
+static bool IsFreshString(CodeGenContext &context, Node *node) {
+  if (auto e = dynamic_cast<Expression *>(node))
+    return e->type == Expression::T_EXPR && IsFreshString(context, e->expr);
+  if (auto e = dynamic_cast<Expr *>(node))
+    return e->type == Expr::T_PLUS || (e->type == Expr::T_TERM && IsFreshString(context, e->term));
+  if (auto t = dynamic_cast<Term *>(node))
+    return t->type == Term::T_FACTOR && IsFreshString(context, t->factor);
+  if (auto f = dynamic_cast<Factor *>(node))
+    return IsFunctionCall(context, f) || (f->type == Factor::T_EXPR && IsFreshString(context, f->expression));
+  return false;
+}
+
+// Whether values of the type hold strings, themselves or in their elements and fields.
+static bool HasStrings(CodeGenContext &context, Type *type) {
+  if (IsString(context, type))
+    return true;
+  if (auto array = llvm::dyn_cast<llvm::ArrayType>(type))
+    return HasStrings(context, array->getElementType());
+  if (auto record = llvm::dyn_cast<StructType>(type))
+    return std::any_of(record->element_begin(), record->element_end(),
+                       [&](Type *field) { return HasStrings(context, field); });
+  return false;
+}
+
+// Calls f with the address of every string in the variable at ptr, looping over array elements; packed
+// tells whether that address lies in a packed record.
+static void ForEachString(CodeGenContext &context, Value *ptr, bool packed,
+                          const std::function<void(Value *, bool)> &f) {
+  Type *type = ptr->getType()->getPointerElementType();
+  if (IsString(context, type)) {
+    f(ptr, packed);
+  } else if (auto record = llvm::dyn_cast<StructType>(type)) {
+    for (unsigned i = 0; i < record->getNumElements(); i++)
+      if (HasStrings(context, record->getElementType(i)))
+        ForEachString(context, context.builder.CreateStructGEP(record, ptr, i), packed || record->isPacked(), f);
+  } else if (auto array = llvm::dyn_cast<llvm::ArrayType>(type)) {
+    if (!HasStrings(context, array->getElementType()))
+      return;
+    Type *i64 = Type::getInt64Ty(MyContext);
+    Function *function = context.blocksStack.top()->function;
+    BasicBlock *preheader = context.currentBlock();
+    BasicBlock *bloop = BasicBlock::Create(MyContext, "stringsLoop", function);
+    BasicBlock *bexit = BasicBlock::Create(MyContext, "stringsDone", function);
+    context.builder.CreateBr(bloop);
+    context.builder.SetInsertPoint(bloop);
+    PHINode *index = context.builder.CreatePHI(i64, 2);
+    index->addIncoming(ConstantInt::get(i64, 0), preheader);
+    ForEachString(context, context.builder.CreateInBoundsGEP(array, ptr, {ConstantInt::get(i64, 0), index}), packed,
+                  f);
+    Value *next = context.builder.CreateNUWAdd(index, ConstantInt::get(i64, 1));
+    index->addIncoming(next, context.currentBlock());
+    Value *done = context.builder.CreateICmpEQ(next, ConstantInt::get(i64, array->getNumElements()));
+    context.builder.CreateCondBr(done, bexit, bloop);
+    context.builder.SetInsertPoint(bexit);
+  }
+}
+
+static LoadInst *LoadString(CodeGenContext &context, Value *slot, bool packed) {
+  LoadInst *load = CreateLoad(context, slot);
+  if (packed)
+    load->setAlignment(1);
+  return load;
+}
+
+// Frees the heap bytes of every string the variable at ptr holds.
+static void ReleaseStrings(CodeGenContext &context, Value *ptr, bool packed) {
+  ForEachString(context, ptr, packed, [&](Value *slot, bool packed) {
+    FreeString(context, LoadString(context, slot, packed));
+  });
+}
+
+// Gives every string of the variable at ptr, just copied from another one, heap bytes of its own.
+static void CopyStrings(CodeGenContext &context, Value *ptr, bool packed) {
+  ForEachString(context, ptr, packed, [&](Value *slot, bool packed) {
+    auto store = context.builder.CreateStore(CopyString(context, LoadString(context, slot, packed)), slot);
+    if (packed)
+      store->setAlignment(1);
+  });
+}
+
+// Store what rhs evaluated to, a string or an array or record holding strings, over the value at ptr.
+// Every string slot owns its heap bytes: the ones it held are freed, and strings held elsewhere are
+// copied first, so that no two slots ever share them.
+static StoreInst *StoreString(CodeGenContext &context, Value *v, Node *rhs, Value *ptr, bool packed) {
+  bool fresh = IsFreshString(context, rhs);
+  if (IsString(context, v->getType())) {
+    if (!fresh)
+      v = CopyString(context, v);
+    FreeString(context, LoadString(context, ptr, packed));
+  } else {
+    // ptr may be part of what v was loaded from, so the copies are made before anything is freed
+    if (!fresh) {
+      AllocaInst *temp = CreateEntryAlloca(context, v->getType());
+      context.builder.CreateStore(v, temp);
+      CopyStrings(context, temp, false);
+      v = CreateLoad(context, temp);
+    }
+    ReleaseStrings(context, ptr, packed);
+  }
+  auto store = context.builder.CreateStore(v, ptr);
+  if (packed)
+    store->setAlignment(1);
+  return store;
+}
+
+// a + b + ... on strings and chars: the total length is known before anything is copied, so the result
+// is allocated once (or not at all when it fits in the value) and every part is copied straight into it
+static Value *ConcatStrings(CodeGenContext &context, const std::vector<Value *> &parts) {
+  std::string text, all;
+  bool constant = true;
+  for (auto part : parts) {
+    constant = constant && GetLiteralText(context, part, text);
+    all += text;
+  }
+  if (constant)
+    return GetStringLiteral(context, all);
+
+  Type *i32 = Type::getInt32Ty(MyContext), *i64 = Type::getInt64Ty(MyContext);
+  StructType *stringType = GetStringType(context);
+  std::vector<Value *> data, lengths;
+  Value *total = ConstantInt::get(i32, 0);
+  for (auto part : parts) {
+    if (IsString(context, part->getType())) {
+      data.push_back(StringData(context, part));
+      lengths.push_back(StringLength(context, part));
+    } else if (part->getType()->isIntegerTy(8)) {
+      data.push_back(nullptr);
+      lengths.push_back(ConstantInt::get(i32, 1));
+    } else {
+      std::cerr << "only strings and chars can be concatenated" << std::endl;
+      std::exit(1);
+    }
+    total = context.builder.CreateNSWAdd(total, lengths.back());
+  }
+
+  AllocaInst *result = CreateEntryAlloca(context, stringType);
+  auto zero = ConstantInt::get(i32, 0);
+  Value *inlineData = context.builder.CreateGEP(stringType, result, {zero, ConstantInt::get(i32, 2), zero});
+  llvm::FunctionCallee malloc = context.module->getOrInsertFunction(
+          "malloc", llvm::FunctionType::get(Type::getInt8PtrTy(MyContext), {i64}, false));
+  Value *dest, *heap;
+  auto constTotal = llvm::dyn_cast<ConstantInt>(total);
+  if (constTotal && constTotal->getZExtValue() <= StringInlineCapacity) {
+    dest = inlineData;
+    heap = Constant::getNullValue(Type::getInt8PtrTy(MyContext));
+  } else if (constTotal) {
+    dest = heap = context.builder.CreateCall(malloc, {ConstantInt::get(i64, constTotal->getZExtValue())});
+    context.builder.CreateStore(ConstantInt::get(Type::getInt8Ty(MyContext), 1), inlineData);
+  } else {
+    Function *currentFunction = context.blocksStack.top()->function;
+    BasicBlock *bheap = BasicBlock::Create(MyContext, "concatHeap", currentFunction);
+    BasicBlock *bcopy = BasicBlock::Create(MyContext, "concatCopy", currentFunction);
+    BasicBlock *bshort = context.currentBlock();
+    Value *fits = context.builder.CreateICmp(llvm::CmpInst::ICMP_ULE, total,
+                                             ConstantInt::get(i32, StringInlineCapacity));
+    context.builder.CreateCondBr(fits, bcopy, bheap);
+    context.builder.SetInsertPoint(bheap);
+    Value *allocated = context.builder.CreateCall(malloc, {context.builder.CreateZExt(total, i64)});
+    context.builder.CreateStore(ConstantInt::get(Type::getInt8Ty(MyContext), 1), inlineData);
+    context.builder.CreateBr(bcopy);
+    context.builder.SetInsertPoint(bcopy);
+    auto destPhi = context.builder.CreatePHI(Type::getInt8PtrTy(MyContext), 2);
+    destPhi->addIncoming(inlineData, bshort);
+    destPhi->addIncoming(allocated, bheap);
+    auto heapPhi = context.builder.CreatePHI(Type::getInt8PtrTy(MyContext), 2);
+    heapPhi->addIncoming(Constant::getNullValue(Type::getInt8PtrTy(MyContext)), bshort);
+    heapPhi->addIncoming(allocated, bheap);
+    dest = destPhi;
+    heap = heapPhi;
+  }
+
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Function *memcpy = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::memcpy, {bytes, bytes, i64});
+  Value *offset = ConstantInt::get(i64, 0);
+  for (size_t i = 0; i < parts.size(); i++) {
+    Value *to = context.builder.CreateGEP(Type::getInt8Ty(MyContext), dest, offset);
+    Value *length = context.builder.CreateZExt(lengths[i], i64);
+    if (data[i])
+      context.builder.CreateCall(memcpy, {to, data[i], length, ConstantInt::getFalse(MyContext)});
+    else
+      context.builder.CreateStore(parts[i], to);
+    offset = context.builder.CreateAdd(offset, length);
+  }
+  context.builder.CreateStore(heap, context.builder.CreateStructGEP(stringType, result, 0));
+  context.builder.CreateStore(total, context.builder.CreateStructGEP(stringType, result, 1));
+  return CreateLoad(context, result);
+}
+
+// compares the common prefix with memcmp, then the lengths
+static Value *CompareStrings(CodeGenContext &context, decltype(Expression::type) type, Value *a, Value *b) {
+  Type *i32 = Type::getInt32Ty(MyContext), *i64 = Type::getInt64Ty(MyContext);
+  Value *lengthA = StringLength(context, a), *lengthB = StringLength(context, b);
+  Value *shorter = context.builder.CreateICmp(llvm::CmpInst::ICMP_ULT, lengthA, lengthB);
+  Value *common = context.builder.CreateSelect(shorter, lengthA, lengthB);
+  llvm::FunctionCallee memcmp = context.module->getOrInsertFunction(
+          "memcmp", llvm::FunctionType::get(i32, {Type::getInt8PtrTy(MyContext), Type::getInt8PtrTy(MyContext), i64},
+                                            false));
+  Value *prefix = context.builder.CreateCall(memcmp, {StringData(context, a), StringData(context, b),
+                                                      context.builder.CreateZExt(common, i64)});
+  Value *samePrefix = context.builder.CreateICmp(llvm::CmpInst::ICMP_EQ, prefix, ConstantInt::get(i32, 0));
+  Value *lengthOrder = context.builder.CreateSub(lengthA, lengthB);
+  Value *order = context.builder.CreateSelect(samePrefix, lengthOrder, prefix);
+  llvm::CmpInst::Predicate predicate;
+  switch (type) {
+    case Expression::T_EQ:
+      predicate = llvm::CmpInst::ICMP_EQ;
+      break;
+    case Expression::T_NE:
+      predicate = llvm::CmpInst::ICMP_NE;
+      break;
+    case Expression::T_LT:
+      predicate = llvm::CmpInst::ICMP_SLT;
+      break;
+    case Expression::T_GT:
+      predicate = llvm::CmpInst::ICMP_SGT;
+      break;
+    case Expression::T_LE:
+      predicate = llvm::CmpInst::ICMP_SLE;
+      break;
+    default:
+      predicate = llvm::CmpInst::ICMP_SGE;
+      break;
+  }
+  return context.builder.CreateICmp(predicate, order, ConstantInt::get(i32, 0));
+}
+
+// Names the statements under node use as variables, and the routines they call.
+static void CollectNames(Node *node, std::set<std::string> &names, std::set<std::string> &calls) {
+  if (!node)
+    return;
+  if (auto a = dynamic_cast<AssignStmt *>(node)) {
+    names.insert(a->id);
+  } else if (auto f = dynamic_cast<ForStmt *>(node)) {
+    names.insert(f->loopId);
+  } else if (auto s = dynamic_cast<ProcStmt *>(node)) {
+    if (s->type == ProcStmt::T_SIMPLE || s->type == ProcStmt::T_SIMPLE_ARGS)
+      calls.insert(s->procId);
+  } else if (auto f = dynamic_cast<Factor *>(node)) {
+    if (f->type == Factor::T_NAME) {
+      names.insert(f->name);
+      calls.insert(f->name);
+    } else if (f->type == Factor::T_NAME_ARGS) {
+      calls.insert(f->name);
+    } else if (f->type == Factor::T_ID_EXPR || f->type == Factor::T_ID_DOT_ID) {
+      names.insert(f->id);
+    }
+  }
+  for (auto child : node->getChildren())
+    CollectNames(child, names, calls);
+}
+
 llvm::Value *Program::codeGen(CodeGenContext &context) {
     if (routine)
         routine->codeGen(context);
@@ -101,6 +1012,9 @@ llvm::Value *Program::codeGen(CodeGenContext &context) {
 }
 
 llvm::Value *Routine::codeGen(CodeGenContext &context) {
+    std::set<std::string> calls;
+    CollectNames(routineHead->routinePart, context.sharedGlobals, calls);
+    context.blocksStack.top()->body = routineBody;
     routineHead->codeGen(context);
     routineBody->codeGen(context);
     return nullptr;
@@ -125,6 +1039,7 @@ llvm::Value *ConstExprList::codeGen(CodeGenContext &context) {
     if (preList) preList->codeGen(context);
     auto var = value->codeGen(context);
     context.local()[name] = var;
+    context.reference().erase(name);
     addToConstTable(context.constTable);
     return var;
 }
@@ -140,6 +1055,9 @@ void ConstExprList::addToConstTable(ConstTable &table) {
         case ConstValue::T_CHAR:
             table.addChar(name, value->value[0]);
             break;
+        case ConstValue::T_STRING:
+            table.addString(name, value->value);
+            break;
         default:
             std::cerr << fmt::format("ConstExprList::addToConstTable failed: unimplemented type {}\n", value->type);
             break;
@@ -168,6 +1086,8 @@ llvm::Value *ConstValue::codeGen(CodeGenContext &context) {
             else if (value == "false")
                 return ConstantInt::get(Type::getInt1Ty(MyContext), 0, true);
             return nullptr;
+        case ConstValue::T_STRING:
+            return GetStringLiteral(context, value);
         default:
             return nullptr;
     }
@@ -200,6 +1120,7 @@ llvm::Value *TypeDefinition::codeGen(CodeGenContext &context) {
             break;
         }
         case TypeDecl::T_ARRAY_TYPE_DECLARE:
+        case TypeDecl::T_SET_TYPE_DECLARE:
             context.type()[name] = typeDecl;
             break;
         case TypeDecl::T_RECORD_TYPE_DECLARE:
@@ -213,10 +1134,9 @@ llvm::Value *TypeDefinition::codeGen(CodeGenContext &context) {
 }
 
 llvm::Value *VarPart::codeGen(CodeGenContext &context) {
-    if (varDeclList) {
+    if (varDeclList)
         varDeclList->codeGen(context);
-        context.isGlobal = false;
-    }
+    context.isGlobal = false;
     return nullptr;
 }
 
@@ -226,6 +1146,117 @@ llvm::Value *VarDeclList::codeGen(CodeGenContext &context) {
     return varDecl->codeGen(context);
 }
 
+// The debugger's view of a value of type t stored as type: arrays keep their index range and
+// records their field names; anything else is described by its storage.
+static DIType *GetDebugType(CodeGenContext &context, TypeDecl *t, Type *type) {
+    if (t && context.debugTypes.count(t))
+        return context.debugTypes[t];
+    DIBuilder &builder = *context.debugBuilder;
+    const DataLayout &layout = context.module->getDataLayout();
+    uint64_t bits = type->isSized() ? layout.getTypeAllocSizeInBits(type) : 0;
+    uint32_t align = type->isSized() ? layout.getABITypeAlignment(type) * 8 : 0;
+    TypeDecl *resolved = ResolveType(context, t);
+    DIType *result;
+    if (resolved != t) {
+        result = builder.createTypedef(GetDebugType(context, resolved, type), t->simpleTypeDecl->name,
+                                       context.debugFile, resolved->line, context.debugFile);
+    } else if (t && t->type == TypeDecl::T_ARRAY_TYPE_DECLARE && t->arrayTypeDecl->range &&
+               !BitPackedSize(context, t->arrayTypeDecl)) {
+        Metadata *range = builder.getOrCreateSubrange(t->arrayTypeDecl->getLowerBound(context.constTable),
+                                                      type->getArrayNumElements());
+        result = builder.createArrayType(bits, align,
+                                         GetDebugType(context, t->arrayTypeDecl->elementType,
+                                                      type->getArrayElementType()),
+                                         builder.getOrCreateArray(range));
+    } else if (t && t->type == TypeDecl::T_RECORD_TYPE_DECLARE) {
+        auto record = cast<StructType>(type);
+        const StructLayout *fields = layout.getStructLayout(record);
+        std::vector<Metadata *> members;
+        unsigned k = 0;
+        for (FieldDeclList *f = t->recordTypeDecl->fieldDeclList; f; f = f->preList) {
+            for (NameList *n = f->fieldDecl->nameList; n; n = n->nameList, k++) {
+                Type *field = record->getElementType(k);
+                members.push_back(builder.createMemberType(
+                        context.debugFile, n->name, context.debugFile, f->fieldDecl->line,
+                        layout.getTypeAllocSizeInBits(field), layout.getABITypeAlignment(field) * 8,
+                        fields->getElementOffsetInBits(k), DINode::FlagZero,
+                        GetDebugType(context, f->fieldDecl->typeDecl, field)));
+            }
+        }
+        result = builder.createStructType(context.debugFile, "record", context.debugFile, t->line, bits, align,
+                                          DINode::FlagZero, nullptr, builder.getOrCreateArray(members));
+    } else if (type->isIntegerTy(1)) {
+        result = builder.createBasicType("boolean", 8, dwarf::DW_ATE_boolean);
+    } else if (type->isIntegerTy(8)) {
+        result = builder.createBasicType("char", 8, dwarf::DW_ATE_unsigned_char);
+    } else if (type->isIntegerTy()) {
+        result = builder.createBasicType("integer", bits, dwarf::DW_ATE_signed);
+    } else if (type->isDoubleTy()) {
+        result = builder.createBasicType("real", bits, dwarf::DW_ATE_float);
+    } else if (type->isArrayTy()) {
+        // sets and packed boolean arrays: the words holding their bits
+        Metadata *range = builder.getOrCreateSubrange(0, type->getArrayNumElements());
+        result = builder.createArrayType(bits, align, GetDebugType(context, nullptr, type->getArrayElementType()),
+                                         builder.getOrCreateArray(range));
+    } else if (type->isPointerTy()) {
+        result = builder.createPointerType(GetDebugType(context, nullptr, type->getPointerElementType()),
+                                           layout.getPointerSizeInBits());
+    } else if (auto structType = dyn_cast<StructType>(type)) {
+        std::vector<Metadata *> members;
+        const StructLayout *fields = layout.getStructLayout(structType);
+        for (unsigned k = 0; k < structType->getNumElements(); k++) {
+            Type *field = structType->getElementType(k);
+            members.push_back(builder.createMemberType(
+                    context.debugFile, "_" + std::to_string(k), context.debugFile, 0,
+                    layout.getTypeAllocSizeInBits(field), layout.getABITypeAlignment(field) * 8,
+                    fields->getElementOffsetInBits(k), DINode::FlagZero, GetDebugType(context, nullptr, field)));
+        }
+        result = builder.createStructType(context.debugFile, IsString(context, type) ? "string" : "", context.debugFile,
+                                          0, bits, align, DINode::FlagZero, nullptr, builder.getOrCreateArray(members));
+    } else {
+        result = builder.createUnspecifiedType("unknown");
+    }
+    if (t)
+        context.debugTypes[t] = result;
+    return result;
+}
+
+// Describes a variable to the debugger (-g): storage is its global, its alloca or, for
+// parameters passed by address, where that address is kept.
+static void DeclareVariable(CodeGenContext &context, Value *storage, const std::string &name, TypeDecl *t,
+                            int line, unsigned argNo, bool reference) {
+    if (!context.options.debugInfo)
+        return;
+    DIBuilder &builder = *context.debugBuilder;
+    Type *type = storage->getType()->getPointerElementType();
+    if (reference)
+        type = type->getPointerElementType();
+    DIType *debugType = GetDebugType(context, t, type);
+    if (auto global = dyn_cast<GlobalVariable>(storage)) {
+        global->addDebugInfo(builder.createGlobalVariableExpression(context.compileUnit, name, name, context.debugFile,
+                                                                    line, debugType, true));
+        return;
+    }
+    DISubprogram *scope = context.blocksStack.top()->function->getSubprogram();
+    DILocalVariable *variable =
+            argNo ? builder.createParameterVariable(scope, name, argNo, context.debugFile, line, debugType, true)
+                  : builder.createAutoVariable(scope, name, context.debugFile, line, debugType, true);
+    auto location = DILocation::get(MyContext, line, 0, scope);
+    uint64_t deref[] = {dwarf::DW_OP_deref};
+    if (isa<Argument>(storage)) {
+        // an array or record used in place where the caller has it
+        builder.insertDbgValueIntrinsic(storage, variable, builder.createExpression(deref), location,
+                                        context.currentBlock());
+    } else {
+        builder.insertDeclare(storage, variable,
+                              builder.createExpression(reference ? ArrayRef<uint64_t>(deref) : ArrayRef<uint64_t>()),
+                              location, context.currentBlock());
+    }
+}
+
+// Main-program variables no routine uses by name live in main's frame, up to --stack-threshold bytes;
+// larger ones stay globals rather than grow the stack. Larger locals of routines are left for
+// CodeGenContext::placeLargeLocals to move to the arena.
 llvm::Value *VarDecl::codeGen(CodeGenContext &context) {
     NameList *n = nameList;
     while (n) {
@@ -235,15 +1266,41 @@ llvm::Value *VarDecl::codeGen(CodeGenContext &context) {
             exit(1);
         } else {
             Value *alloc;
-            if (context.isGlobal) {
+            uint64_t size = context.module->getDataLayout().getTypeAllocSize(t);
+            if (context.isGlobal && !context.sharedGlobals.count(n->name) && size <= (uint64_t) context.options.stackThreshold) {
+                // main-program variables start out zeroed, as they did as globals
+                alloc = context.builder.CreateAlloca(t, nullptr, n->name);
+                if (t->isAggregateType()) {
+                    Type *bytes = Type::getInt8PtrTy(MyContext);
+                    Type *i64 = Type::getInt64Ty(MyContext);
+                    Function *memset = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::memset,
+                                                                       {bytes, i64});
+                    context.builder.CreateCall(memset, {context.builder.CreateBitCast(alloc, bytes),
+                                                        ConstantInt::get(Type::getInt8Ty(MyContext), 0),
+                                                        ConstantInt::get(i64, size), ConstantInt::getFalse(MyContext)});
+                } else {
+                    context.builder.CreateStore(Constant::getNullValue(t), alloc);
+                }
+            } else if (context.isGlobal) {
                 auto zero = Constant::getNullValue(t);
                 alloc = new llvm::GlobalVariable(*context.module, t, false,
-                        llvm::GlobalValue::ExternalLinkage, zero, n->name);
+                        llvm::GlobalValue::InternalLinkage, zero, n->name);
             } else {
-                alloc = new AllocaInst(t, 0, n->name, context.currentBlock());
+                alloc = context.builder.CreateAlloca(t, nullptr, n->name);
+                if (size > (uint64_t) context.options.stackThreshold)
+                    context.largeLocals.push_back(llvm::cast<AllocaInst>(alloc));
+                if (IsDynamicArray(context, typeDecl)) {
+                    context.builder.CreateStore(Constant::getNullValue(t), alloc);
+                    context.blocksStack.top()->dynamicArrays.push_back(alloc);
+                } else if (HasStrings(context, t)) {
+                    context.builder.CreateStore(Constant::getNullValue(t), alloc);
+                    context.blocksStack.top()->strings.push_back(alloc);
+                }
             }
             context.local()[n->name] = alloc;
             context.varType()[n->name] = typeDecl;
+            context.reference().erase(n->name);
+            DeclareVariable(context, alloc, n->name, typeDecl, line, 0, false);
 
             if (typeDecl->type == TypeDecl::T_SIMPLE_TYPE_DECLARE &&
                 typeDecl->simpleTypeDecl->type == SimpleTypeDecl::T_TYPE_NAME) {
@@ -264,6 +1321,8 @@ llvm::Type *TypeDecl::getType(CodeGenContext &context, std::string name) {
         return arrayTypeDecl->getType(context);
     else if (type == T_RECORD_TYPE_DECLARE)
         return recordTypeDecl->getType(context, name);
+    else if (type == T_SET_TYPE_DECLARE)
+        return setTypeDecl->getType(context);
     return nullptr;
 };
 
@@ -278,6 +1337,8 @@ llvm::Type *SimpleTypeDecl::getType(CodeGenContext &context) {
               return llvm::Type::getInt32Ty(MyContext);
             else if (sysType == "real")
               return llvm::Type::getDoubleTy(MyContext);
+            else if (sysType == "string")
+              return GetStringType(context);
             else
               return nullptr;
         }
@@ -308,11 +1369,80 @@ llvm::Type *SimpleTypeDecl::getType(CodeGenContext &context) {
     return nullptr;
 };
 
+// Dynamic arrays are owned by the variable holding them, so they cannot sit inside other arrays or records.
+static void CheckNotDynamicArray(CodeGenContext &context, TypeDecl *t) {
+  if (IsDynamicArray(context, t)) {
+    std::cerr << "dynamic arrays can only be variables and parameters" << std::endl;
+    std::exit(1);
+  }
+}
+
 llvm::Type *ArrayTypeDecl::getType(CodeGenContext &context) {
+    CheckNotDynamicArray(context, elementType);
+    if (!range) {
+        if (packed) {
+            std::cerr << "dynamic array cannot be packed" << std::endl;
+            std::exit(1);
+        }
+        // the runtime copies and frees blocks as plain bytes, which would leave strings with two owners or none
+        if (HasStrings(context, elementType->getType(context, ""))) {
+            std::cerr << "dynamic array cannot hold strings" << std::endl;
+            std::exit(1);
+        }
+        Type *i64 = llvm::Type::getInt64Ty(MyContext);
+        Type *elements = llvm::ArrayType::get(elementType->getType(context, ""), 0);
+        return StructType::get(MyContext, {i64, i64, elements})->getPointerTo();
+    }
+    if (int64_t bits = BitPackedSize(context, this))
+        return llvm::ArrayType::get(llvm::Type::getInt64Ty(MyContext), (bits + 63) / 64);
     return llvm::ArrayType::get(elementType->getType(context, ""), range->getRange(context.constTable));
 }
 
 
+static int64_t GetOrdinalBound(CodeGenContext &context, ConstValue *value, const std::string &name) {
+  Value *bound = nullptr;
+  if (value)
+    bound = value->codeGen(context);
+  else if (context.constTable.isConst(name))
+    bound = context.isVariable(name)->locals[name];
+  auto c = llvm::dyn_cast_or_null<ConstantInt>(bound);
+  if (!c) {
+    std::cerr << "set bound must be an ordinal constant: " << (value ? value->value : name) << std::endl;
+    std::exit(1);
+  }
+  return c->getBitWidth() < 32 ? c->getZExtValue() : c->getSExtValue();
+}
+
+llvm::Type *SetTypeDecl::getType(CodeGenContext &context) {
+    SimpleTypeDecl *base = baseType;
+    while (base->type == SimpleTypeDecl::T_TYPE_NAME && base->name != "char" && base->name != "boolean") {
+        auto b = context.isType(base->name);
+        TypeDecl *t = b ? b->types[base->name] : nullptr;
+        if (!t || t->type != TypeDecl::T_SIMPLE_TYPE_DECLARE || t->simpleTypeDecl == base) {
+            std::cerr << "set base type must be an ordinal type: " << base->name << std::endl;
+            std::exit(1);
+        }
+        base = t->simpleTypeDecl;
+    }
+    int64_t lower, upper;
+    if (base->type == SimpleTypeDecl::T_RANGE) {
+        lower = GetOrdinalBound(context, base->lowerBound, "");
+        upper = GetOrdinalBound(context, base->upperBound, "");
+    } else if (base->type == SimpleTypeDecl::T_NAME_RANGE) {
+        lower = GetOrdinalBound(context, nullptr, base->lowerName);
+        upper = GetOrdinalBound(context, nullptr, base->upperName);
+    } else {
+        std::string name = base->type == SimpleTypeDecl::T_SYS_TYPE ? base->sysType : base->name;
+        lower = 0;
+        upper = name == "char" ? 255 : name == "boolean" ? 1 : -1;
+    }
+    if (lower < 0 || upper < lower || upper > MaxSetOrdinal) {
+        std::cerr << "set base type must lie within 0.." << MaxSetOrdinal << std::endl;
+        std::exit(1);
+    }
+    return GetSetConstant(std::vector<uint64_t>(upper / 64 + 1, 0))->getType();
+}
+
 llvm::Type *RecordTypeDecl::getType(CodeGenContext &context, std::string &name) {
     if (context.module->getTypeByName(name))
         return context.module->getTypeByName(name);
@@ -320,6 +1450,7 @@ llvm::Type *RecordTypeDecl::getType(CodeGenContext &context, std::string &name)
     std::vector<Type *> argList;
     while (f) {
         NameList *n = f->fieldDecl->nameList;
+        CheckNotDynamicArray(context, f->fieldDecl->typeDecl);
         while (n) {
             argList.push_back(f->fieldDecl->typeDecl->getType(context, ""));
             n = n->nameList;
@@ -328,9 +1459,9 @@ llvm::Type *RecordTypeDecl::getType(CodeGenContext &context, std::string &name)
     }
     StructType *structType;
     if (!name.empty())
-        structType = StructType::create(MyContext, makeArrayRef(argList), name);
+        structType = StructType::create(MyContext, makeArrayRef(argList), name, packed);
     else
-        structType = StructType::create(MyContext, makeArrayRef(argList));
+        structType = StructType::create(MyContext, makeArrayRef(argList), "", packed);
     return structType;
 }
 
@@ -350,38 +1481,481 @@ llvm::Value *RoutinePart::codeGen(CodeGenContext &context) {
     return nullptr;
 }
 
-llvm::Value *FunctionDecl::codeGen(CodeGenContext &context) {
-    CodeGenBlock *parent = context.blocksStack.top();
-    std::vector<Type *> argTypes;
-    ParaDeclList *p = functionHead->parameters->paraDeclList;
-    while (p) {
-        NameList *n;
-        if (p->paraTypeList->type == ParaTypeList::T_VAL) {
-            n = p->paraTypeList->valParaList->nameList;
-            while (n) {
-                argTypes.push_back(p->paraTypeList->typeDecl->getType(context));
-                n = n->nameList;
-            }
-        } else {
-            n = p->paraTypeList->varParaList->nameList;
-            while (n) {
-                argTypes.push_back(Type::getInt32PtrTy(MyContext));
-                n = n->nameList;
-            }
-        }
+// The factor an argument consists of when it names a variable, an element or a field, else null.
+static Factor *AsVariable(Expression *e) {
+  if (!e || e->type != Expression::T_EXPR || e->expr->type != Expr::T_TERM || e->expr->term->type != Term::T_FACTOR)
+    return nullptr;
+  Factor *f = e->expr->term->factor;
+  if (f->type != Factor::T_NAME && f->type != Factor::T_ID_DOT_ID && f->type != Factor::T_ID_EXPR)
+    return nullptr;
+  return f;
+}
 
-        p = p->paraDeclList;
+static std::string VariableName(Factor *f) {
+  if (!f)
+    return "";
+  if (f->type == Factor::T_NAME)
+    return f->name;
+  if (f->type == Factor::T_ID_DOT_ID || f->type == Factor::T_ID_EXPR)
+    return f->id;
+  return "";
+}
+
+// The address of the variable, element or field f names.
+static Value *GetVariableRef(CodeGenContext &context, Factor *f) {
+  if (f->type == Factor::T_ID_DOT_ID)
+    return GetRecordRef(context, f->id, f->recordId);
+  if (f->type == Factor::T_ID_EXPR)
+    return GetArrayRef(context, f->id, f->indexList);
+  CodeGenBlock *b = context.isVariable(f->name);
+  if (!b) {
+    std::cerr << "undeclared variable: " << f->name << std::endl;
+    std::exit(1);
+  }
+  if (context.isReference(f->name))
+    return CreateLoad(context, b->locals[f->name]);
+  return b->locals[f->name];
+}
+
+// Arrays and records are passed by address even as value parameters; a dynamic array passes its handle.
+static bool IsAggregate(CodeGenContext &context, TypeDecl *t) {
+  t = ResolveType(context, t);
+  return t && ((t->type == TypeDecl::T_ARRAY_TYPE_DECLARE && t->arrayTypeDecl->range) ||
+               t->type == TypeDecl::T_RECORD_TYPE_DECLARE);
+}
+
+static Type *GetParameterType(CodeGenContext &context, ParaTypeList *p) {
+  Type *t = p->typeDecl->getType(context);
+  TypeDecl decl(p->typeDecl);
+  if (p->type == ParaTypeList::T_VAR || IsAggregate(context, &decl))
+    return t->getPointerTo();
+  return t;
+}
+
+// dest, which holds no value yet, becomes a copy of the array or record at src, with strings of its own.
+static void InitAggregate(CodeGenContext &context, Value *dest, Value *src, Type *type, bool packed) {
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Type *i64 = Type::getInt64Ty(MyContext);
+  Function *memcpy = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::memcpy, {bytes, bytes, i64});
+  context.builder.CreateCall(memcpy, {context.builder.CreateBitCast(dest, bytes),
+                                      context.builder.CreateBitCast(src, bytes),
+                                      ConstantInt::get(i64, context.module->getDataLayout().getTypeAllocSize(type)),
+                                      ConstantInt::getFalse(MyContext)});
+  if (HasStrings(context, type))
+    CopyStrings(context, dest, packed);
+}
+
+// dest := src for arrays and records. The strings dest held are freed first, unless src is dest itself.
+static void CopyAggregate(CodeGenContext &context, Value *dest, Value *src, Type *type, bool packed) {
+  if (!HasStrings(context, type)) {
+    InitAggregate(context, dest, src, type, packed);
+    return;
+  }
+  if (dest == src)
+    return;
+  Function *function = context.blocksStack.top()->function;
+  BasicBlock *bcopy = BasicBlock::Create(MyContext, "aggregateCopy", function);
+  BasicBlock *bdone = BasicBlock::Create(MyContext, "aggregateCopied", function);
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Value *same = context.builder.CreateICmpEQ(context.builder.CreateBitCast(dest, bytes),
+                                             context.builder.CreateBitCast(src, bytes));
+  context.builder.CreateCondBr(same, bdone, bcopy);
+  context.builder.SetInsertPoint(bcopy);
+  ReleaseStrings(context, dest, packed);
+  InitAggregate(context, dest, src, type, packed);
+  context.builder.CreateBr(bdone);
+  context.builder.SetInsertPoint(bdone);
+}
+
+// Whether a call to routine passes the variable name (or part of it) as a var argument. Calls to
+// routines not declared yet are assumed to.
+static bool PassesByReference(CodeGenContext &context, const std::string &routine, ArgsList *argsList,
+                              const std::string &name) {
+  auto callee = context.funcParams.find(routine);
+  int k = 0;
+  for (auto p = argsList; p; p = p->preList, k++) {
+    if (VariableName(AsVariable(p->expression)) != name)
+      continue;
+    if (callee == context.funcParams.end())
+      return true;
+    auto &position = callee->second.position;
+    if (std::find(position.begin(), position.end(), k) != position.end())
+      return true;
+  }
+  return false;
+}
+
+// The variable setlength(a, ...) resizes; empty for any other statement.
+static std::string ResizedArray(ProcStmt *s) {
+  if (s->type != ProcStmt::T_SYS_PROC_EXPR || s->sysProc != "setlength")
+    return "";
+  ExpressionList *first = s->expressionList;
+  while (first && first->preList)
+    first = first->preList;
+  return first ? VariableName(AsVariable(first->expression)) : "";
+}
+
+// Whether the statements under node may write to the variable name, nested routines included.
+// A local of the same name in a nested routine counts too.
+static bool MayWrite(CodeGenContext &context, Node *node, const std::string &name) {
+  if (!node)
+    return false;
+  if (auto a = dynamic_cast<AssignStmt *>(node)) {
+    if (a->id == name)
+      return true;
+  } else if (auto f = dynamic_cast<ForStmt *>(node)) {
+    if (f->loopId == name)
+      return true;
+  } else if (auto s = dynamic_cast<ProcStmt *>(node)) {
+    if (s->type == ProcStmt::T_READ && VariableName(s->factor) == name)
+      return true;
+    if (ResizedArray(s) == name)
+      return true;
+    if (s->type == ProcStmt::T_SIMPLE_ARGS && PassesByReference(context, s->procId, s->argsList, name))
+      return true;
+  } else if (auto f = dynamic_cast<Factor *>(node)) {
+    if (f->type == Factor::T_NAME_ARGS && PassesByReference(context, f->name, f->argsList, name))
+      return true;
+  }
+  for (auto child : node->getChildren())
+    if (MayWrite(context, child, name))
+      return true;
+  return false;
+}
+
+// Once the routine's var parameters are known: an aggregate value parameter the body may write to is
+// copied into a local, any other is used in place; pointer parameters that are never written to are
+// recorded as read-only for CodeGenContext::addParameterAttributes.
+static void BindPointerParameters(CodeGenContext &context, Function *function, SubRoutine *body,
+                                  const std::string &routine) {
+  auto &params = context.funcParams[routine];
+  for (auto &arg : function->args()) {
+    int i = arg.getArgNo();
+    std::string name = arg.getName().str();
+    if (std::find(params.aggregates.begin(), params.aggregates.end(), i) != params.aggregates.end()) {
+      Type *type = arg.getType()->getPointerElementType();
+      if (MayWrite(context, body, name)) {
+        AllocaInst *alloc = context.builder.CreateAlloca(type, nullptr, name + ".copy");
+        InitAggregate(context, alloc, &arg, type, false);
+        if (HasStrings(context, type))
+          context.blocksStack.top()->strings.push_back(alloc);
+        context.local()[name] = alloc;
+      } else {
+        context.local()[name] = &arg;
+      }
+      params.readOnly.push_back(i);
+    } else if (std::find(params.position.begin(), params.position.end(), i) != params.position.end() &&
+               !MayWrite(context, body, name)) {
+      params.readOnly.push_back(i);
     }
-    FunctionType *ftype = FunctionType::get(functionHead->returnType->getType(context), makeArrayRef(argTypes), false);
-    Function *function = Function::Create(ftype, llvm::GlobalValue::InternalLinkage, functionHead->name,
-                                          context.module);
-    BasicBlock *bblock = BasicBlock::Create(MyContext, "entry", function, nullptr);
-    context.pushBlock(bblock);
-    context.blocksStack.top()->function = function;
-    p = functionHead->parameters->paraDeclList;
-    llvm::Value *arg_value;
+  }
+}
+
+// The statements after which the routine returns: the last statement of its body and, recursively,
+// the last statements of if and case branches in that position.
+static void CollectTailStatements(Stmt *stmt, std::vector<NonLabelStmt *> &tails) {
+  if (!stmt || !stmt->nonLabelStmt)
+    return;
+  NonLabelStmt *s = stmt->nonLabelStmt;
+  switch (s->type) {
+    case NonLabelStmt::T_COMPOUND:
+      if (s->compoundStmt->stmtList)
+        CollectTailStatements(s->compoundStmt->stmtList->stmt, tails);
+      break;
+    case NonLabelStmt::T_IF:
+      CollectTailStatements(s->ifStmt->stmt, tails);
+      if (s->ifStmt->elseClause)
+        CollectTailStatements(s->ifStmt->elseClause->stmt, tails);
+      break;
+    case NonLabelStmt::T_CASE:
+      for (auto l = s->caseStmt->caseExprList; l; l = l->preList)
+        CollectTailStatements(l->caseExpr->stmt, tails);
+      CollectTailStatements(s->caseStmt->otherwise, tails);
+      break;
+    default:
+      tails.push_back(s);
+  }
+}
+
+// Mark `f := f(...)` and `p(...)` in tail position of routine f or p.
+static void FindTailCalls(CodeGenContext &context, SubRoutine *body, const std::string &routine) {
+  std::vector<NonLabelStmt *> tails;
+  if (body->routineBody->compoundStmt->stmtList)
+    CollectTailStatements(body->routineBody->compoundStmt->stmtList->stmt, tails);
+  for (auto s : tails) {
+    if (s->type == NonLabelStmt::T_PROC) {
+      ProcStmt *p = s->procStmt;
+      if ((p->type == ProcStmt::T_SIMPLE || p->type == ProcStmt::T_SIMPLE_ARGS) && p->procId == routine)
+        context.tailCalls.insert(p);
+    } else if (s->type == NonLabelStmt::T_ASSIGN) {
+      AssignStmt *a = s->assignStmt;
+      if (a->type != AssignStmt::T_SIMPLE || a->id != routine)
+        continue;
+      Expression *e = a->rhs;
+      if (e->type == Expression::T_EXPR && e->expr->type == Expr::T_TERM && e->expr->term->type == Term::T_FACTOR &&
+          e->expr->term->factor->type == Factor::T_NAME_ARGS && e->expr->term->factor->name == routine)
+        context.tailCalls.insert(a);
+    }
+  }
+}
+
+// Return straight from a self call found by FindTailCalls. The callee frame replaces the caller's,
+// so no argument may point into it, and no dynamic array or string may be left to release after
+// the call; such calls stay ordinary.
+static bool EmitTailCall(CodeGenContext &context, Value *v) {
+  auto call = llvm::dyn_cast<CallInst>(v);
+  CodeGenBlock *b = context.blocksStack.top();
+  if (!call || call != &context.currentBlock()->back() || !b->dynamicArrays.empty() || !b->strings.empty())
+    return false;
+  for (unsigned i = 0; i < call->arg_size(); i++) {
+    Value *base = call->getArgOperand(i);
+    while (auto gep = llvm::dyn_cast<GEPOperator>(base))
+      base = gep->getPointerOperand();
+    if (llvm::isa<AllocaInst>(base))
+      return false;
+  }
+  call->setTailCallKind(CallInst::TCK_MustTail);
+  Function *function = context.blocksStack.top()->function;
+  if (context.options.instrumentRoutines)
+    context.profileProbe("spl_prof_exit", context.routineIds[function])->moveBefore(call);
+  context.builder.CreateRet(call->getType()->isVoidTy() ? nullptr : call);
+  context.builder.SetInsertPoint(BasicBlock::Create(MyContext, "afterTailCall", function));
+  return true;
+}
+
+// Give the blocks of the routine's own dynamic arrays back to the runtime on the way out, and free the
+// heap bytes of the strings its variables hold. A function returning a dynamic array or strings hands
+// them to the caller.
+static void ReleaseLocals(CodeGenContext &context) {
+  for (Value *storage : context.blocksStack.top()->dynamicArrays) {
+    Type *handleType = storage->getType()->getPointerElementType();
+    Value *handle = context.builder.CreateBitCast(CreateLoad(context, storage), Type::getInt8PtrTy(MyContext));
+    CallArrayRuntime(context, "spl_array_free", Type::getVoidTy(MyContext),
+                     {handle, GetElementSize(context, handleType)});
+  }
+  for (Value *storage : context.blocksStack.top()->strings)
+    ReleaseStrings(context, storage, false);
+}
+
+// A dynamic array passed by value stays the caller's, which keeps using its block.
+static void CheckOwnArray(CodeGenBlock *b, const std::string &id) {
+  if (b->borrowedArrays.count(id)) {
+    std::cerr << "dynamic array value parameter cannot be resized or assigned, pass it as var: " << id << std::endl;
+    std::exit(1);
+  }
+}
+
+// The variables of the routines being generated that code about to be outlined from them uses, by
+// name or through routines it calls that capture them in turn. Globals are reached directly and
+// need no capture.
+static std::vector<Capture> FindCaptures(CodeGenContext &context, const std::set<std::string> &names,
+                                         const std::set<std::string> &calls) {
+  std::vector<Capture> captures;
+  auto add = [&](const Capture &capture) {
+    for (auto &c : captures)
+      if (c.variable == capture.variable)
+        return;
+    captures.push_back(capture);
+  };
+  for (auto &name : names) {
+    CodeGenBlock *b = context.isVariable(name);
+    if (!b || llvm::isa<Constant>(b->locals[name]))
+      continue;
+    add({b->locals[name], b->references.count(name) > 0, name, b->varTypes[name]});
+  }
+  for (auto &call : calls) {
+    auto callee = context.funcParams.find(call);
+    if (callee == context.funcParams.end())
+      continue;
+    for (auto capture : callee->second.captures) {
+      capture.name.clear();
+      add(capture);
+    }
+  }
+  return captures;
+}
+
+// The names a routine uses without declaring them: those in its statements and the ones its nested
+// routines use that way, less its own name, parameters, constants and variables.
+static void CollectFreeNames(SubRoutine *body, Parameters *parameters, const std::string &routine,
+                             std::set<std::string> &names, std::set<std::string> &calls) {
+  std::set<std::string> used;
+  CollectNames(body->routineBody, used, calls);
+  RoutineHead *head = body->routineHead;
+  for (auto r = head->routinePart; r; r = r->routinePart) {
+    if (r->functionDecl)
+      CollectFreeNames(r->functionDecl->subRoutine, r->functionDecl->functionHead->parameters,
+                       r->functionDecl->functionHead->name, used, calls);
+    if (r->procedureDecl)
+      CollectFreeNames(r->procedureDecl->subRoutine, r->procedureDecl->procedureHead->parameters,
+                       r->procedureDecl->procedureHead->name, used, calls);
+  }
+  used.erase(routine);
+  for (auto p = parameters->paraDeclList; p; p = p->paraDeclList) {
+    auto n = p->paraTypeList->type == ParaTypeList::T_VAL ? p->paraTypeList->valParaList->nameList
+                                                          : p->paraTypeList->varParaList->nameList;
+    for (; n; n = n->nameList)
+      used.erase(n->name);
+  }
+  for (auto c = head->constPart ? head->constPart->constExprList : nullptr; c; c = c->preList)
+    used.erase(c->name);
+  for (auto v = head->varPart ? head->varPart->varDeclList : nullptr; v; v = v->preList)
+    for (auto n = v->varDecl->nameList; n; n = n->nameList)
+      used.erase(n->name);
+  names.insert(used.begin(), used.end());
+}
+
+// What a routine about to be declared captures, by name in its body or nested routines.
+static std::vector<Capture> FindCaptures(CodeGenContext &context, SubRoutine *body, Parameters *parameters,
+                                         const std::string &routine) {
+  std::set<std::string> names, calls;
+  CollectFreeNames(body, parameters, routine, names, calls);
+  return FindCaptures(context, names, calls);
+}
+
+// Give each captured variable a slot holding the address passed for it, and make the ones used
+// by name references to that slot, like var parameters.
+static void BindCaptures(CodeGenContext &context, const std::vector<Capture> &captures,
+                         const std::vector<Value *> &addresses) {
+  for (size_t i = 0; i < captures.size(); i++) {
+    const Capture &capture = captures[i];
+    Value *address = addresses[i];
+    address->setName(capture.name.empty() ? "capture" : capture.name);
+    AllocaInst *slot = context.builder.CreateAlloca(address->getType(), nullptr, address->getName() + ".addr");
+    context.builder.CreateStore(address, slot);
+    context.blocksStack.top()->captures[capture.variable] = slot;
+    if (!capture.name.empty() && context.local().find(capture.name) == context.local().end()) {
+      context.local()[capture.name] = slot;
+      context.varType()[capture.name] = capture.type;
+      context.reference().insert(capture.name);
+    }
+  }
+}
+
+// The arguments of a routine from arg on.
+static std::vector<Value *> GetArguments(Function *function, Function::arg_iterator arg) {
+  std::vector<Value *> arguments;
+  for (; arg != function->arg_end(); ++arg)
+    arguments.push_back(&*arg);
+  return arguments;
+}
+
+// The address of a captured variable as seen from the routine being generated: its owner has it
+// at hand, any other routine received it as a captured-variable argument itself.
+static Value *GetCaptureAddress(CodeGenContext &context, const Capture &capture, const std::string &callee) {
+  Function *current = context.blocksStack.top()->function;
+  Value *variable = capture.variable;
+  Function *owner = llvm::isa<Argument>(variable) ? llvm::cast<Argument>(variable)->getParent()
+                                                  : llvm::cast<Instruction>(variable)->getFunction();
+  if (owner == current)
+    return capture.reference ? CreateLoad(context, variable) : variable;
+  for (auto b = context.blocksStack.top(); b && b->function == current; b = b->preBlock) {
+    auto slot = b->captures.find(variable);
+    if (slot != b->captures.end())
+      return CreateLoad(context, slot->second);
+  }
+  std::cerr << callee << " uses a variable of a routine it is not called from within: "
+            << variable->getName().str() << std::endl;
+  std::exit(1);
+}
+
+// The values a scalar value parameter is declared to hold, if that is a bounded ordinal type.
+static bool GetParameterRange(CodeGenContext &context, SimpleTypeDecl *t, int64_t &lower, int64_t &upper) {
+  while (t->type == SimpleTypeDecl::T_TYPE_NAME && t->name != "char" && t->name != "boolean") {
+    auto b = context.isType(t->name);
+    TypeDecl *d = b ? b->types[t->name] : nullptr;
+    if (!d || d->type != TypeDecl::T_SIMPLE_TYPE_DECLARE || d->simpleTypeDecl == t)
+      return false;
+    t = d->simpleTypeDecl;
+  }
+  if (t->type == SimpleTypeDecl::T_RANGE) {
+    lower = GetOrdinalBound(context, t->lowerBound, "");
+    upper = GetOrdinalBound(context, t->upperBound, "");
+  } else if (t->type == SimpleTypeDecl::T_NAME_RANGE) {
+    lower = GetOrdinalBound(context, nullptr, t->lowerName);
+    upper = GetOrdinalBound(context, nullptr, t->upperName);
+  } else {
+    std::string name = t->type == SimpleTypeDecl::T_SYS_TYPE ? t->sysType : t->name;
+    if (name != "char" && name != "boolean")
+      return false;
+    lower = 0;
+    upper = name == "char" ? 255 : 1;
+  }
+  return lower <= upper;
+}
+
+// Describes the parameters once BindPointerParameters has placed them; their argument numbers
+// follow the argument order.
+static void DeclareParameters(CodeGenContext &context, Parameters *parameters) {
+    unsigned argNo = 1;
+    for (ParaDeclList *p = parameters->paraDeclList; p; p = p->paraDeclList) {
+        bool reference = p->paraTypeList->type == ParaTypeList::T_VAR;
+        NameList *n = reference ? p->paraTypeList->varParaList->nameList : p->paraTypeList->valParaList->nameList;
+        for (; n; n = n->nameList)
+            DeclareVariable(context, context.local()[n->name], n->name, context.varType()[n->name],
+                            p->paraTypeList->line, argNo++, reference);
+    }
+}
+
+// The command line's fast-math flags plus those the routine asks for: `fastmath;` for all of them,
+// `fastmath(reassoc, contract);` for some.
+static FastMathFlags GetFastMathFlags(CodeGenContext &context, DirectiveList *directives, const std::string &routine) {
+  FastMathFlags flags = context.options.fastMath;
+  for (DirectiveList *d = directives; d; d = d->preList) {
+    if (d->name != "fastmath") {
+      std::cerr << "unknown directive " << d->name << " of " << routine << std::endl;
+      std::exit(1);
+    }
+    if (!d->arguments)
+      flags.setFast();
+    for (NameList *n = d->arguments; n; n = n->nameList) {
+      if (!AddFastMathFlag(flags, n->name)) {
+        std::cerr << "unknown fast-math flag " << n->name << " of " << routine << std::endl;
+        std::exit(1);
+      }
+    }
+  }
+  return flags;
+}
+
+llvm::Value *FunctionDecl::codeGen(CodeGenContext &context) {
+    // the routine is generated in the middle of its parent's code, which resumes where it stopped
+    IRBuilderBase::InsertPointGuard resume(context.builder);
+    IRBuilderBase::FastMathFlagGuard resumeFastMath(context.builder);
+    std::vector<Capture> captures = FindCaptures(context, subRoutine, functionHead->parameters, functionHead->name);
+    std::vector<Type *> argTypes;
+    ParaDeclList *p = functionHead->parameters->paraDeclList;
+    while (p) {
+        NameList *n;
+        if (p->paraTypeList->type == ParaTypeList::T_VAL) {
+            n = p->paraTypeList->valParaList->nameList;
+        } else {
+            n = p->paraTypeList->varParaList->nameList;
+        }
+        while (n) {
+            argTypes.push_back(GetParameterType(context, p->paraTypeList));
+            n = n->nameList;
+        }
+
+        p = p->paraDeclList;
+    }
+    for (auto &capture : captures)
+        argTypes.push_back(capture.reference ? capture.variable->getType()->getPointerElementType()
+                                             : capture.variable->getType());
+    FunctionType *ftype = FunctionType::get(functionHead->returnType->getType(context), makeArrayRef(argTypes), false);
+    Function *function = Function::Create(ftype, llvm::GlobalValue::InternalLinkage, functionHead->name,
+                                          context.module);
+    context.debugRoutine(function, functionHead->name, functionHead->line);
+    BasicBlock *bblock = BasicBlock::Create(MyContext, "entry", function, nullptr);
+    context.pushBlock(bblock);
+    context.blocksStack.top()->function = function;
+    context.blocksStack.top()->body = subRoutine->routineBody;
+    context.setFastMath(function, GetFastMathFlags(context, directives, functionHead->name));
+    p = functionHead->parameters->paraDeclList;
+    llvm::Value *arg_value;
     auto args_values = function->arg_begin();
-    std::vector<int> place;
+    std::vector<int> place, aggregates, arrays;
+    std::map<int, std::pair<int64_t, int64_t>> ranges;
     int i = 0;
     while (p) {
         NameList *n;
@@ -391,20 +1965,34 @@ llvm::Value *FunctionDecl::codeGen(CodeGenContext &context) {
             n = p->paraTypeList->varParaList->nameList;
         }
         while (n) {
+            args_values->setName(n->name);
+            TypeDecl declared(p->paraTypeList->typeDecl);
             if (p->paraTypeList->type == ParaTypeList::T_VAR) {
-                AllocaInst *alloc = new AllocaInst(Type::getInt32PtrTy(MyContext), 0, n->name,
-                                                   context.currentBlock());
+                AllocaInst *alloc = context.builder.CreateAlloca(args_values->getType(), nullptr, n->name);
                 context.local()[n->name] = alloc;
                 context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
                 context.reference().insert(n->name);
                 place.push_back(i);
-                new llvm::StoreInst(args_values, alloc, false, context.currentBlock());
+                context.builder.CreateStore(args_values, alloc);
+            } else if (IsAggregate(context, &declared)) {
+                // bound by BindPointerParameters
+                context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
+                aggregates.push_back(i);
             } else {
-                AllocaInst *alloc = new AllocaInst(p->paraTypeList->typeDecl->getType(context), 0, n->name,
-                                                   context.currentBlock());
+                AllocaInst *alloc = context.builder.CreateAlloca(p->paraTypeList->typeDecl->getType(context), nullptr,
+                                                                 n->name);
                 context.local()[n->name] = alloc;
                 context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
-                new llvm::StoreInst(args_values, alloc, false, context.currentBlock());
+                context.builder.CreateStore(args_values, alloc);
+                if (IsString(context, alloc->getAllocatedType()))
+                    context.blocksStack.top()->strings.push_back(alloc);
+                int64_t lower, upper;
+                if (GetParameterRange(context, p->paraTypeList->typeDecl, lower, upper))
+                    ranges[i] = {lower, upper};
+                if (IsDynamicArray(context, &declared)) {
+                    context.blocksStack.top()->borrowedArrays.insert(n->name);
+                    arrays.push_back(i);
+                }
             }
             i++;
             args_values++;
@@ -412,60 +2000,80 @@ llvm::Value *FunctionDecl::codeGen(CodeGenContext &context) {
         }
         p = p->paraDeclList;
     }
+    BindCaptures(context, captures, GetArguments(function, args_values));
     if (context.funcParams.find(functionHead->name) != context.funcParams.end()) {
         std::cout << "Error, redeclare function: " << functionHead->name;
         exit(0);
     }
     context.funcParams[functionHead->name].position = place;
-    AllocaInst *alloc = new AllocaInst(functionHead->returnType->getType(context), 0, functionHead->name,
-                                       context.currentBlock());
+    context.funcParams[functionHead->name].aggregates = aggregates;
+    context.funcParams[functionHead->name].arrays = arrays;
+    context.funcParams[functionHead->name].ranges = ranges;
+    context.funcParams[functionHead->name].captures = captures;
+    BindPointerParameters(context, function, subRoutine, functionHead->name);
+    DeclareParameters(context, functionHead->parameters);
+    FindTailCalls(context, subRoutine, functionHead->name);
+    AllocaInst *alloc = context.builder.CreateAlloca(functionHead->returnType->getType(context), nullptr,
+                                                     functionHead->name);
     context.local()[functionHead->name] = alloc;
     context.varType()[functionHead->name] = new TypeDecl(functionHead->returnType);
+    if (IsDynamicArray(context, context.varType()[functionHead->name]) ||
+        HasStrings(context, alloc->getAllocatedType()))
+        context.builder.CreateStore(Constant::getNullValue(alloc->getAllocatedType()), alloc);
+    DeclareVariable(context, alloc, functionHead->name, context.varType()[functionHead->name], functionHead->line,
+                    0, false);
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_enter",
+                             context.addProfiledRoutine(function, functionHead->name, functionHead->line));
 
     subRoutine->codeGen(context);
+    ReleaseLocals(context);
 
-    auto retVal = new LoadInst(alloc, "", false, context.currentBlock());
-    llvm::ReturnInst::Create(MyContext, retVal, context.currentBlock());
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_exit", context.routineIds[function]);
+    context.builder.CreateRet(CreateLoad(context, alloc));
     context.popBlock();
-
-    while (context.blocksStack.top() != parent)
-        context.popBlock();
-
     return function;
 }
 
 llvm::Value *ProcedureDecl::codeGen(CodeGenContext &context) {
-    CodeGenBlock *parent = context.blocksStack.top();
+    // the routine is generated in the middle of its parent's code, which resumes where it stopped
+    IRBuilderBase::InsertPointGuard resume(context.builder);
+    IRBuilderBase::FastMathFlagGuard resumeFastMath(context.builder);
+    std::vector<Capture> captures = FindCaptures(context, subRoutine, procedureHead->parameters, procedureHead->name);
     std::vector<Type *> argTypes;
     ParaDeclList *p = procedureHead->parameters->paraDeclList;
     while (p) {
         NameList *n;
         if (p->paraTypeList->type == ParaTypeList::T_VAL) {
             n = p->paraTypeList->valParaList->nameList;
-            while (n) {
-                argTypes.push_back(p->paraTypeList->typeDecl->getType(context));
-                n = n->nameList;
-            }
         } else {
             n = p->paraTypeList->varParaList->nameList;
-            while (n) {
-                argTypes.push_back(Type::getInt32PtrTy(MyContext));
-                n = n->nameList;
-            }
+        }
+        while (n) {
+            argTypes.push_back(GetParameterType(context, p->paraTypeList));
+            n = n->nameList;
         }
 
         p = p->paraDeclList;
     }
+    for (auto &capture : captures)
+        argTypes.push_back(capture.reference ? capture.variable->getType()->getPointerElementType()
+                                             : capture.variable->getType());
     FunctionType *ftype = FunctionType::get(Type::getVoidTy(MyContext), makeArrayRef(argTypes), false);
     Function *function = Function::Create(ftype, llvm::GlobalValue::InternalLinkage, procedureHead->name,
                                           context.module);
+    context.debugRoutine(function, procedureHead->name, procedureHead->line);
     BasicBlock *bblock = BasicBlock::Create(MyContext, "entry", function, nullptr);
     context.pushBlock(bblock);
     context.blocksStack.top()->function = function;
+    context.blocksStack.top()->body = subRoutine->routineBody;
+    context.setFastMath(function, GetFastMathFlags(context, directives, procedureHead->name));
     p = procedureHead->parameters->paraDeclList;
     llvm::Value *arg_value;
     auto args_values = function->arg_begin();
-    std::vector<int> place;
+    std::vector<int> place, aggregates, arrays;
+    std::map<int, std::pair<int64_t, int64_t>> ranges;
     int i = 0;
     while (p) {
         NameList *n;
@@ -475,20 +2083,34 @@ llvm::Value *ProcedureDecl::codeGen(CodeGenContext &context) {
             n = p->paraTypeList->varParaList->nameList;
         }
         while (n) {
+            args_values->setName(n->name);
+            TypeDecl declared(p->paraTypeList->typeDecl);
             if (p->paraTypeList->type == ParaTypeList::T_VAR) {
-                AllocaInst *alloc = new AllocaInst(Type::getInt32PtrTy(MyContext), 0, n->name,
-                                                   context.currentBlock());
+                AllocaInst *alloc = context.builder.CreateAlloca(args_values->getType(), nullptr, n->name);
                 context.local()[n->name] = alloc;
                 context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
                 context.reference().insert(n->name);
                 place.push_back(i);
-                new llvm::StoreInst(args_values, alloc, false, context.currentBlock());
+                context.builder.CreateStore(args_values, alloc);
+            } else if (IsAggregate(context, &declared)) {
+                // bound by BindPointerParameters
+                context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
+                aggregates.push_back(i);
             } else {
-                AllocaInst *alloc = new AllocaInst(p->paraTypeList->typeDecl->getType(context), 0, n->name,
-                                                   context.currentBlock());
+                AllocaInst *alloc = context.builder.CreateAlloca(p->paraTypeList->typeDecl->getType(context), nullptr,
+                                                                 n->name);
                 context.local()[n->name] = alloc;
                 context.varType()[n->name] = new TypeDecl(p->paraTypeList->typeDecl);
-                new llvm::StoreInst(args_values, alloc, false, context.currentBlock());
+                context.builder.CreateStore(args_values, alloc);
+                if (IsString(context, alloc->getAllocatedType()))
+                    context.blocksStack.top()->strings.push_back(alloc);
+                int64_t lower, upper;
+                if (GetParameterRange(context, p->paraTypeList->typeDecl, lower, upper))
+                    ranges[i] = {lower, upper};
+                if (IsDynamicArray(context, &declared)) {
+                    context.blocksStack.top()->borrowedArrays.insert(n->name);
+                    arrays.push_back(i);
+                }
             }
             i++;
             args_values++;
@@ -496,20 +2118,30 @@ llvm::Value *ProcedureDecl::codeGen(CodeGenContext &context) {
         }
         p = p->paraDeclList;
     }
+    BindCaptures(context, captures, GetArguments(function, args_values));
     if (context.funcParams.find(procedureHead->name) != context.funcParams.end()) {
         std::cout << "Error, redeclare procedure: " << procedureHead->name;
         exit(0);
     }
     context.funcParams[procedureHead->name].position = place;
+    context.funcParams[procedureHead->name].aggregates = aggregates;
+    context.funcParams[procedureHead->name].arrays = arrays;
+    context.funcParams[procedureHead->name].ranges = ranges;
+    context.funcParams[procedureHead->name].captures = captures;
+    BindPointerParameters(context, function, subRoutine, procedureHead->name);
+    DeclareParameters(context, procedureHead->parameters);
+    FindTailCalls(context, subRoutine, procedureHead->name);
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_enter",
+                             context.addProfiledRoutine(function, procedureHead->name, procedureHead->line));
 
     subRoutine->codeGen(context);
+    ReleaseLocals(context);
 
-    llvm::ReturnInst::Create(MyContext, nullptr, context.currentBlock());
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_exit", context.routineIds[function]);
+    context.builder.CreateRetVoid();
     context.popBlock();
-
-    while (context.blocksStack.top() != parent)
-        context.popBlock();
-
     return function;
 }
 
@@ -542,7 +2174,11 @@ llvm::Value *StmtList::codeGen(CodeGenContext &context) {
 }
 
 llvm::Value *Stmt::codeGen(CodeGenContext &context) {
+    // A nested statement sets its own position; the rest of this one goes back to this line.
+    DebugLoc outer = context.builder.getCurrentDebugLocation();
+    context.setDebugLocation(nonLabelStmt);
     nonLabelStmt->codeGen(context);
+    context.builder.SetCurrentDebugLocation(outer);
     return nullptr;
 }
 
@@ -572,10 +2208,10 @@ llvm::Value *NonLabelStmt::codeGen(CodeGenContext &context) {
 }
 
 void getPrintArgs(std::vector<llvm::Value *> &print_args, std::string &print_format, ExpressionList *p,
-                  CodeGenContext &context) {
+                  CodeGenContext &context, std::vector<llvm::Value *> &temporaries) {
     if (p) {
         if (p->preList)
-            getPrintArgs(print_args, print_format, p->preList, context);
+            getPrintArgs(print_args, print_format, p->preList, context, temporaries);
         auto arg_val = p->expression->codeGen(context);
         if (arg_val->getType() == llvm::Type::getInt32Ty(MyContext)) {
           print_format += "%d ";
@@ -589,9 +2225,13 @@ void getPrintArgs(std::vector<llvm::Value *> &print_args, std::string &print_for
         } else if (arg_val->getType() == Type::getInt1Ty(MyContext)) {
           print_format += "%d ";
             print_args.push_back(arg_val);
-        } else if (arg_val->getType() == llvm::Type::getInt8PtrTy(MyContext)) {
-            std::cerr << "print string not implemented" << std::endl;
-            std::exit(1);
+        } else if (IsString(context, arg_val->getType())) {
+            // printf copies the bytes straight into the stdout buffer
+          print_format += "%.*s ";
+            print_args.push_back(StringLength(context, arg_val));
+            print_args.push_back(StringData(context, arg_val));
+            if (IsFreshString(context, p->expression))
+                temporaries.push_back(arg_val);
         }
     }
 }
@@ -603,11 +2243,15 @@ void getReadArgs(std::vector<llvm::Value *> &read_args, std::string &read_format
         Type *type;
         switch (f->type) {
             case Factor::T_NAME: {
+                if (context.isLoopVariable(f->name)) {
+                    std::cerr << "for-loop control variable should not be read into: " << f->name << std::endl;
+                    std::exit(1);
+                }
                 arg_val = f->codeGen(context);
                 type = arg_val->getType();
                 auto b = context.isReference(f->name);
                 if (b) {
-                    arg_val = new LoadInst(context.isVariable(f->name)->locals[f->name], "", context.currentBlock());
+                    arg_val = CreateLoad(context, context.isVariable(f->name)->locals[f->name]);
                 } else {
                     arg_val = context.isVariable(
                             f->name)->locals[f->name];
@@ -621,8 +2265,8 @@ void getReadArgs(std::vector<llvm::Value *> &read_args, std::string &read_format
                 break;
             }
             case Factor::T_ID_EXPR: {
-                arg_val = GetArrayRef(context, f->id, f->expression);
-                type = context.isVariable(f->id)->varTypes[f->id]->arrayTypeDecl->elementType->getType(context, "");
+                arg_val = GetArrayRef(context, f->id, f->indexList);
+                type = arg_val->getType()->getPointerElementType();
                 break;
             }
             default:
@@ -642,9 +2286,34 @@ void getReadArgs(std::vector<llvm::Value *> &read_args, std::string &read_format
         } else if (type == Type::getInt1Ty(MyContext)) {
           read_format += "%d";
             read_args.push_back(arg_val);
-        } else if (type == llvm::Type::getInt8PtrTy(MyContext)) {
-            std::cerr << "read string not implemented" << std::endl;
-            std::exit(1);
+        } else if (IsString(context, type)) {
+            // one word of at most StringReadCapacity bytes, the rest of a longer one is left for the next
+            // read; the string gets its own copy of the buffer
+            Type *i32 = Type::getInt32Ty(MyContext), *i8 = Type::getInt8Ty(MyContext);
+            Type *bytePtr = Type::getInt8PtrTy(MyContext);
+            AllocaInst *buffer = CreateEntryAlloca(context, llvm::ArrayType::get(i8, StringReadCapacity + 1));
+            auto zero = ConstantInt::get(i32, 0);
+            Value *word = context.builder.CreateInBoundsGEP(buffer->getAllocatedType(), buffer, {zero, zero});
+            context.builder.CreateStore(ConstantInt::get(i8, 0), word);
+            std::string format = "%" + std::to_string(StringReadCapacity) + "s";
+            auto formatConst = llvm::ConstantDataArray::getString(MyContext, format, true);
+            auto formatVar = new llvm::GlobalVariable(*context.module, formatConst->getType(), true,
+                                                      llvm::GlobalValue::PrivateLinkage, formatConst, ".str");
+            context.builder.CreateCall(context.read, {ConstantExpr::getGetElementPtr(formatConst->getType(), formatVar,
+                                                                                      ArrayRef<Constant *>({zero, zero})),
+                                                      word});
+            llvm::FunctionCallee strlen = context.module->getOrInsertFunction(
+                    "strlen", llvm::FunctionType::get(Type::getInt64Ty(MyContext), {bytePtr}, false));
+            Value *length = context.builder.CreateCall(strlen, {word});
+            Value *s = Constant::getNullValue(type);
+            s = context.builder.CreateInsertValue(s, word, {0});
+            s = context.builder.CreateInsertValue(s, context.builder.CreateTrunc(length, i32), {1});
+            s = ConcatStrings(context, {s});
+            bool packed = f->type == Factor::T_ID_DOT_ID && IsPackedRecord(context, f->id);
+            FreeString(context, LoadString(context, arg_val, packed));
+            auto store = context.builder.CreateStore(s, arg_val);
+            if (packed)
+                store->setAlignment(1);
         }
     }
 }
@@ -655,73 +2324,77 @@ llvm::Value *funcGen(CodeGenContext &context, std::string &procId, ArgsList *arg
         fmt::print("Function/procedure called but not declared: {}\n", procId);
         exit(0);
     }
+    auto &params = context.funcParams[procId];
     std::vector<Value *> args;
+    // aggregate value arguments taken straight from a variable, which may still need a copy
+    std::vector<int> inPlace;
+    // aggregate arguments holding strings of their own, which the callee only borrows
+    std::vector<Value *> temporaries;
     auto p = argsList;
     int k = 0;
-    auto j = context.funcParams[procId].position.begin();
+    auto j = params.position.begin();
     while (p) {
-        if (j != context.funcParams[procId].position.end() && k == *j) {
-            auto zero = llvm::Constant::getNullValue(llvm::IntegerType::getInt32Ty(MyContext));
-
-            std::vector<llvm::Value *> indices;
-            indices.push_back(zero);
-            if (!p->expression || p->expression->type != Expression::T_EXPR ||
-                p->expression->expr->type != Expr::T_TERM ||
-                p->expression->expr->term->type != Term::T_FACTOR ||
-                (p->expression->expr->term->factor->type != Factor::T_NAME &&
-                 p->expression->expr->term->factor->type != Factor::T_ID_DOT_ID &&
-                 p->expression->expr->term->factor->type != Factor::T_ID_EXPR)) {
+        Type *paramType = k < (int) function->getFunctionType()->getNumParams()
+                          ? function->getFunctionType()->getParamType(k) : nullptr;
+        if (j != params.position.end() && k == *j) {
+            Factor *f = AsVariable(p->expression);
+            if (!f) {
                 fmt::print("Reference must pass a variable.\n");
                 exit(0);
             }
-            if (p->expression->expr->term->factor->type == Factor::T_NAME) {
-                auto name = p->expression->expr->term->factor->name;
-                if (context.constTable.isConst(name)) {
+            if (f->type == Factor::T_NAME) {
+                if (context.constTable.isConst(f->name)) {
                   std::cerr << "const value should not be referenced" << std::endl;
                   std::exit(1);
                 }
-                auto b = context.blocksStack.top();
-                while (b) {
-                    if (b->locals.find(name) == b->locals.end()) {
-                        b = b->preBlock;
-                        continue;
-                    }
-                    GetElementPtrInst *var_ref;
-                    if (context.isReference(name)) {
-                        auto tmp = new LoadInst(b->locals[name], "", false, context.currentBlock());
-                        var_ref = GetElementPtrInst::Create(nullptr,
-                                                            tmp,
-                                                            makeArrayRef(indices), "",
-                                                            context.currentBlock());
-                    } else {
-                        var_ref = GetElementPtrInst::Create(nullptr,
-                                                            b->locals[name],
-                                                            makeArrayRef(indices), "",
-                                                            context.currentBlock());
-                    }
-                    args.push_back(var_ref);
-                    break;
+                if (context.isLoopVariable(f->name)) {
+                  std::cerr << "for-loop control variable should not be referenced: " << f->name << std::endl;
+                  std::exit(1);
                 }
-            } else if (p->expression->expr->term->factor->type == Factor::T_ID_DOT_ID) {
-                GetElementPtrInst *var_ref = GetElementPtrInst::Create(Type::getInt32Ty(MyContext),
-                                                                       GetRecordRef(context,
-                                                                                    p->expression->expr->term->factor->id,
-                                                                                    p->expression->expr->term->factor->recordId),
-                                                                       makeArrayRef(indices), "",
-                                                                       context.currentBlock());
-                args.push_back(var_ref);
-            } else {
-                GetElementPtrInst *var_ref = GetElementPtrInst::Create(Type::getInt32Ty(MyContext),
-                                                                       GetArrayRef(context,
-                                                                                   p->expression->expr->term->factor->id,
-                                                                                   p->expression->expr->term->factor->expression),
-                                                                       makeArrayRef(indices), "",
-                                                                       context.currentBlock());
-                args.push_back(var_ref);
+                if (CodeGenBlock *b = context.isVariable(f->name))
+                  CheckOwnArray(b, f->name);
+            } else if (f->type == Factor::T_ID_DOT_ID && IsPackedRecord(context, f->id)) {
+                std::cerr << "field of packed record cannot be passed by reference: " << f->id << std::endl;
+                std::exit(1);
+            }
+            Value *ref = GetVariableRef(context, f);
+            if (ref->getType() != paramType) {
+                std::cerr << "type mismatch for var parameter " << k + 1 << " of " << procId << std::endl;
+                std::exit(1);
             }
+            args.push_back(ref);
             j++;
+        } else if (std::find(params.aggregates.begin(), params.aggregates.end(), k) != params.aggregates.end()) {
+            Value *ref;
+            Factor *f = AsVariable(p->expression);
+            if (f && !IsFunctionCall(context, f)) {
+                ref = GetVariableRef(context, f);
+                inPlace.push_back(k);
+            } else {
+                Value *value = p->expression->codeGen(context);
+                ref = CreateEntryAlloca(context, value->getType());
+                context.builder.CreateStore(value, ref);
+                if (HasStrings(context, value->getType()) && IsFreshString(context, p->expression))
+                    temporaries.push_back(ref);
+            }
+            if (ref->getType() != paramType) {
+                std::cerr << "type mismatch for parameter " << k + 1 << " of " << procId << std::endl;
+                std::exit(1);
+            }
+            args.push_back(ref);
         } else {
-            args.push_back(p->expression->codeGen(context));
+            Value *arg = p->expression->codeGen(context);
+            if (IsSet(arg) && paramType)
+                arg = CoerceSet(context, arg, paramType);
+            // the callee owns its string parameters and frees them when it returns
+            if (IsString(context, arg->getType()) && !IsFreshString(context, p->expression))
+                arg = CopyString(context, arg);
+            if (std::find(params.arrays.begin(), params.arrays.end(), k) != params.arrays.end() &&
+                arg->getType() != paramType) {
+                std::cerr << "type mismatch for parameter " << k + 1 << " of " << procId << std::endl;
+                std::exit(1);
+            }
+            args.push_back(arg);
         }
         p = p->preList;
         k++;
@@ -729,22 +2402,126 @@ llvm::Value *funcGen(CodeGenContext &context, std::string &procId, ArgsList *arg
 
     }
 
-    auto call = llvm::CallInst::Create(function, llvm::makeArrayRef(args), "", context.currentBlock());
+    size_t declared = args.size();
+    for (auto &capture : params.captures)
+        args.push_back(GetCaptureAddress(context, capture, procId));
+
+    // A variable passed by value is handed over in place when it is a local of this routine and
+    // no var or captured-variable argument of the same call shares it; otherwise the callee gets
+    // a copy, as it must not observe writes made through those other paths.
+    auto baseOf = [](Value *v) {
+        while (auto gep = llvm::dyn_cast<GEPOperator>(v))
+            v = gep->getPointerOperand();
+        return v;
+    };
+    for (int i : inPlace) {
+        Value *base = baseOf(args[i]);
+        bool copy = !llvm::isa<AllocaInst>(base);
+        for (auto ref = params.position.begin(); ref != params.position.end() && !copy; ref++)
+            copy = baseOf(args[*ref]) == base;
+        for (size_t j = declared; j < args.size() && !copy; j++)
+            copy = baseOf(args[j]) == base;
+        if (copy) {
+            Type *type = args[i]->getType()->getPointerElementType();
+            AllocaInst *tmp = CreateEntryAlloca(context, type);
+            InitAggregate(context, tmp, args[i], type, false);
+            args[i] = tmp;
+            if (HasStrings(context, type))
+                temporaries.push_back(tmp);
+        }
+    }
+
+    auto call = context.builder.CreateCall(function, llvm::makeArrayRef(args));
+    for (Value *temporary : temporaries)
+        ReleaseStrings(context, temporary, false);
 
 
     return call;
 }
 
+// setlength(a, n) gives a the bounds 0..n - 1 and setlength(a, lo, hi) the bounds lo..hi. Elements whose
+// index lies within both the old and the new bounds keep their values; the others start out zero.
+static Value *SetLength(CodeGenContext &context, ExpressionList *args) {
+  std::vector<Expression *> exprs;
+  for (ExpressionList *l = args; l; l = l->preList)
+    exprs.insert(exprs.begin(), l->expression);
+  Factor *f = exprs.size() == 2 || exprs.size() == 3 ? AsVariable(exprs[0]) : nullptr;
+  CodeGenBlock *b = f && f->type == Factor::T_NAME ? context.isVariable(f->name) : nullptr;
+  if (!b || !b->varTypes.count(f->name) || !IsDynamicArray(context, b->varTypes[f->name])) {
+    std::cerr << "setlength takes a dynamic array variable and its length or bounds" << std::endl;
+    std::exit(1);
+  }
+  CheckOwnArray(b, f->name);
+  Type *i64 = Type::getInt64Ty(MyContext);
+  std::vector<Value *> bounds;
+  for (size_t k = 1; k < exprs.size(); k++) {
+    Value *v = exprs[k]->codeGen(context);
+    if (!v->getType()->isIntegerTy(32)) {
+      std::cerr << "bounds of dynamic array must be integers: " << f->name << std::endl;
+      std::exit(1);
+    }
+    bounds.push_back(context.builder.CreateSExt(v, i64));
+  }
+  if (bounds.size() == 1)
+    bounds = {ConstantInt::get(i64, 0), context.builder.CreateSub(bounds[0], ConstantInt::get(i64, 1))};
+
+  Value *storage = GetVariableRef(context, f);
+  Type *handleType = storage->getType()->getPointerElementType();
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Value *old = context.builder.CreateBitCast(CreateLoad(context, storage), bytes);
+  Value *handle = CallArrayRuntime(context, "spl_array_resize", bytes,
+                                   {old, bounds[0], bounds[1], GetElementSize(context, handleType)});
+  return context.builder.CreateStore(context.builder.CreateBitCast(handle, handleType), storage);
+}
+
+// a := b copies the elements of b into a block of a's own, as assignment does for other arrays. The
+// array a function returns is fresh and is taken over instead.
+static Value *AssignDynamicArray(CodeGenContext &context, CodeGenBlock *b, const std::string &id, Expression *rhs) {
+  CheckOwnArray(b, id);
+  Value *storage = context.isReference(id) ? CreateLoad(context, b->locals[id]) : b->locals[id];
+  Type *handleType = storage->getType()->getPointerElementType();
+  Value *r = rhs->codeGen(context);
+  if (r->getType() != handleType) {
+    std::cerr << "Assign stmt error left and right has different types" << std::endl;
+    std::exit(1);
+  }
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Value *old = context.builder.CreateBitCast(CreateLoad(context, storage), bytes);
+  Value *size = GetElementSize(context, handleType);
+  // only a function result is a block nothing else holds; parentheses aside, anything else is copied
+  Expression *e = rhs;
+  Factor *f = nullptr;
+  while (e->type == Expression::T_EXPR && e->expr->type == Expr::T_TERM && e->expr->term->type == Term::T_FACTOR) {
+    f = e->expr->term->factor;
+    if (f->type != Factor::T_EXPR)
+      break;
+    e = f->expression;
+  }
+  Value *handle;
+  if (f && IsFunctionCall(context, f)) {
+    CallArrayRuntime(context, "spl_array_free", Type::getVoidTy(MyContext), {old, size});
+    handle = context.builder.CreateBitCast(r, bytes);
+  } else {
+    handle = CallArrayRuntime(context, "spl_array_assign", bytes,
+                              {old, context.builder.CreateBitCast(r, bytes), size});
+  }
+  return context.builder.CreateStore(context.builder.CreateBitCast(handle, handleType), storage);
+}
+
 llvm::Value *ProcStmt::codeGen(CodeGenContext &context) {
     if (type == T_SIMPLE || type == T_SIMPLE_ARGS) {
-        return funcGen(context, procId, argsList);
+        auto call = funcGen(context, procId, argsList);
+        if (context.tailCalls.count(this))
+            EmitTailCall(context, call);
+        return call;
     } else if (type == T_SYS_PROC_EXPR) {
         if (sysProc == "write" || sysProc == "writeln") {
             std::string printf_format;
             std::vector<llvm::Value *> printf_args;
 
             ExpressionList *p = expressionList;
-            getPrintArgs(printf_args, printf_format, p, context);
+            std::vector<llvm::Value *> temporaries;
+            getPrintArgs(printf_args, printf_format, p, context, temporaries);
             if (sysProc == "writeln")
                 printf_format += "\n";
 
@@ -765,9 +2542,12 @@ llvm::Value *ProcStmt::codeGen(CodeGenContext &context) {
                     indices);
 
             printf_args.insert(printf_args.begin(), var_ref);
-            auto call = llvm::CallInst::Create(context.print, llvm::makeArrayRef(printf_args), "",
-                                               context.currentBlock());
+            auto call = context.builder.CreateCall(context.print, llvm::makeArrayRef(printf_args));
+            for (Value *s : temporaries)
+                FreeString(context, s);
             return call;
+        } else if (sysProc == "setlength") {
+            return SetLength(context, expressionList);
         }
     } else if (type == T_READ) {
         std::string printf_format;
@@ -775,6 +2555,8 @@ llvm::Value *ProcStmt::codeGen(CodeGenContext &context) {
 
         Factor *p = factor;
         getReadArgs(printf_args, printf_format, p, context);
+        if (printf_format.empty())
+            return nullptr;
 
         auto printf_format_const = llvm::ConstantDataArray::getString(MyContext, printf_format, true);
         auto format_string_var = new llvm::GlobalVariable(*context.module,
@@ -793,8 +2575,7 @@ llvm::Value *ProcStmt::codeGen(CodeGenContext &context) {
                 indices);
 
         printf_args.insert(printf_args.begin(), var_ref);
-        auto call = llvm::CallInst::Create(context.read, llvm::makeArrayRef(printf_args), "",
-                                           context.currentBlock());
+        auto call = context.builder.CreateCall(context.read, llvm::makeArrayRef(printf_args));
         return call;
     }
     return nullptr;
@@ -814,6 +2595,210 @@ TypeDecl *RecordTypeDecl::findName(const std::string & s) {
     return nullptr;
 }
 
+static llvm::MDNode *CreateLoopID(llvm::ArrayRef<llvm::Metadata *> properties) {
+  // a loop ID is a distinct node whose first operand refers to itself
+  std::vector<llvm::Metadata *> ops;
+  auto self = llvm::MDNode::getTemporary(MyContext, llvm::None);
+  ops.push_back(self.get());
+  ops.insert(ops.end(), properties.begin(), properties.end());
+  llvm::MDNode *loopID = llvm::MDNode::getDistinct(MyContext, ops);
+  loopID->replaceOperandWith(0, loopID);
+  return loopID;
+}
+
+// The extents of an array type, nested arrays included, and the type of its elements; false unless
+// it is an array of ordinals or reals stored one per element.
+static bool GetArrayShape(CodeGenContext &context, TypeDecl *t, std::vector<int64_t> &extents, Type *&element) {
+  t = ResolveType(context, t);
+  if (!t || t->type != TypeDecl::T_ARRAY_TYPE_DECLARE || !t->arrayTypeDecl->range)
+    return false;
+  extents.clear();
+  while (t && t->type == TypeDecl::T_ARRAY_TYPE_DECLARE) {
+    if (BitPackedSize(context, t->arrayTypeDecl))
+      return false;
+    extents.push_back(t->arrayTypeDecl->range->getRange(context.constTable));
+    t = ResolveType(context, t->arrayTypeDecl->elementType);
+  }
+  element = t ? t->getType(context, "") : nullptr;
+  return element && (element->isIntegerTy() || element->isDoubleTy());
+}
+
+// Whether the array a loop or assignment writes may share memory with another variable it uses. A var
+// parameter, captured variable or aggregate value parameter used in place may be whatever its
+// caller passed, which is never a local of this routine; distinct locals and globals never overlap.
+static bool MayAlias(CodeGenContext &context, const std::string &array, const std::string &other) {
+  // a dynamic array variable owns its block, unless it is a value parameter borrowing the caller's
+  auto storage = [&](const std::string &name) -> Value * {
+    CodeGenBlock *b = context.isVariable(name);
+    return b->references.count(name) || b->borrowedArrays.count(name) ? nullptr : b->locals[name];
+  };
+  auto passed = [](Value *v) { return !v || !(llvm::isa<AllocaInst>(v) || llvm::isa<GlobalVariable>(v)); };
+  auto own = [&](Value *v) {
+    auto alloca = llvm::dyn_cast_or_null<AllocaInst>(v);
+    return alloca && alloca->getFunction() == context.blocksStack.top()->function;
+  };
+  Value *a = storage(array), *b = storage(other);
+  if (b && llvm::isa<Constant>(b) && !llvm::isa<GlobalVariable>(b))
+    return false;
+  // an array reached through a pointer is another array or record, or part of one
+  auto &types = context.isVariable(other)->varTypes;
+  bool aggregate = !types.count(other) || IsAggregate(context, types[other]) || IsDynamicArray(context, types[other]);
+  return (aggregate && passed(a) && !own(b)) || (passed(b) && !own(a));
+}
+
+// In an element-wise assignment a whole array on the right stands for its element at the position
+// being computed; null for any other name.
+static Value *GetElementRef(CodeGenContext &context, const std::string &name) {
+  CodeGenBlock *b = context.isVariable(name);
+  if (!context.elementLoop || !b || !b->varTypes.count(name))
+    return nullptr;
+  TypeDecl *t = ResolveType(context, b->varTypes[name]);
+  if (!t || t->type != TypeDecl::T_ARRAY_TYPE_DECLARE)
+    return nullptr;
+  std::vector<int64_t> extents;
+  Type *element;
+  if (!GetArrayShape(context, t, extents, element) || extents != context.elementLoop->extents) {
+    std::cerr << "array in an element-wise expression must have the shape of the array assigned: " << name
+              << std::endl;
+    std::exit(1);
+  }
+  Value *array = context.isReference(name) ? CreateLoad(context, b->locals[name]) : b->locals[name];
+  Value *elements = context.builder.CreateBitCast(array, element->getPointerTo());
+  return context.builder.CreateInBoundsGEP(element, elements, context.elementLoop->index);
+}
+
+// dest := rhs for a whole array, one element at a time in a flat loop over all of them. The caller
+// makes sure each iteration reads only the elements of dest at its own position and writes only
+// its own, so the loop is marked parallel and the vectorizer needs no runtime alias checks.
+static void EmitElementLoop(CodeGenContext &context, Value *dest, const std::vector<int64_t> &extents,
+                            Type *element, Expression *rhs) {
+  Function *function = context.blocksStack.top()->function;
+  Type *i64 = Type::getInt64Ty(MyContext);
+  int64_t count = 1;
+  for (int64_t extent : extents)
+    count *= extent;
+  Value *elements = context.builder.CreateBitCast(dest, element->getPointerTo());
+  BasicBlock *preheader = context.currentBlock();
+  BasicBlock *bloop = BasicBlock::Create(MyContext, "elementLoop", function);
+  BasicBlock *bexit = BasicBlock::Create(MyContext, "elementExit", function);
+  context.builder.CreateBr(bloop);
+  context.builder.SetInsertPoint(bloop);
+  PHINode *index = context.builder.CreatePHI(i64, 2, "element");
+  index->addIncoming(ConstantInt::get(i64, 0), preheader);
+
+  ElementLoop loop{extents, index};
+  ElementLoop *outer = context.elementLoop;
+  context.elementLoop = &loop;
+  Value *v = rhs->codeGen(context);
+  context.elementLoop = outer;
+  if (v->getType()->isIntegerTy(32) && element->isDoubleTy())
+    v = context.builder.CreateSIToFP(v, element);
+  if (v->getType() != element) {
+    std::cerr << "element-wise expression does not have the element type of the array assigned" << std::endl;
+    std::exit(1);
+  }
+  context.builder.CreateStore(v, context.builder.CreateInBoundsGEP(element, elements, index));
+
+  BasicBlock *latch = context.currentBlock();
+  Value *next = context.builder.CreateNUWAdd(index, ConstantInt::get(i64, 1));
+  index->addIncoming(next, latch);
+  // the loop's blocks are the ones created from bloop on, bexit aside
+  llvm::MDNode *group = llvm::MDNode::getDistinct(MyContext, {});
+  for (auto block = bloop->getIterator(); block != function->end(); ++block) {
+    if (&*block == bexit)
+      continue;
+    for (auto &inst : *block)
+      if (llvm::isa<LoadInst>(inst) || llvm::isa<StoreInst>(inst))
+        inst.setMetadata(llvm::LLVMContext::MD_access_group, group);
+  }
+  llvm::Metadata *parallel[] = {llvm::MDString::get(MyContext, "llvm.loop.parallel_accesses"), group};
+  llvm::MDNode *loopID = CreateLoopID({llvm::MDNode::get(MyContext, parallel)});
+  context.builder.CreateCondBr(context.builder.CreateICmpEQ(next, ConstantInt::get(i64, count)), bexit, bloop)
+          ->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+  context.builder.SetInsertPoint(bexit);
+}
+
+// Whether an element-wise right-hand side may read elements of the array dest at other positions
+// than the one being computed: through a subscript of dest or of what may share its memory, a
+// scalar that may be one of its elements, or a function call, which may read it in any way.
+static bool ReadsOtherElements(CodeGenContext &context, Node *node, const std::string &dest) {
+  if (!node)
+    return false;
+  if (auto f = dynamic_cast<Factor *>(node)) {
+    if (IsFunctionCall(context, f))
+      return true;
+    const std::string &name = f->type == Factor::T_NAME ? f->name : f->id;
+    CodeGenBlock *b = context.isVariable(name);
+    if (b && !context.isLoopVariable(name) && b->varTypes.count(name)) {
+      TypeDecl *t = ResolveType(context, b->varTypes[name]);
+      // whole arrays stand for their elements at the position being computed
+      bool element = f->type == Factor::T_NAME && t && t->type == TypeDecl::T_ARRAY_TYPE_DECLARE;
+      if ((f->type == Factor::T_NAME || f->type == Factor::T_ID_EXPR || f->type == Factor::T_ID_DOT_ID) &&
+          !element && (name == dest || MayAlias(context, dest, name)))
+        return true;
+    }
+  }
+  for (auto child : node->getChildren())
+    if (ReadsOtherElements(context, child, dest))
+      return true;
+  return false;
+}
+
+// Store an array or record element or field that the right-hand side loaded whole from memory by
+// copying that memory instead; null when v is not such a load.
+static Value *StoreAggregate(CodeGenContext &context, Value *v, Value *ptr, bool packed) {
+  auto load = llvm::dyn_cast<LoadInst>(v);
+  if (!load || !load->use_empty() || !v->getType()->isAggregateType() ||
+      v->getType() != ptr->getType()->getPointerElementType())
+    return nullptr;
+  Value *src = load->getPointerOperand();
+  load->eraseFromParent();
+  CopyAggregate(context, ptr, src, v->getType(), packed);
+  return src;
+}
+
+// Assignment to a whole array or record. A variable of the same type is copied with memcpy, which
+// two variables of one type can only meet as the same variable or apart; any other value holding
+// strings goes through StoreString; an array assigned any other expression but a function call gets
+// it element by element, through a temporary when the expression may read elements it would already
+// have overwritten. Null when none applies.
+static Value *AssignAggregate(CodeGenContext &context, const std::string &id, Value *dest, TypeDecl *t,
+                              Expression *rhs) {
+  Type *type = dest->getType()->getPointerElementType();
+  Factor *f = AsVariable(rhs);
+  if (f && !IsFunctionCall(context, f)) {
+    Value *src = GetVariableRef(context, f);
+    if (src->getType() == dest->getType()) {
+      CopyAggregate(context, dest, src, type, false);
+      return src;
+    }
+  }
+  if (HasStrings(context, type)) {
+    Value *v = rhs->codeGen(context);
+    if (v->getType() != type) {
+      std::cerr << "Assign stmt error left and right has different types" << std::endl;
+      std::exit(1);
+    }
+    return StoreString(context, v, rhs, dest, false);
+  }
+  std::vector<int64_t> extents;
+  Type *element;
+  Factor *call = rhs->type == Expression::T_EXPR && rhs->expr->type == Expr::T_TERM &&
+                 rhs->expr->term->type == Term::T_FACTOR ? rhs->expr->term->factor : nullptr;
+  if ((call && IsFunctionCall(context, call)) || !GetArrayShape(context, t, extents, element))
+    return nullptr;
+  if (!ReadsOtherElements(context, rhs, id)) {
+    EmitElementLoop(context, dest, extents, element, rhs);
+    return dest;
+  }
+  AllocaInst *temp = CreateEntryAlloca(context, type);
+  if (context.module->getDataLayout().getTypeAllocSize(type) > (uint64_t) context.options.stackThreshold)
+    context.largeLocals.push_back(temp);
+  EmitElementLoop(context, temp, extents, element, rhs);
+  CopyAggregate(context, dest, temp, type, false);
+  return dest;
+}
+
 llvm::Value *AssignStmt::codeGen(CodeGenContext &context) {
     CodeGenBlock *b = context.blocksStack.top();
     while (b) {
@@ -825,108 +2810,378 @@ llvm::Value *AssignStmt::codeGen(CodeGenContext &context) {
             std::cerr << "const value should not be changed" << std::endl;
             std::exit(1);
         }
+        if (type == T_SIMPLE && context.isLoopVariable(id)) {
+            std::cerr << "for-loop control variable should not be changed: " << id << std::endl;
+            std::exit(1);
+        }
         if (b->locals[id] == nullptr) {
             fmt::print("Uninitialize variable: {}\n", id);
         }
         if (type == T_SIMPLE) {
+            if (IsDynamicArray(context, b->varTypes[id]))
+                return AssignDynamicArray(context, b, id, rhs);
+            if (IsAggregate(context, b->varTypes[id])) {
+                Value *dest = context.isReference(id) ? CreateLoad(context, b->locals[id]) : b->locals[id];
+                if (Value *v = AssignAggregate(context, id, dest, b->varTypes[id], rhs))
+                    return v;
+            }
             if (context.isReference(id)) {
-                auto tmp = new llvm::LoadInst(b->locals[id], "", false, context.currentBlock());
-                auto r = rhs->codeGen(context);
+                auto tmp = CreateLoad(context, b->locals[id]);
+                auto r = CoerceSet(context, rhs->codeGen(context), b->varTypes[id]->getType(context, ""));
                 if(r->getType() != b->varTypes[id]->getType(context, "")){
                     std::cerr << "Assign stmt error left and right has different types" << std::endl;
                     std::exit(1);
                 }
-                return new llvm::StoreInst(r, tmp, false, context.currentBlock());
+                if (HasStrings(context, r->getType()))
+                    return StoreString(context, r, rhs, tmp, false);
+                return context.builder.CreateStore(r, tmp);
             }
-            return new llvm::StoreInst(rhs->codeGen(context), b->locals[id], false, context.currentBlock());
+            auto r = rhs->codeGen(context);
+            if (context.tailCalls.count(this) && EmitTailCall(context, r))
+                return r;
+            if (HasStrings(context, r->getType()))
+                return StoreString(context, r, rhs, b->locals[id], false);
+            if (IsSet(r))
+                r = CoerceSet(context, r, b->locals[id]->getType()->getPointerElementType());
+            return context.builder.CreateStore(r, b->locals[id]);
         } else if (type == T_ARRAY) {
             auto r = rhs->codeGen(context);
-            if(r->getType() != b->varTypes[id]->arrayTypeDecl->elementType->getType(context, "")){
+            Value *bit = nullptr;
+            auto ref = GetArrayRef(context, id, index, &bit);
+            Type *elementTy = bit ? Type::getInt1Ty(MyContext) : ref->getType()->getPointerElementType();
+            r = CoerceSet(context, r, elementTy);
+            if(r->getType() != elementTy){
                 std::cerr << "Assign stmt error left and right has different types" << std::endl;
                 std::exit(1);
             }
-            return new llvm::StoreInst(r, GetArrayRef(context, id, index), false,
-                                       context.currentBlock());
+            if (bit)
+                return StorePackedBit(context, ref, bit, r);
+            if (IsString(context, elementTy))
+                return StoreString(context, r, rhs, ref, false);
+            if (Value *copy = StoreAggregate(context, r, ref, false))
+                return copy;
+            if (HasStrings(context, elementTy))
+                return StoreString(context, r, rhs, ref, false);
+            return context.builder.CreateStore(r, ref);
         } else {
-            auto r = rhs->codeGen(context);
+            auto r = CoerceSet(context, rhs->codeGen(context),
+                               b->varTypes[id]->recordTypeDecl->findName(id)->getType(context, ""));
             if(r->getType() != b->varTypes[id]->recordTypeDecl->findName(id)->getType(context, "")){
                 std::cerr << "Assign stmt error left and right has different types" << std::endl;
                 std::exit(1);
             }
-            return new StoreInst(r, GetRecordRef(context, id, recordId), false,
-                                 context.currentBlock());
+            Value *ref = GetRecordRef(context, id, recordId);
+            bool packed = IsPackedRecord(context, id);
+            if (IsString(context, r->getType()))
+                return StoreString(context, r, rhs, ref, packed);
+            if (Value *copy = StoreAggregate(context, r, ref, packed))
+                return copy;
+            if (HasStrings(context, r->getType()))
+                return StoreString(context, r, rhs, ref, packed);
+            auto store = context.builder.CreateStore(r, ref);
+            if (packed)
+                store->setAlignment(1);
+            return store;
         }
     }
     return nullptr;
 }
 
+// Ranges wider than this are tested with a single unsigned compare instead of being expanded into switch cases.
+static const int64_t MaxExpandedCaseRange = 64;
+
+namespace AST {
+    struct CaseLowering {
+        llvm::SwitchInst *switchInst;
+        llvm::BasicBlock *bmerge;
+        std::vector<std::pair<int64_t, int64_t>> labels;
+    };
+}
+
+// Case labels are compared as unsigned for char and boolean selectors, so 'a'..'z' style ranges stay ordered.
+static int64_t GetCaseLabelValue(llvm::ConstantInt *c) {
+  return c->getBitWidth() < 32 ? (int64_t) c->getZExtValue() : c->getSExtValue();
+}
+
+static llvm::ConstantInt *GetCaseLabel(CodeGenContext &context, ConstValue *value, const std::string &name,
+                                       llvm::Type *selectorType) {
+  llvm::Value *label = nullptr;
+  if (value) {
+    label = value->codeGen(context);
+  } else if (context.constTable.isConst(name)) {
+    label = context.isVariable(name)->locals[name];
+  }
+  auto c = llvm::dyn_cast_or_null<llvm::ConstantInt>(label);
+  if (!c) {
+    std::cerr << "case label must be an ordinal constant: " << (value ? value->value : name) << std::endl;
+    std::exit(1);
+  }
+  if (c->getType() != selectorType) {
+    std::cerr << "case label type does not match the case selector: " << (value ? value->value : name) << std::endl;
+    std::exit(1);
+  }
+  return c;
+}
+
 llvm::Value *CaseStmt::codeGen(CodeGenContext &context) {
     Function *currentFuction = context.blocksStack.top()->function;
     Value *condition = expression->codeGen(context);
+    if (!condition->getType()->isIntegerTy()) {
+        std::cerr << "case selector must be an ordinal type" << std::endl;
+        std::exit(1);
+    }
     BasicBlock *bmerge = BasicBlock::Create(MyContext, "mergeStmt", currentFuction);
-    if (caseExprList) caseExprList->codeGen(context, condition, bmerge);
-    llvm::BranchInst::Create(bmerge, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bmerge);
-    context.blocksStack.top()->function = currentFuction;
-    return nullptr;
+    BasicBlock *bdefault = otherwise ? BasicBlock::Create(MyContext, "otherwiseStmt", currentFuction) : bmerge;
+    // one switch for the whole statement, so the backend can pick jump tables, bit tests or lookup tables
+    CaseLowering lowering{context.builder.CreateSwitch(condition, bdefault, 0), bmerge, {}};
+    if (caseExprList) caseExprList->codeGen(context, lowering);
+    if (otherwise) {
+        context.builder.SetInsertPoint(bdefault);
+        otherwise->codeGen(context);
+        context.builder.CreateBr(bmerge);
+    }
+    context.builder.SetInsertPoint(bmerge);
+    return lowering.switchInst;
 }
 
-llvm::Value *CaseExprList::codeGen(CodeGenContext &context, Value *condition, BasicBlock *bmerge) {
-    if (preList) preList->codeGen(context, condition, bmerge);
-    if (caseExpr) return caseExpr->codeGen(context, condition, bmerge);
+llvm::Value *CaseExprList::codeGen(CodeGenContext &context, CaseLowering &lowering) {
+    if (preList) preList->codeGen(context, lowering);
+    if (caseExpr) return caseExpr->codeGen(context, lowering);
     return nullptr;
 }
 
-llvm::Value *CaseExpr::codeGen(CodeGenContext &context, Value *condition, BasicBlock *bmerge) {
+llvm::Value *CaseExpr::codeGen(CodeGenContext &context, CaseLowering &lowering) {
     Function *currentFuction = context.blocksStack.top()->function;
-    BasicBlock *btrue = BasicBlock::Create(MyContext, "thenStmt", currentFuction);
-    BasicBlock *bfalse = BasicBlock::Create(MyContext, "elseStmt", currentFuction);
-    Value *cmp;
-    if (type == T_CONST) cmp = constValue->codeGen(context);
-    else {
-        if (context.isReference(id)) {
-            cmp = new llvm::LoadInst(context.isVariable(id)->locals[id], "", false, context.currentBlock());
-            cmp = new llvm::LoadInst(cmp, "", false, context.currentBlock());
-        } else
-            cmp = new llvm::LoadInst(context.isVariable(id)->locals[id], "", false, context.currentBlock());
-    }
-    auto res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_EQ,
-                                     cmp, condition, "", context.currentBlock());
-    llvm::Instruction *ret = llvm::BranchInst::Create(btrue, bfalse, res, context.currentBlock());
-    context.pushBlock(btrue);
-    context.blocksStack.top()->function = currentFuction;
+    SwitchInst *switchInst = lowering.switchInst;
+    Value *condition = switchInst->getCondition();
+    Type *selectorType = condition->getType();
+    BasicBlock *bcase = BasicBlock::Create(MyContext, "caseStmt", currentFuction);
+
+    for (CaseLabelList *l = labelList; l; l = l->preList) {
+        ConstantInt *lower, *upper;
+        if (l->type == CaseLabelList::T_CONST || l->type == CaseLabelList::T_CONST_RANGE)
+            lower = GetCaseLabel(context, l->lowerValue, "", selectorType);
+        else
+            lower = GetCaseLabel(context, nullptr, l->lowerName, selectorType);
+        if (l->type == CaseLabelList::T_CONST_RANGE)
+            upper = GetCaseLabel(context, l->upperValue, "", selectorType);
+        else if (l->type == CaseLabelList::T_ID_RANGE)
+            upper = GetCaseLabel(context, nullptr, l->upperName, selectorType);
+        else
+            upper = lower;
+
+        int64_t lo = GetCaseLabelValue(lower), hi = GetCaseLabelValue(upper);
+        if (lo > hi) {
+            std::cerr << "empty case label range" << std::endl;
+            std::exit(1);
+        }
+        for (auto &seen : lowering.labels) {
+            if (lo <= seen.second && seen.first <= hi) {
+                std::cerr << "duplicate case label" << std::endl;
+                std::exit(1);
+            }
+        }
+        lowering.labels.emplace_back(lo, hi);
+
+        if (hi - lo < MaxExpandedCaseRange) {
+            for (int64_t v = lo; v <= hi; v++)
+                switchInst->addCase(ConstantInt::get(llvm::cast<IntegerType>(selectorType), v, true), bcase);
+        } else {
+            // (selector - lo) <=u (hi - lo), chained in front of the current default destination
+            BasicBlock *brange = BasicBlock::Create(MyContext, "caseRange", currentFuction);
+            IRBuilderBase::InsertPointGuard guard(context.builder);
+            context.builder.SetInsertPoint(brange);
+            Value *offset = context.builder.CreateSub(condition, lower);
+            Value *inRange = context.builder.CreateICmpULE(offset, ConstantInt::get(selectorType, hi - lo));
+            context.builder.CreateCondBr(inRange, bcase, switchInst->getDefaultDest());
+            switchInst->setDefaultDest(brange);
+        }
+    }
+
+    context.builder.SetInsertPoint(bcase);
     stmt->codeGen(context);
-    llvm::BranchInst::Create(bmerge, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bfalse);
-    context.blocksStack.top()->function = currentFuction;
-    return nullptr;
+    context.builder.CreateBr(lowering.bmerge);
+    return bcase;
+}
+
+
+// An operand may be evaluated unconditionally when it cannot call a routine, index an array or divide by a variable.
+static bool IsSpeculatable(CodeGenContext &context, Node *node) {
+  if (!node)
+    return true;
+  if (auto f = dynamic_cast<Factor *>(node)) {
+    if (IsFunctionCall(context, f) || f->type == Factor::T_ID_EXPR)
+      return false;
+  } else if (auto t = dynamic_cast<Term *>(node)) {
+    if (t->type == Term::T_DIV || t->type == Term::T_MOD) {
+      auto divisor = t->factor->type == Factor::T_CONST ? t->factor->constValue : nullptr;
+      if (!divisor || (divisor->type != ConstValue::T_INTEGER && divisor->type != ConstValue::T_REAL) ||
+          std::stod(divisor->value) == 0)
+        return false;
+    }
+  }
+  for (auto child : node->getChildren())
+    if (!IsSpeculatable(context, child))
+      return false;
+  return true;
+}
+
+static Value *ToCondition(CodeGenContext &context, Value *v) {
+  if (v->getType() == Type::getInt1Ty(MyContext))
+    return v;
+  if (!v->getType()->isIntegerTy()) {
+    std::cerr << "condition must be a boolean expression" << std::endl;
+    std::exit(1);
+  }
+  return context.builder.CreateICmp(llvm::CmpInst::ICMP_NE, v, ConstantInt::get(v->getType(), 0));
+}
+
+// Code a constant condition never runs is still generated, so that its errors are reported, but in a
+// block nothing branches to, which the optimizer and the backend throw away.
+static void GenerateDeadCode(CodeGenContext &context, Node *node) {
+  if (!node)
+    return;
+  IRBuilderBase::InsertPointGuard resume(context.builder);
+  context.builder.SetInsertPoint(BasicBlock::Create(MyContext, "deadCode", context.blocksStack.top()->function));
+  node->codeGen(context);
+  context.builder.CreateUnreachable();
+}
+
+// Boolean `and`/`or` in a value context: cheap operands are combined without branches,
+// anything else is only evaluated when the left operand does not decide the result.
+static Value *EmitLogical(CodeGenContext &context, bool isAnd, Value *lhs, Node *rhs) {
+  if (IsSpeculatable(context, rhs)) {
+    Value *r = rhs->codeGen(context);
+    if (r->getType() != lhs->getType()) {
+      std::cerr << "operands of and/or must both be boolean" << std::endl;
+      std::exit(1);
+    }
+    return isAnd ? context.builder.CreateAnd(lhs, r) : context.builder.CreateOr(lhs, r);
+  }
+  // a constant left operand either decides the result or leaves it to the right one
+  if (auto c = llvm::dyn_cast<ConstantInt>(lhs)) {
+    if (c->isZero() != isAnd)
+      return ToCondition(context, rhs->codeGen(context));
+    GenerateDeadCode(context, rhs);
+    return lhs;
+  }
+  Function *currentFuction = context.blocksStack.top()->function;
+  BasicBlock *bentry = context.currentBlock();
+  BasicBlock *brhs = BasicBlock::Create(MyContext, isAnd ? "andRhs" : "orRhs", currentFuction);
+  BasicBlock *bmerge = BasicBlock::Create(MyContext, isAnd ? "andMerge" : "orMerge", currentFuction);
+  context.builder.CreateCondBr(lhs, isAnd ? brhs : bmerge, isAnd ? bmerge : brhs);
+
+  context.builder.SetInsertPoint(brhs);
+  Value *r = ToCondition(context, rhs->codeGen(context));
+  BasicBlock *brhsEnd = context.currentBlock();
+  context.builder.CreateBr(bmerge);
+
+  context.builder.SetInsertPoint(bmerge);
+  PHINode *phi = context.builder.CreatePHI(Type::getInt1Ty(MyContext), 2);
+  phi->addIncoming(ConstantInt::get(Type::getInt1Ty(MyContext), isAnd ? 0 : 1), bentry);
+  phi->addIncoming(r, brhsEnd);
+  return phi;
+}
+
+// Branch on a condition without materializing it: and/or become branch chains, not swaps the targets.
+static void EmitCondBranch(CodeGenContext &context, Node *cond, BasicBlock *btrue, BasicBlock *bfalse) {
+  Node *lhs = nullptr, *rhs = nullptr;
+  bool isAnd = false;
+  if (auto e = dynamic_cast<Expression *>(cond)) {
+    if (e->type == Expression::T_EXPR)
+      return EmitCondBranch(context, e->expr, btrue, bfalse);
+  } else if (auto e = dynamic_cast<Expr *>(cond)) {
+    if (e->type == Expr::T_TERM)
+      return EmitCondBranch(context, e->term, btrue, bfalse);
+    if (e->type == Expr::T_OR)
+      lhs = e->expr, rhs = e->term;
+  } else if (auto t = dynamic_cast<Term *>(cond)) {
+    if (t->type == Term::T_FACTOR)
+      return EmitCondBranch(context, t->factor, btrue, bfalse);
+    if (t->type == Term::T_AND)
+      lhs = t->term, rhs = t->factor, isAnd = true;
+  } else if (auto f = dynamic_cast<Factor *>(cond)) {
+    if (f->type == Factor::T_EXPR)
+      return EmitCondBranch(context, f->expression, btrue, bfalse);
+    if (f->type == Factor::T_NOT_FACTOR)
+      return EmitCondBranch(context, f->factor, bfalse, btrue);
+  }
+
+  if (lhs && !IsSpeculatable(context, rhs)) {
+    Function *currentFuction = context.blocksStack.top()->function;
+    BasicBlock *brhs = BasicBlock::Create(MyContext, isAnd ? "andRhs" : "orRhs", currentFuction);
+    EmitCondBranch(context, lhs, isAnd ? brhs : btrue, isAnd ? bfalse : brhs);
+    context.builder.SetInsertPoint(brhs);
+    EmitCondBranch(context, rhs, btrue, bfalse);
+    return;
+  }
+  Value *c = ToCondition(context, cond->codeGen(context));
+  if (auto folded = llvm::dyn_cast<ConstantInt>(c))
+    context.builder.CreateBr(folded->isOne() ? btrue : bfalse);
+  else
+    context.builder.CreateCondBr(c, btrue, bfalse);
 }
 
+// Literals and constants combined by operators, which the builder folds without emitting code.
+static bool IsConstantExpression(CodeGenContext &context, Node *node) {
+  if (!node)
+    return true;
+  if (auto f = dynamic_cast<Factor *>(node)) {
+    switch (f->type) {
+      case Factor::T_CONST:
+        return f->constValue->type != ConstValue::T_STRING;
+      case Factor::T_NAME:
+        return context.constTable.isConst(f->name) &&
+               context.constTable.table.at(f->name).back().type != ConstTable::ConstValueUnion::STRING;
+      case Factor::T_EXPR:
+      case Factor::T_NOT_FACTOR:
+      case Factor::T_MINUS_FACTOR:
+        break;
+      default:
+        return false;
+    }
+  }
+  for (auto child : node->getChildren())
+    if (!IsConstantExpression(context, child))
+      return false;
+  return true;
+}
+
+// The value of a condition known at compile time, so the statement using it needs no branch.
+static ConstantInt *ConstantCondition(CodeGenContext &context, Node *cond) {
+  if (!IsConstantExpression(context, cond))
+    return nullptr;
+  return llvm::dyn_cast<ConstantInt>(ToCondition(context, cond->codeGen(context)));
+}
 
 llvm::Value *IfStmt::codeGen(CodeGenContext &context) {
+    // only the branch taken is generated in line
+    if (auto c = ConstantCondition(context, expression)) {
+        if (c->isOne()) {
+            stmt->codeGen(context);
+            GenerateDeadCode(context, elseClause);
+        } else {
+            GenerateDeadCode(context, stmt);
+            if (elseClause)
+                elseClause->codeGen(context);
+        }
+        return nullptr;
+    }
     Function *currentFuction = context.blocksStack.top()->function;
-    Value *condition = expression->codeGen(context);
     BasicBlock *btrue = BasicBlock::Create(MyContext, "thenStmt", currentFuction);
     BasicBlock *bfalse = BasicBlock::Create(MyContext, "elseStmt", currentFuction);
     BasicBlock *bmerge = BasicBlock::Create(MyContext, "mergeStmt", currentFuction);
-    llvm::Instruction *ret = llvm::BranchInst::Create(btrue, bfalse, condition, context.currentBlock());
-    context.pushBlock(btrue);
-    context.blocksStack.top()->function = currentFuction;
+    EmitCondBranch(context, expression, btrue, bfalse);
 
+    context.builder.SetInsertPoint(btrue);
     stmt->codeGen(context);
-    llvm::BranchInst::Create(bmerge, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bfalse);
-    context.blocksStack.top()->function = currentFuction;
+    context.builder.CreateBr(bmerge);
+    context.builder.SetInsertPoint(bfalse);
     if (elseClause)
         elseClause->codeGen(context);
-    llvm::BranchInst::Create(bmerge, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bmerge);
-    context.blocksStack.top()->function = currentFuction;
-    return ret;
+    context.builder.CreateBr(bmerge);
+    context.builder.SetInsertPoint(bmerge);
+    return nullptr;
 }
 
 llvm::Value *ElseClause::codeGen(CodeGenContext &context) {
@@ -937,45 +3192,46 @@ llvm::Value *ElseClause::codeGen(CodeGenContext &context) {
 }
 
 llvm::Value *WhileStmt::codeGen(CodeGenContext &context) {
+    auto c = ConstantCondition(context, whileCondition);
+    if (c && c->isZero()) {
+        GenerateDeadCode(context, stmt);
+        return nullptr;
+    }
     Function *currentFuction = context.blocksStack.top()->function;
     BasicBlock *sloop = BasicBlock::Create(MyContext, "startloop", currentFuction);
     BasicBlock *bloop = BasicBlock::Create(MyContext, "loopStmt", currentFuction);
     BasicBlock *bexit = BasicBlock::Create(MyContext, "eixtStmt", currentFuction);
 
-    llvm::BranchInst::Create(sloop, context.currentBlock());
-    context.pushBlock(sloop);
-    context.blocksStack.top()->function = currentFuction;
-    Value *test = whileCondition->codeGen(context);
-    llvm::Instruction *ret = llvm::BranchInst::Create(bloop, bexit, test, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bloop);
-    context.blocksStack.top()->function = currentFuction;
+    context.builder.CreateBr(sloop);
+    context.builder.SetInsertPoint(sloop);
+    EmitCondBranch(context, whileCondition, bloop, bexit);
+    context.builder.SetInsertPoint(bloop);
     stmt->codeGen(context);
-    llvm::BranchInst::Create(sloop, context.currentBlock());
-    context.popBlock();
-    context.pushBlock(bexit);
-    context.blocksStack.top()->function = currentFuction;
-    return ret;
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_loop", context.addProfiledLoop(currentFuction, whileCondition->line));
+    context.builder.CreateBr(sloop);
+    context.builder.SetInsertPoint(bexit);
+    return nullptr;
 }
 
 llvm::Value *RepeatStmt::codeGen(CodeGenContext &context) {
+    // a body repeated until a condition that is always true runs once
+    auto c = ConstantCondition(context, untilCondition);
+    if (c && c->isOne())
+        return stmtList->codeGen(context);
     Function *currentFuction = context.blocksStack.top()->function;
     BasicBlock *bloop = BasicBlock::Create(MyContext, "loopStmt", currentFuction);
     BasicBlock *bexit = BasicBlock::Create(MyContext, "eixtStmt", currentFuction);
-    llvm::BranchInst::Create(bloop, context.currentBlock());
-
-    context.pushBlock(bloop);
-    context.blocksStack.top()->function = currentFuction;
+    context.builder.CreateBr(bloop);
 
+    context.builder.SetInsertPoint(bloop);
     stmtList->codeGen(context);
-    Value *test = untilCondition->codeGen(context);
-    llvm::Instruction *ret = llvm::BranchInst::Create(bexit, bloop, test, context.currentBlock());
-    context.popBlock();
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_loop", context.addProfiledLoop(currentFuction, untilCondition->line));
+    EmitCondBranch(context, untilCondition, bexit, bloop);
 
-    context.pushBlock(bexit);
-    context.blocksStack.top()->function = currentFuction;
-
-    return ret;
+    context.builder.SetInsertPoint(bexit);
+    return nullptr;
 }
 
 llvm::Value *Expression::codeGen(CodeGenContext &context) {
@@ -985,142 +3241,255 @@ llvm::Value *Expression::codeGen(CodeGenContext &context) {
     } else {
         Value *op1_val = expression->codeGen(context);
         Value *op2_val = expr->codeGen(context);
+        if (type == T_IN)
+            return SetMembership(context, op1_val, op2_val);
+        if (IsString(context, op1_val->getType()) && IsString(context, op2_val->getType())) {
+            Value *result = CompareStrings(context, type, op1_val, op2_val);
+            if (IsFreshString(context, expression))
+                FreeString(context, op1_val);
+            if (IsFreshString(context, expr))
+                FreeString(context, op2_val);
+            return result;
+        }
+        if (IsSet(op1_val) || IsSet(op2_val))
+            return CompareSets(context, type, op1_val, op2_val);
         if (op1_val->getType() == Type::getDoubleTy(MyContext) || op2_val->getType() == Type::getDoubleTy(MyContext)) {
             if (op1_val->getType() != Type::getDoubleTy(MyContext)) {
-                op1_val = CastInst::Create(
-                        CastInst::getCastOpcode(op1_val, true, Type::getDoubleTy(MyContext), true), op1_val,
-                        Type::getDoubleTy(MyContext), "", context.currentBlock());
+                op1_val = context.builder.CreateSIToFP(op1_val, Type::getDoubleTy(MyContext));
             }
             if (op2_val->getType() != Type::getDoubleTy(MyContext)) {
-                op2_val = CastInst::Create(
-                        CastInst::getCastOpcode(op2_val, true, Type::getDoubleTy(MyContext), true), op2_val,
-                        Type::getDoubleTy(MyContext), "", context.currentBlock());
+                op2_val = context.builder.CreateSIToFP(op2_val, Type::getDoubleTy(MyContext));
             }
         }
+        bool isReal = op1_val->getType() == Type::getDoubleTy(MyContext);
+        llvm::CmpInst::Predicate predicate;
         switch (type) {
             case T_EQ:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_EQ,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_OEQ : llvm::CmpInst::ICMP_EQ;
                 break;
             case T_NE:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_NE,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_UNE : llvm::CmpInst::ICMP_NE;
                 break;
             case T_LT:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_SLT,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_OLT : llvm::CmpInst::ICMP_SLT;
                 break;
             case T_GT:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_SGT,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_OGT : llvm::CmpInst::ICMP_SGT;
                 break;
             case T_LE:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_SLE,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_OLE : llvm::CmpInst::ICMP_SLE;
                 break;
             case T_GE:
-                res = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_SGE,
-                                            op1_val, op2_val, "", context.currentBlock());
+                predicate = isReal ? llvm::CmpInst::FCMP_OGE : llvm::CmpInst::ICMP_SGE;
                 break;
             default:
-                res = nullptr;
-                break;
+                return nullptr;
         }
+        res = context.builder.CreateICmp(predicate, op1_val, op2_val);
     }
     return res;
 }
 
-llvm::Value *Expr::codeGen(CodeGenContext &context) {
-    if (type == T_TERM)
-        return term->codeGen(context);
-    Value *op1_val = expr->codeGen(context);
-    Value *op2_val = term->codeGen(context);
+// op1 + op2, op1 - op2 or op1 or op2 on already evaluated operands
+static Value *EmitAdding(CodeGenContext &context, decltype(Expr::type) type, Value *op1_val, Value *op2_val) {
+    if (IsSet(op1_val) || IsSet(op2_val)) {
+        if (type == Expr::T_OR) {
+            std::cerr << "or is not defined on sets" << std::endl;
+            std::exit(1);
+        }
+        // union, and difference as a and not b
+        return CreateSetOp(context, type == Expr::T_PLUS ? llvm::Instruction::Or : llvm::Instruction::And,
+                           op1_val, op2_val, type == Expr::T_MINUS);
+    }
     if (op1_val->getType() == Type::getDoubleTy(MyContext) || op2_val->getType() == Type::getDoubleTy(MyContext)) {
         if (op1_val->getType() != Type::getDoubleTy(MyContext)) {
-            op1_val = CastInst::Create(
-                    CastInst::getCastOpcode(op1_val, true, Type::getDoubleTy(MyContext), true), op1_val,
-                    Type::getDoubleTy(MyContext), "", context.currentBlock());
+            op1_val = context.builder.CreateSIToFP(op1_val, Type::getDoubleTy(MyContext));
         }
         if (op2_val->getType() != Type::getDoubleTy(MyContext)) {
-            op2_val = CastInst::Create(
-                    CastInst::getCastOpcode(op2_val, true, Type::getDoubleTy(MyContext), true), op2_val,
-                    Type::getDoubleTy(MyContext), "", context.currentBlock());
+            op2_val = context.builder.CreateSIToFP(op2_val, Type::getDoubleTy(MyContext));
         }
     }
     assert(op1_val->getType() == op2_val->getType());
     switch (type) {
-        case T_PLUS:
+        case Expr::T_PLUS:
             if (op1_val->getType() == Type::getDoubleTy(MyContext))
-                return llvm::BinaryOperator::Create(llvm::Instruction::FAdd,
-                                                    op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateFAdd(op1_val, op2_val);
             else
-                return llvm::BinaryOperator::Create(llvm::Instruction::Add,
-                                                    op1_val, op2_val, "", context.currentBlock());
-        case T_MINUS:
+                return context.builder.CreateAdd(op1_val, op2_val);
+        case Expr::T_MINUS:
             if (op1_val->getType() == Type::getDoubleTy(MyContext))
-                return llvm::BinaryOperator::Create(llvm::Instruction::FSub,
-                                                    op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateFSub(op1_val, op2_val);
             else
-                return llvm::BinaryOperator::Create(llvm::Instruction::Sub,
-                                                    op1_val, op2_val, "", context.currentBlock());
-        case T_OR:
-            return llvm::BinaryOperator::Create(llvm::Instruction::Or,
-                                                op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateSub(op1_val, op2_val);
+        case Expr::T_OR:
+            return context.builder.CreateOr(op1_val, op2_val);
         default:
             return nullptr;
     }
 }
 
+llvm::Value *Expr::codeGen(CodeGenContext &context) {
+    if (type == T_TERM)
+        return term->codeGen(context);
+    if (type == T_PLUS) {
+        // a + b + c is evaluated as a whole so that string concatenation allocates only once
+        std::vector<Node *> operands;
+        Expr *e = this;
+        for (; e->type == T_PLUS; e = e->expr)
+            operands.insert(operands.begin(), e->term);
+        operands.insert(operands.begin(), e);
+        std::vector<Value *> values;
+        for (auto operand : operands)
+            values.push_back(operand->codeGen(context));
+        for (auto v : values) {
+            if (!IsString(context, v->getType()))
+                continue;
+            Value *result = ConcatStrings(context, values);
+            for (size_t i = 0; i < values.size(); i++)
+                if (IsString(context, values[i]->getType()) && IsFreshString(context, operands[i]))
+                    FreeString(context, values[i]);
+            return result;
+        }
+        Value *sum = values[0];
+        for (size_t i = 1; i < values.size(); i++)
+            sum = EmitAdding(context, T_PLUS, sum, values[i]);
+        return sum;
+    }
+    Value *op1_val = expr->codeGen(context);
+    if (type == T_OR && op1_val->getType() == Type::getInt1Ty(MyContext))
+        return EmitLogical(context, false, op1_val, term);
+    Value *op2_val = term->codeGen(context);
+    return EmitAdding(context, type, op1_val, op2_val);
+}
+
 llvm::Value *Term::codeGen(CodeGenContext &context) {
     if (type == T_FACTOR)
         return factor->codeGen(context);
     if (type == T_FACTOR)
         return factor->codeGen(context);
     Value *op1_val = term->codeGen(context);
+    if (type == T_AND && op1_val->getType() == Type::getInt1Ty(MyContext))
+        return EmitLogical(context, true, op1_val, factor);
     Value *op2_val = factor->codeGen(context);
+    if (IsSet(op1_val) || IsSet(op2_val)) {
+        if (type != T_MUL) {
+            std::cerr << "only * (intersection) is defined on sets among multiplying operators" << std::endl;
+            std::exit(1);
+        }
+        return CreateSetOp(context, llvm::Instruction::And, op1_val, op2_val, false);
+    }
     if (op1_val->getType() == Type::getDoubleTy(MyContext) || op2_val->getType() == Type::getDoubleTy(MyContext)) {
         if (op1_val->getType() != Type::getDoubleTy(MyContext)) {
-            op1_val = CastInst::Create(
-                    CastInst::getCastOpcode(op1_val, true, Type::getDoubleTy(MyContext), true), op1_val,
-                    Type::getDoubleTy(MyContext), "", context.currentBlock());
+            op1_val = context.builder.CreateSIToFP(op1_val, Type::getDoubleTy(MyContext));
         }
         if (op2_val->getType() != Type::getDoubleTy(MyContext)) {
-            op2_val = CastInst::Create(
-                    CastInst::getCastOpcode(op2_val, true, Type::getDoubleTy(MyContext), true), op2_val,
-                    Type::getDoubleTy(MyContext), "", context.currentBlock());
+            op2_val = context.builder.CreateSIToFP(op2_val, Type::getDoubleTy(MyContext));
         }
     }
     assert(op1_val->getType() == op2_val->getType());
     switch (type) {
         case T_MUL:
             if (op1_val->getType() == Type::getDoubleTy(MyContext)) {
-                return llvm::BinaryOperator::Create(llvm::Instruction::FMul,
-                                                    op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateFMul(op1_val, op2_val);
             } else
-                return llvm::BinaryOperator::Create(llvm::Instruction::Mul,
-                                                    op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateMul(op1_val, op2_val);
         case T_DIV:
             if (op1_val->getType() == Type::getInt32Ty(MyContext))
-                return llvm::BinaryOperator::Create(llvm::Instruction::SDiv,
-                                                    op1_val, op2_val, "", context.currentBlock());
+                return context.builder.CreateSDiv(op1_val, op2_val);
             else
-                return llvm::BinaryOperator::Create(llvm::Instruction::FDiv, op1_val, op2_val, "",
-                                                    context.currentBlock());
+                return context.builder.CreateFDiv(op1_val, op2_val);
         case T_AND:
-            return llvm::BinaryOperator::Create(llvm::Instruction::And,
-                                                op1_val, op2_val, "", context.currentBlock());
+            return context.builder.CreateAnd(op1_val, op2_val);
         case T_MOD:
-            return llvm::BinaryOperator::Create(llvm::Instruction::SRem,
-                                                op1_val, op2_val, "", context.currentBlock());
+            return context.builder.CreateSRem(op1_val, op2_val);
         default:
             return nullptr;
     }
 }
 
+// System functions are inline IR or intrinsics rather than library calls, so they stay free of side effects
+// and fold or vectorize with the code around them.
+// length(a): the number of elements of an array, from the header of a dynamic one and a constant otherwise.
+static Value *ArrayLength(CodeGenContext &context, Expression *arg) {
+  Factor *f = AsVariable(arg);
+  CodeGenBlock *b = f && f->type == Factor::T_NAME ? context.isVariable(f->name) : nullptr;
+  TypeDecl *t = b && b->varTypes.count(f->name) ? ResolveType(context, b->varTypes[f->name]) : nullptr;
+  if (!t || t->type != TypeDecl::T_ARRAY_TYPE_DECLARE) {
+    std::cerr << "length needs an array variable" << std::endl;
+    std::exit(1);
+  }
+  Type *i32 = Type::getInt32Ty(MyContext);
+  if (t->arrayTypeDecl->range)
+    return ConstantInt::get(i32, t->arrayTypeDecl->range->getRange(context.constTable));
+  return context.builder.CreateTrunc(LoadArrayHeader(context, arg->codeGen(context), 1), i32);
+}
+
+static Value *SysFunction(CodeGenContext &context, const std::string &function, ArgsList *argsList) {
+  if (!argsList || argsList->preList) {
+    std::cerr << function << " takes exactly one argument" << std::endl;
+    std::exit(1);
+  }
+  if (function == "length")
+    return ArrayLength(context, argsList->expression);
+  Value *x = argsList->expression->codeGen(context);
+  Type *type = x->getType();
+  bool isReal = type->isDoubleTy();
+  if (!isReal && !type->isIntegerTy()) {
+    std::cerr << function << " needs a numeric or ordinal argument" << std::endl;
+    std::exit(1);
+  }
+  if (function == "chr") {
+    return context.builder.CreateIntCast(x, Type::getInt8Ty(MyContext), false);
+  } else if (function == "ord") {
+    // chars and booleans are unsigned
+    return context.builder.CreateIntCast(x, Type::getInt32Ty(MyContext), type->isIntegerTy(32));
+  } else if (function == "abs") {
+    if (isReal) {
+      Function *fabs = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::fabs, {type});
+      return context.builder.CreateCall(fabs, {x});
+    }
+    Value *negative = context.builder.CreateICmp(llvm::CmpInst::ICMP_SLT, x, ConstantInt::get(type, 0));
+    Value *negated = context.builder.CreateSub(ConstantInt::get(type, 0), x);
+    return context.builder.CreateSelect(negative, negated, x);
+  } else if (function == "sqr") {
+    if (isReal)
+      return context.builder.CreateFMul(x, x);
+    return context.builder.CreateNSWMul(x, x);
+  } else if (function == "sqrt") {
+    if (!isReal)
+      x = context.builder.CreateCast(llvm::Instruction::SIToFP, x, Type::getDoubleTy(MyContext));
+    Function *sqrt = llvm::Intrinsic::getDeclaration(context.module, llvm::Intrinsic::sqrt, {x->getType()});
+    return context.builder.CreateCall(sqrt, {x});
+  } else if (function == "odd") {
+    if (isReal) {
+      std::cerr << "odd needs an integer argument" << std::endl;
+      std::exit(1);
+    }
+    // the low bit, at any integer width (a boolean is its own low bit)
+    Value *low = context.builder.CreateAnd(x, ConstantInt::get(type, 1));
+    return context.builder.CreateICmpNE(low, ConstantInt::get(type, 0));
+  } else if (function == "succ" || function == "pred") {
+    if (isReal) {
+      std::cerr << function << " needs an ordinal argument" << std::endl;
+      std::exit(1);
+    }
+    bool noWrap = type->isIntegerTy(32);
+    if (function == "succ")
+      return context.builder.CreateAdd(x, ConstantInt::get(type, 1), "", false, noWrap);
+    return context.builder.CreateSub(x, ConstantInt::get(type, 1), "", false, noWrap);
+  }
+  std::cerr << "unknown system function: " << function << std::endl;
+  std::exit(1);
+}
+
 llvm::Value *Factor::codeGen(CodeGenContext &context) {
     auto p = context.blocksStack.top();
     switch (type) {
         case T_NAME: {
+            if (context.isLoopVariable(name))
+                return context.loopVariables[name].induction;
+            if (Value *element = GetElementRef(context, name))
+                return CreateLoad(context, element);
             while (p) {
                 if (p->locals.find(name) == p->locals.end()) {
                     p = p->preBlock;
@@ -1132,10 +3501,18 @@ llvm::Value *Factor::codeGen(CodeGenContext &context) {
                 if (context.constTable.isConst(name))
                     return p->locals[name];
                 if (context.isReference(name)) {
-                    auto tmp = new llvm::LoadInst(p->locals[name], "", false, context.currentBlock());
-                    return new llvm::LoadInst(tmp, "", false, context.currentBlock());
+                    auto tmp = CreateLoad(context, p->locals[name]);
+                    return CreateLoad(context, tmp);
                 }
-                return new llvm::LoadInst(p->locals[name], "", false, context.currentBlock());
+                return CreateLoad(context, p->locals[name]);
+            }
+            // a function without parameters is called by its bare name
+            if (IsFunctionCall(context, this)) {
+                ElementLoop *loop = context.elementLoop;
+                context.elementLoop = nullptr;
+                Value *v = funcGen(context, name, nullptr);
+                context.elementLoop = loop;
+                return v;
             }
             fmt::print("Undefined variable: {}\n", name);
             exit(1);
@@ -1145,129 +3522,786 @@ llvm::Value *Factor::codeGen(CodeGenContext &context) {
         case T_EXPR:
             return expression->codeGen(context);
         case T_NOT_FACTOR: {
-            Value *tmp;
-            assert(factor->type == T_NAME);
-            Function *currentFuction = context.blocksStack.top()->function;
             Value *v = factor->codeGen(context);
-            BasicBlock *btrue = BasicBlock::Create(MyContext, "thenStmt", context.blocksStack.top()->function);
-            BasicBlock *bfalse = BasicBlock::Create(MyContext, "elseStmt", context.blocksStack.top()->function);
-            BasicBlock *bmerge = BasicBlock::Create(MyContext, "mergeStmt", context.blocksStack.top()->function);
-            llvm::Instruction *ret = llvm::BranchInst::Create(btrue, bfalse, v, context.currentBlock());
-            context.pushBlock(btrue);
-            context.blocksStack.top()->function = currentFuction;
-            if (v->getType() == Type::getDoubleTy(MyContext)) {
-                tmp = ConstantFP::get(MyContext, llvm::APFloat(0.0));
-            } else {
-                tmp = ConstantInt::get(MyContext, llvm::APInt(32, 0, false));
-            }
-            llvm::BranchInst::Create(bmerge, context.currentBlock());
-            context.popBlock();
-            context.pushBlock(bfalse);
-            context.blocksStack.top()->function = currentFuction;
-            if (v->getType() == Type::getDoubleTy(MyContext)) {
-                tmp = ConstantFP::get(MyContext, llvm::APFloat(1.0));
-            } else {
-                tmp = ConstantInt::get(MyContext, llvm::APInt(32, 1, false));
-            }
-            llvm::BranchInst::Create(bmerge, context.currentBlock());
-            context.popBlock();
-            context.pushBlock(bmerge);
-            context.blocksStack.top()->function = currentFuction;
-
-            return tmp;
+            if (v->getType() == Type::getInt1Ty(MyContext))
+                return context.builder.CreateNot(v);
+            // not x on numbers is (x = 0), kept in the operand's type
+            Value *isZero;
+            if (v->getType() == Type::getDoubleTy(MyContext))
+                isZero = context.builder.CreateFCmp(llvm::CmpInst::FCMP_OEQ, v, ConstantFP::get(v->getType(), 0.0));
+            else
+                isZero = context.builder.CreateICmp(llvm::CmpInst::ICMP_EQ, v, ConstantInt::get(v->getType(), 0));
+            Value *one = v->getType()->isDoubleTy() ? ConstantFP::get(v->getType(), 1.0) : ConstantInt::get(v->getType(), 1);
+            return context.builder.CreateSelect(isZero, one, Constant::getNullValue(v->getType()));
+        }
+        case T_NAME_ARGS: {
+            // the arguments of a call in an element-wise expression are whole arrays, not elements
+            ElementLoop *loop = context.elementLoop;
+            context.elementLoop = nullptr;
+            Value *v = funcGen(context, name, argsList);
+            context.elementLoop = loop;
+            return v;
         }
-        case T_NAME_ARGS:
-            return funcGen(context, name, argsList);
         case T_MINUS_FACTOR: {
             auto val_2 = factor->codeGen(context);
             if (val_2->getType() == Type::getDoubleTy(MyContext)) {
-                return BinaryOperator::Create(Instruction::FSub, ConstantFP::get(MyContext, llvm::APFloat(0.0)),
-                                              val_2, "", context.currentBlock());
+                return context.builder.CreateFSub(ConstantFP::get(MyContext, llvm::APFloat(0.0)), val_2);
             } else
-                return BinaryOperator::Create(Instruction::Sub,
-                                              ConstantInt::get(val_2->getType(), llvm::APInt(32, 0, false)), val_2,
-                                              "",
-                                              context.currentBlock());
+                return context.builder.CreateSub(ConstantInt::get(val_2->getType(), llvm::APInt(32, 0, false)), val_2);
+        }
+        case T_ID_DOT_ID: {
+            auto load = CreateLoad(context, GetRecordRef(context, id, recordId));
+            if (IsPackedRecord(context, id))
+                load->setAlignment(1);
+            return load;
+        }
+        case T_SET:
+            return SetConstructor(context, setElements);
+        case T_ID_EXPR: {
+            Value *bit = nullptr;
+            Value *ref = GetArrayRef(context, id, indexList, &bit);
+            if (bit)
+                return LoadPackedBit(context, ref, bit);
+            return CreateLoad(context, ref);
         }
-        case T_ID_DOT_ID:
-            return new LoadInst(GetRecordRef(context, id, recordId), "", false, context.currentBlock());
-        case T_ID_EXPR:
-            return new LoadInst(GetArrayRef(context, id, expression), "", false, context.currentBlock());
         case T_SYS_FUNCT_ARGS:
-            if (sysFunction == "chr") {
-                auto intV = argsList->expression->codeGen(context);
-                return CastInst::CreateIntegerCast(intV, Type::getInt8Ty(MyContext), false, "",
-                                                   context.currentBlock());
-            } else if (sysFunction == "ord") {
-                auto chrV = argsList->expression->codeGen(context);
-                return CastInst::CreateIntegerCast(chrV, Type::getInt32Ty(MyContext), true, "",
-                                                   context.currentBlock());
-            }
-            break;
+            return SysFunction(context, sysFunction, argsList);
         default:
             return nullptr;
     }
     return nullptr;
 }
 
-llvm::Value *ForStmt::codeGen(CodeGenContext &context) {
-    Function *currentFuction = context.blocksStack.top()->function;
-    BasicBlock *sloop = BasicBlock::Create(MyContext, "startloop", currentFuction);
-    BasicBlock *bloop = BasicBlock::Create(MyContext, "loopStmt", currentFuction);
-    BasicBlock *bexit = BasicBlock::Create(MyContext, "eixtStmt", currentFuction);
-    AssignStmt *initial = new AssignStmt(loopId, firstBound);
-    initial->codeGen(context);
-    llvm::BranchInst::Create(sloop, context.currentBlock());
-    context.pushBlock(sloop);
-    context.blocksStack.top()->function = currentFuction;
-
-    auto *f = new Factor(Factor::T_NAME, loopId);
-    Value *test = llvm::CmpInst::Create(llvm::Instruction::ICmp, llvm::CmpInst::ICMP_EQ,
-                                        f->codeGen(context), secondBound->codeGen(context), "",
-                                        context.currentBlock());
-    llvm::Instruction *ret = llvm::BranchInst::Create(bexit, bloop, test, context.currentBlock());
-    context.popBlock();
+// Matches `name`, `name + c` and `name - c`, returning c in offset.
+static bool IsAffineIndex(Expression *e, const std::string &name, int64_t &offset) {
+  if (!e || e->type != Expression::T_EXPR)
+    return false;
+  Expr *x = e->expr;
+  offset = 0;
+  if (x->type == Expr::T_PLUS || x->type == Expr::T_MINUS) {
+    Term *t = x->term;
+    if (t->type != Term::T_FACTOR || t->factor->type != Factor::T_CONST ||
+        t->factor->constValue->type != ConstValue::T_INTEGER)
+      return false;
+    offset = std::stoll(t->factor->constValue->value);
+    if (x->type == Expr::T_MINUS)
+      offset = -offset;
+    x = x->expr;
+  }
+  if (x->type != Expr::T_TERM || x->term->type != Term::T_FACTOR)
+    return false;
+  Factor *f = x->term->factor;
+  return f->type == Factor::T_NAME && f->name == name;
+}
 
-    context.pushBlock(bloop);
-    context.blocksStack.top()->function = currentFuction;
-    stmt->codeGen(context);
-    Factor *f1;
-    auto int1 = new ConstValue("1", ConstValue::T_INTEGER);
-    Value *update;
-    if (direction->type == Direction::T_TO) {
-        f1 = new Factor(Factor::T_NAME, loopId);
-        update = llvm::BinaryOperator::Create(llvm::Instruction::Add,
-                                              f1->codeGen(context), int1->codeGen(context), "",
-                                              context.currentBlock());
-    } else {
-        f1 = new Factor(Factor::T_NAME, loopId);
-        update = llvm::BinaryOperator::Create(llvm::Instruction::Sub,
-                                              f1->codeGen(context), int1->codeGen(context), "",
-                                              context.currentBlock());
+// Array accesses made on every run of a loop body; conditional statements, nested loops
+// and the right operands of and/or are left out.
+static void CollectArrayAccesses(Node *node, std::vector<std::pair<std::string, ExpressionList *>> &accesses) {
+  if (!node || dynamic_cast<IfStmt *>(node) || dynamic_cast<WhileStmt *>(node) ||
+      dynamic_cast<RepeatStmt *>(node) || dynamic_cast<ForStmt *>(node) || dynamic_cast<CaseStmt *>(node))
+    return;
+  if (auto e = dynamic_cast<Expr *>(node)) {
+    if (e->type == Expr::T_OR) {
+      CollectArrayAccesses(e->expr, accesses);
+      return;
     }
-    CodeGenBlock *b = context.blocksStack.top();
-    while (b) {
-        if (b->locals.find(loopId) == b->locals.end()) {
-            b = b->preBlock;
-            continue;
-        }
-        if (context.isReference(loopId)) {
-            auto tmp = new llvm::LoadInst(b->locals[loopId], "", false, context.currentBlock());
-            return new llvm::StoreInst(update, tmp, false, context.currentBlock());
+  } else if (auto t = dynamic_cast<Term *>(node)) {
+    if (t->type == Term::T_AND) {
+      CollectArrayAccesses(t->term, accesses);
+      return;
+    }
+  } else if (auto f = dynamic_cast<Factor *>(node)) {
+    if (f->type == Factor::T_ID_EXPR)
+      accesses.emplace_back(f->id, f->indexList);
+  } else if (auto a = dynamic_cast<AssignStmt *>(node)) {
+    if (a->type == AssignStmt::T_ARRAY)
+      accesses.emplace_back(a->id, a->index);
+  }
+  for (auto child : node->getChildren())
+    CollectArrayAccesses(child, accesses);
+}
+
+// Indices that follow the control variable are checked at both ends of its range, indices that follow
+// an enclosing loop's variable once per entry; the accesses in the body then go unchecked.
+static void HoistBoundsChecks(CodeGenContext &context, ForStmt *loop, Value *first, Value *last) {
+  if (!first->getType()->isIntegerTy(32))
+    return;
+  std::vector<std::pair<std::string, ExpressionList *>> accesses;
+  CollectArrayAccesses(loop->stmt, accesses);
+  std::set<std::tuple<std::string, size_t, std::string, int64_t>> emitted;
+  for (auto &access : accesses) {
+    const std::string &id = access.first;
+    CodeGenBlock *b = context.isVariable(id);
+    if (!b || b->varTypes.find(id) == b->varTypes.end() || IsDynamicArray(context, b->varTypes[id]))
+      continue;
+    std::vector<Expression *> exprs;
+    for (ExpressionList *l = access.second; l; l = l->preList)
+      exprs.insert(exprs.begin(), l->expression);
+    TypeDecl *elementType = b->varTypes[id];
+    std::vector<ArrayTypeDecl *> dims = GetArrayDims(context, id, exprs.size(), elementType);
+    for (size_t k = 0; k < dims.size(); k++) {
+      std::string var;
+      int64_t offset;
+      Value *low = nullptr, *high = nullptr;
+      if (IsAffineIndex(exprs[k], loop->loopId, offset)) {
+        var = loop->loopId, low = first, high = last;
+      } else {
+        for (auto &l : context.loopVariables) {
+          if (l.second.induction->getType()->isIntegerTy(32) && IsAffineIndex(exprs[k], l.first, offset)) {
+            var = l.first, low = high = l.second.induction;
+            break;
+          }
         }
-        new llvm::StoreInst(update, b->locals[loopId], false, context.currentBlock());
-        break;
+      }
+      if (!low)
+        continue;
+      context.hoistedBoundsChecks.insert(exprs[k]);
+      if (!emitted.insert(std::make_tuple(id, k, var, offset)).second)
+        continue;
+      auto shift = [&](Value *v) -> Value * {
+        if (offset == 0)
+          return v;
+        return context.builder.CreateNSWAdd(v, ConstantInt::get(v->getType(), offset, true));
+      };
+      bool single = low == high;
+      low = shift(low);
+      high = single ? low : shift(high);
+
+      int64_t lo0, hi0, lo1, hi1;
+      int64_t lower = dims[k]->getLowerBound(context.constTable);
+      int64_t upper = lower + dims[k]->range->getRange(context.constTable) - 1;
+      if (GetValueRange(context, low, lo0, hi0) && GetValueRange(context, high, lo1, hi1) &&
+          std::min(lo0, lo1) >= lower && std::max(hi0, hi1) <= upper) {
+        RecordBoundsCheck(context, BoundsCheck::T_RANGE, id, k);
+        continue;
+      }
+      RecordBoundsCheck(context, BoundsCheck::T_HOISTED, id, k);
+      EmitBoundsCheck(context, id, dims[k], low);
+      if (high != low)
+        EmitBoundsCheck(context, id, dims[k], high);
+    }
+  }
+}
+
+// The memory a variable is kept in, through the reference if it is one.
+static Value *GetVariableStorage(CodeGenContext &context, const std::string &name) {
+  Value *storage = context.isVariable(name)->locals[name];
+  return context.isReference(name) ? CreateLoad(context, storage) : storage;
+}
+
+static Constant *GetReductionIdentity(const std::string &op, Type *type) {
+  bool real = type->isDoubleTy();
+  if (op == "+")
+    return Constant::getNullValue(type);
+  if (op == "*")
+    return real ? ConstantFP::get(type, 1.0) : ConstantInt::get(type, 1);
+  if (real)
+    return ConstantFP::get(type, op == "min" ? std::numeric_limits<double>::infinity()
+                                             : -std::numeric_limits<double>::infinity());
+  unsigned bits = type->getIntegerBitWidth();
+  return ConstantInt::get(MyContext, op == "min" ? APInt::getSignedMaxValue(bits) : APInt::getSignedMinValue(bits));
+}
+
+static Value *CombineReduction(CodeGenContext &context, const std::string &op, Value *a, Value *b) {
+  bool real = a->getType()->isDoubleTy();
+  if (op == "+")
+    return real ? context.builder.CreateFAdd(a, b) : context.builder.CreateAdd(a, b);
+  if (op == "*")
+    return real ? context.builder.CreateFMul(a, b) : context.builder.CreateMul(a, b);
+  Value *less = real ? context.builder.CreateFCmpOLT(a, b) : context.builder.CreateICmpSLT(a, b);
+  return op == "min" ? context.builder.CreateSelect(less, a, b) : context.builder.CreateSelect(less, b, a);
+}
+
+// The clauses of an explicit parallel for: the operator of each reduction variable, and the private variables.
+static void GetParallelClauses(CodeGenContext &context, ForStmt *loop, std::map<std::string, std::string> &reductions,
+                               std::set<std::string> &privates) {
+  for (ParallelClause *c = loop->parallelClauses; c; c = c->preList) {
+    bool isPrivate = c->kind == "private";
+    if (!isPrivate && c->kind != "+" && c->kind != "*" && c->kind != "min" && c->kind != "max") {
+      std::cerr << "unknown parallel clause: " << c->kind << std::endl;
+      std::exit(1);
     }
-    llvm::BranchInst::Create(sloop, context.currentBlock());
+    for (NameList *n = c->names; n; n = n->nameList) {
+      CodeGenBlock *b = context.isVariable(n->name);
+      if (!b || context.constTable.isConst(n->name) || context.isLoopVariable(n->name) || n->name == loop->loopId ||
+          reductions.count(n->name) || privates.count(n->name)) {
+        std::cerr << "not a variable the parallel loop can make private: " << n->name << std::endl;
+        std::exit(1);
+      }
+      Type *type = b->varTypes[n->name]->getType(context, "");
+      if (!isPrivate && !type->isDoubleTy() && !type->isIntegerTy(32)) {
+        std::cerr << "reduction variable must be an integer or real: " << n->name << std::endl;
+        std::exit(1);
+      }
+      if (isPrivate)
+        privates.insert(n->name);
+      else
+        reductions[n->name] = c->kind;
+    }
+  }
+}
+
+// Run a parallel for on the thread pool of runtime/parallel.c. The body is outlined into
+// void(i8 *env, i64 lo, i64 hi), which runs iterations lo..hi in increasing order; env holds the
+// addresses of the variables it captures, bound in it like those of a nested routine. Every chunk
+// gets its own private variables and reduction accumulators, and folds the accumulators into the
+// shared variables under the runtime's lock when it is done. Loops of fewer than grain iterations
+// run sequentially.
+static void EmitParallelFor(CodeGenContext &context, ForStmt *loop, Value *first, Value *last,
+                            const std::map<std::string, std::string> &reductions,
+                            const std::set<std::string> &privates, int64_t grain) {
+  std::set<std::string> names, calls;
+  CollectNames(loop->stmt, names, calls);
+  names.erase(loop->loopId);
+  for (auto &p : privates)
+    names.erase(p);
+  std::map<std::string, Value *> shared;
+  for (auto &r : reductions) {
+    names.insert(r.first);
+    shared[r.first] = context.isVariable(r.first)->locals[r.first];
+  }
+  // the control variables of enclosing loops are read from memory in the body
+  for (auto &name : names)
+    if (context.isLoopVariable(name))
+      context.builder.CreateStore(context.loopVariables[name].induction, GetVariableStorage(context, name));
+  std::vector<Capture> captures = FindCaptures(context, names, calls);
+
+  Type *i64 = Type::getInt64Ty(MyContext);
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  std::vector<Type *> fields;
+  for (auto &capture : captures)
+    fields.push_back(capture.reference ? capture.variable->getType()->getPointerElementType()
+                                       : capture.variable->getType());
+  StructType *envType = StructType::get(MyContext, fields);
+  Value *env = Constant::getNullValue(bytes);
+  if (!captures.empty()) {
+    AllocaInst *envSlot = CreateEntryAlloca(context, envType);
+    for (size_t i = 0; i < captures.size(); i++)
+      context.builder.CreateStore(GetCaptureAddress(context, captures[i], loop->loopId),
+                                  context.builder.CreateStructGEP(envType, envSlot, i));
+    env = context.builder.CreateBitCast(envSlot, bytes);
+  }
+
+  auto bodyType = FunctionType::get(Type::getVoidTy(MyContext), {bytes, i64, i64}, false);
+  std::string name = context.blocksStack.top()->function->getName().str() + ".parallel." + loop->loopId;
+  Function *body = Function::Create(bodyType, GlobalValue::InternalLinkage, name, context.module);
+  Type *type = first->getType();
+  // char and boolean bounds are unsigned
+  bool isSigned = type->getIntegerBitWidth() >= 32;
+  {
+    IRBuilderBase::InsertPointGuard resume(context.builder);
+    auto outerLoops = std::move(context.loopVariables);
+    context.loopVariables.clear();
+    bool outerParallel = context.inParallelBody;
+    context.inParallelBody = true;
+    context.debugRoutine(body, name, loop->line);
+    context.pushBlock(BasicBlock::Create(MyContext, "entry", body));
+    context.blocksStack.top()->function = body;
+    context.setFastMath(body, context.builder.getFastMathFlags());
+    if (context.options.instrumentRoutines)
+      context.profileProbe("spl_prof_enter", context.addProfiledRoutine(body, name, loop->line));
+    auto arg = body->arg_begin();
+    Value *envArg = &*arg++;
+    Value *lo = &*arg++;
+    Value *hi = &*arg;
+    envArg->setName("env");
+    lo->setName("lo");
+    hi->setName("hi");
+
+    for (auto &p : privates) {
+      TypeDecl *t = context.isVariable(p)->varTypes[p];
+      AllocaInst *copy = context.builder.CreateAlloca(t->getType(context, ""), nullptr, p);
+      context.local()[p] = copy;
+      context.varType()[p] = t;
+      if (HasStrings(context, copy->getAllocatedType())) {
+        context.builder.CreateStore(Constant::getNullValue(copy->getAllocatedType()), copy);
+        context.blocksStack.top()->strings.push_back(copy);
+      }
+    }
+    for (auto &r : reductions) {
+      TypeDecl *t = context.isVariable(r.first)->varTypes[r.first];
+      Type *rtype = t->getType(context, "");
+      AllocaInst *accumulator = context.builder.CreateAlloca(rtype, nullptr, r.first);
+      context.builder.CreateStore(GetReductionIdentity(r.second, rtype), accumulator);
+      context.local()[r.first] = accumulator;
+      context.varType()[r.first] = t;
+    }
+    std::vector<Value *> addresses;
+    Value *envRef = context.builder.CreateBitCast(envArg, envType->getPointerTo());
+    for (size_t i = 0; i < captures.size(); i++)
+      addresses.push_back(CreateLoad(context, context.builder.CreateStructGEP(envType, envRef, i)));
+    BindCaptures(context, captures, addresses);
+
+    Value *begin = context.builder.CreateIntCast(lo, type, isSigned);
+    Value *end = context.builder.CreateIntCast(hi, type, isSigned);
+    if (context.options.checkBounds)
+      HoistBoundsChecks(context, loop, begin, end);
+    BasicBlock *entry = context.currentBlock();
+    BasicBlock *bloop = BasicBlock::Create(MyContext, "loopStmt", body);
+    BasicBlock *bexit = BasicBlock::Create(MyContext, "eixtStmt", body);
+    context.builder.CreateBr(bloop);
+    context.builder.SetInsertPoint(bloop);
+    PHINode *induction = context.builder.CreatePHI(type, 2, loop->loopId);
+    induction->addIncoming(begin, entry);
+    context.loopVariables[loop->loopId] = {induction, begin, end};
+    loop->stmt->codeGen(context);
+    context.loopVariables.erase(loop->loopId);
+    if (context.options.instrumentRoutines)
+      context.profileProbe("spl_prof_loop", context.addProfiledLoop(body, loop->firstBound->line));
+    BasicBlock *latch = context.currentBlock();
+    Value *done = context.builder.CreateICmpEQ(induction, end);
+    induction->addIncoming(context.builder.CreateNSWAdd(induction, ConstantInt::get(type, 1)), latch);
+    loop->loopID = CreateLoopID({});
+    context.builder.CreateCondBr(done, bexit, bloop)->setMetadata(llvm::LLVMContext::MD_loop, loop->loopID);
+
+    context.builder.SetInsertPoint(bexit);
+    if (!reductions.empty()) {
+      auto lockType = FunctionType::get(Type::getVoidTy(MyContext), false);
+      context.builder.CreateCall(context.module->getOrInsertFunction("spl_parallel_lock", lockType), {});
+      for (auto &r : reductions) {
+        Value *target = shared[r.first];
+        if (!llvm::isa<GlobalVariable>(target))
+          target = CreateLoad(context, context.blocksStack.top()->captures[target]);
+        Value *partial = CreateLoad(context, context.local()[r.first]);
+        context.builder.CreateStore(CombineReduction(context, r.second, CreateLoad(context, target), partial), target);
+      }
+      context.builder.CreateCall(context.module->getOrInsertFunction("spl_parallel_unlock", lockType), {});
+    }
+    ReleaseLocals(context);
+    if (context.options.instrumentRoutines)
+      context.profileProbe("spl_prof_exit", context.routineIds[body]);
+    context.builder.CreateRetVoid();
     context.popBlock();
+    context.loopVariables = std::move(outerLoops);
+    context.inParallelBody = outerParallel;
+  }
+
+  bool up = loop->direction->type == Direction::T_TO;
+  auto runType = FunctionType::get(Type::getVoidTy(MyContext), {bodyType->getPointerTo(), bytes, i64, i64, i64},
+                                   false);
+  context.builder.CreateCall(context.module->getOrInsertFunction("spl_parallel_for", runType),
+                             {body, env, context.builder.CreateIntCast(up ? first : last, i64, isSigned),
+                              context.builder.CreateIntCast(up ? last : first, i64, isSigned),
+                              ConstantInt::get(i64, grain)});
+}
+
+// Whether node computes scale * var + offset, from integer constants, const names and var itself.
+static bool GetAffineSubscript(CodeGenContext &context, Node *node, const std::string &var, int64_t &scale,
+                               int64_t &offset) {
+  int64_t scale1, offset1, scale2, offset2;
+  if (auto e = dynamic_cast<Expression *>(node))
+    return e->type == Expression::T_EXPR && GetAffineSubscript(context, e->expr, var, scale, offset);
+  if (auto e = dynamic_cast<Expr *>(node)) {
+    if (e->type == Expr::T_TERM)
+      return GetAffineSubscript(context, e->term, var, scale, offset);
+    if (e->type == Expr::T_OR || !GetAffineSubscript(context, e->expr, var, scale1, offset1) ||
+        !GetAffineSubscript(context, e->term, var, scale2, offset2))
+      return false;
+    int64_t sign = e->type == Expr::T_PLUS ? 1 : -1;
+    scale = scale1 + sign * scale2, offset = offset1 + sign * offset2;
+    return true;
+  }
+  if (auto t = dynamic_cast<Term *>(node)) {
+    if (t->type == Term::T_FACTOR)
+      return GetAffineSubscript(context, t->factor, var, scale, offset);
+    if (t->type != Term::T_MUL || !GetAffineSubscript(context, t->term, var, scale1, offset1) ||
+        !GetAffineSubscript(context, t->factor, var, scale2, offset2) || (scale1 && scale2))
+      return false;
+    scale = scale1 * offset2 + scale2 * offset1, offset = offset1 * offset2;
+    return true;
+  }
+  auto f = dynamic_cast<Factor *>(node);
+  if (!f)
+    return false;
+  switch (f->type) {
+    case Factor::T_CONST:
+      if (f->constValue->type != ConstValue::T_INTEGER)
+        return false;
+      scale = 0, offset = std::stoll(f->constValue->value);
+      return true;
+    case Factor::T_NAME: {
+      if (f->name == var) {
+        scale = 1, offset = 0;
+        return true;
+      }
+      CodeGenBlock *b = context.isVariable(f->name);
+      auto c = b ? llvm::dyn_cast<ConstantInt>(b->locals[f->name]) : nullptr;
+      if (!c || c->getBitWidth() != 32)
+        return false;
+      scale = 0, offset = c->getSExtValue();
+      return true;
+    }
+    case Factor::T_EXPR:
+      return GetAffineSubscript(context, f->expression, var, scale, offset);
+    case Factor::T_MINUS_FACTOR:
+      if (!GetAffineSubscript(context, f->factor, var, scale, offset))
+        return false;
+      scale = -scale, offset = -offset;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// What the body of a for loop uses and assigns, gathered before it is generated.
+class LoopBody {
+public:
+  // whole-variable assignments, and the control variables of nested loops
+  std::map<std::string, std::vector<AssignStmt *>> assignments;
+  std::set<std::string> innerLoops;
+  // how often each variable is used by name, element accesses aside
+  std::map<std::string, int> uses;
+  // the subscripts of every element access to each array, and whether it writes the element
+  std::map<std::string, std::vector<std::pair<ExpressionList *, bool>>> elements;
+  std::set<std::string> calls;
+  // a statement that keeps the loop sequential whatever the rest does
+  std::string sequential;
+};
+
+static void ScanLoopBody(CodeGenContext &context, Node *node, LoopBody &body) {
+  if (!node)
+    return;
+  if (auto s = dynamic_cast<NonLabelStmt *>(node)) {
+    if (s->type == NonLabelStmt::T_GOTO && body.sequential.empty())
+      body.sequential = "contains a goto";
+  } else if (auto a = dynamic_cast<AssignStmt *>(node)) {
+    if (a->type == AssignStmt::T_SIMPLE)
+      body.assignments[a->id].push_back(a);
+    else if (a->type == AssignStmt::T_ARRAY)
+      body.elements[a->id].emplace_back(a->index, true);
+    else if (body.sequential.empty())
+      body.sequential = "assigns to the record field " + a->id + "." + a->recordId;
+  } else if (auto f = dynamic_cast<ForStmt *>(node)) {
+    body.innerLoops.insert(f->loopId);
+  } else if (auto p = dynamic_cast<ProcStmt *>(node)) {
+    if (p->type == ProcStmt::T_SIMPLE || p->type == ProcStmt::T_SIMPLE_ARGS)
+      body.calls.insert(p->procId);
+    else if (body.sequential.empty())
+      body.sequential = "calls " + (p->type == ProcStmt::T_READ ? std::string("read") : p->sysProc);
+  } else if (auto f = dynamic_cast<Factor *>(node)) {
+    if (f->type == Factor::T_NAME && context.isVariable(f->name)) {
+      body.uses[f->name]++;
+    } else if (IsFunctionCall(context, f)) {
+      body.calls.insert(f->name);
+    } else if (f->type == Factor::T_ID_EXPR) {
+      body.elements[f->id].emplace_back(f->indexList, false);
+    } else if (f->type == Factor::T_ID_DOT_ID) {
+      body.uses[f->id]++;
+    }
+  }
+  for (auto child : node->getChildren())
+    ScanLoopBody(context, child, body);
+}
+
+// How often the statements under node name the variable, to assign it or to use it.
+static int CountMentions(Node *node, const std::string &name) {
+  if (!node)
+    return 0;
+  int count = 0;
+  if (auto a = dynamic_cast<AssignStmt *>(node))
+    count = a->id == name;
+  else if (auto f = dynamic_cast<ForStmt *>(node))
+    count = f->loopId == name;
+  else if (auto f = dynamic_cast<Factor *>(node))
+    count = f->name == name || f->id == name;
+  for (auto child : node->getChildren())
+    count += CountMentions(child, name);
+  return count;
+}
+
+// The operator of a reduction x := x + e, x := x - e or x := x * e, with - counted as +; empty
+// for any other assignment. Whether e uses x is left to the caller.
+static std::string GetReductionOperator(AssignStmt *a) {
+  if (a->rhs->type != Expression::T_EXPR)
+    return "";
+  Expr *e = a->rhs->expr;
+  std::string op = e->type == Expr::T_TERM ? "*" : "+";
+  while (e->type == Expr::T_PLUS || e->type == Expr::T_MINUS)
+    e = e->expr;
+  if (e->type != Expr::T_TERM)
+    return "";
+  Term *t = e->term;
+  if (op == "*" && t->type != Term::T_MUL)
+    return "";
+  while (op == "*" && t->type == Term::T_MUL)
+    t = t->term;
+  if (t->type != Term::T_FACTOR || t->factor->type != Factor::T_NAME || t->factor->name != a->id)
+    return "";
+  return op;
+}
+
+// Whether a scalar the loop assigns can get a copy per iteration: a local of this routine that no
+// nested routine captures and nothing outside the loop uses, whose first use in the body is an
+// assignment that does not read it.
+static bool IsLoopPrivate(CodeGenContext &context, ForStmt *loop, const std::string &name) {
+  CodeGenBlock *b = context.blocksStack.top();
+  auto local = b->locals.find(name);
+  if (local == b->locals.end() || !llvm::isa<AllocaInst>(local->second) || b->references.count(name) || !b->body)
+    return false;
+  for (auto &routine : context.funcParams)
+    for (auto &capture : routine.second.captures)
+      if (capture.variable == local->second)
+        return false;
+  if (CountMentions(b->body, name) != CountMentions(loop->stmt, name))
+    return false;
+  std::vector<Stmt *> statements;
+  NonLabelStmt *s = loop->stmt->nonLabelStmt;
+  if (s->type == NonLabelStmt::T_COMPOUND) {
+    for (StmtList *l = s->compoundStmt->stmtList; l; l = l->preList)
+      statements.insert(statements.begin(), l->stmt);
+  } else {
+    statements.push_back(loop->stmt);
+  }
+  for (Stmt *statement : statements) {
+    if (!CountMentions(statement, name))
+      continue;
+    AssignStmt *a = statement->nonLabelStmt->assignStmt;
+    return statement->nonLabelStmt->type == NonLabelStmt::T_ASSIGN && a->type == AssignStmt::T_SIMPLE &&
+           a->id == name && !CountMentions(a->rhs, name);
+  }
+  return false;
+}
+
+// Whether every access to an array has the same subscript scale * var + offset, scale != 0, in one
+// of its dimensions, so no two iterations reach the same element.
+static bool SeparatesIterations(CodeGenContext &context, const std::string &var,
+                                const std::vector<std::pair<ExpressionList *, bool>> &accesses) {
+  auto subscripts = [](ExpressionList *l) {
+    std::vector<Expression *> exprs;
+    for (; l; l = l->preList)
+      exprs.insert(exprs.begin(), l->expression);
+    return exprs;
+  };
+  std::vector<Expression *> first = subscripts(accesses.front().first);
+  for (size_t k = 0; k < first.size(); k++) {
+    int64_t scale, offset;
+    if (!GetAffineSubscript(context, first[k], var, scale, offset) || !scale)
+      continue;
+    bool same = true;
+    for (auto &access : accesses) {
+      std::vector<Expression *> exprs = subscripts(access.first);
+      int64_t s, o;
+      same &= k < exprs.size() && GetAffineSubscript(context, exprs[k], var, s, o) && s == scale && o == offset;
+    }
+    if (same)
+      return true;
+  }
+  return false;
+}
+
+// Why the iterations of a for loop cannot run in parallel, or empty when they can once the
+// reductions and private variables found are given a copy per chunk.
+static std::string FindLoopDependence(CodeGenContext &context, ForStmt *loop,
+                                      std::map<std::string, std::string> &reductions,
+                                      std::set<std::string> &privates) {
+  LoopBody body;
+  ScanLoopBody(context, loop->stmt, body);
+  if (!body.sequential.empty())
+    return body.sequential;
+  for (auto &call : body.calls) {
+    Function *callee = context.module->getFunction(call);
+    if (!callee || !context.isPureRoutine(callee))
+      return "calls " + call + ", which is not pure";
+  }
 
-    context.pushBlock(bexit);
-    context.blocksStack.top()->function = currentFuction;
+  // Pascal leaves a control variable undefined after its loop
+  privates = body.innerLoops;
+  for (auto &assignment : body.assignments) {
+    const std::string &name = assignment.first;
+    CodeGenBlock *b = context.isVariable(name);
+    if (privates.count(name))
+      continue;
+    if (!b || !b->varTypes.count(name))
+      return "assigns to " + name + ", which is not a variable";
+    if (name == loop->loopId || context.isLoopVariable(name))
+      return "assigns to the control variable " + name;
+    std::string op = GetReductionOperator(assignment.second.front());
+    for (AssignStmt *a : assignment.second)
+      if (GetReductionOperator(a) != op)
+        op.clear();
+    Type *type = b->varTypes[name]->getType(context, "");
+    // each reduction uses the variable once, on the left of its operator
+    if (!op.empty() && body.uses[name] == (int) assignment.second.size() &&
+        (type->isIntegerTy(32) || type->isDoubleTy())) {
+      if (type->isDoubleTy() && !context.builder.getFastMathFlags().allowReassoc())
+        return "the real reduction on " + name + " needs reassoc fast-math";
+      reductions[name] = op;
+    } else if (IsLoopPrivate(context, loop, name)) {
+      privates.insert(name);
+    } else {
+      return name + " is assigned in one iteration and may be used in another";
+    }
+  }
+
+  for (auto &array : body.elements) {
+    const std::string &name = array.first;
+    if (!context.isVariable(name))
+      continue;
+    bool written = false;
+    for (auto &access : array.second)
+      written |= access.second;
+    if (!written)
+      continue;
+    // bits of a packed boolean array share words, which each store reads and writes back whole
+    for (TypeDecl *t = ResolveType(context, context.isVariable(name)->varTypes[name]);
+         t && t->type == TypeDecl::T_ARRAY_TYPE_DECLARE; t = ResolveType(context, t->arrayTypeDecl->elementType))
+      if (BitPackedSize(context, t->arrayTypeDecl))
+        return name + " is a packed boolean array, whose elements share words";
+    if (body.uses.count(name) || body.assignments.count(name))
+      return name + " is used as a whole and written element by element";
+    if (!SeparatesIterations(context, loop->loopId, array.second))
+      return name + " is written at subscripts that do not keep the iterations apart";
+    std::set<std::string> others;
+    for (auto &e : body.elements)
+      others.insert(e.first);
+    for (auto &u : body.uses)
+      others.insert(u.first);
+    for (auto &other : others)
+      if (other != name && !privates.count(other) && context.isVariable(other) && MayAlias(context, name, other))
+        return name + " may share memory with " + other;
+  }
+  return "";
+}
 
+static void RecordParallelLoop(CodeGenContext &context, ForStmt *loop, bool parallel, const std::string &reason) {
+  std::string routine = context.blocksStack.top()->function->getName().str();
+  context.parallelLoops.push_back({routine, loop->line, loop->loopId, parallel, reason});
+}
+
+// Decide whether a loop without a parallel clause runs in parallel, and with what; the reason is
+// kept for --parallel-report.
+static bool IsAutoParallel(CodeGenContext &context, ForStmt *loop, Value *first, Value *last,
+                           std::map<std::string, std::string> &reductions, std::set<std::string> &privates) {
+  std::string reason;
+  if (context.inParallelBody)
+    reason = "inside a parallel loop";
+  else
+    reason = FindLoopDependence(context, loop, reductions, privates);
+  auto firstConstant = llvm::dyn_cast<ConstantInt>(first), lastConstant = llvm::dyn_cast<ConstantInt>(last);
+  int64_t threshold = context.options.parallelThreshold;
+  if (reason.empty() && firstConstant && lastConstant) {
+    bool isSigned = first->getType()->getIntegerBitWidth() >= 32;
+    int64_t a = isSigned ? firstConstant->getSExtValue() : firstConstant->getZExtValue();
+    int64_t b = isSigned ? lastConstant->getSExtValue() : lastConstant->getZExtValue();
+    int64_t count = (a < b ? b - a : a - b) + 1;
+    if (count < threshold)
+      reason = std::to_string(count) + " iterations, fewer than " + std::to_string(threshold);
+  }
+  if (!reason.empty()) {
+    RecordParallelLoop(context, loop, false, reason);
+    return false;
+  }
+
+  reason = "no loop-carried dependences";
+  for (auto &r : reductions)
+    reason += ", reduction " + r.second + " on " + r.first;
+  for (auto &p : privates)
+    reason += ", private " + p;
+  if (!firstConstant || !lastConstant)
+    reason += ", from " + std::to_string(threshold) + " iterations";
+  if (!context.options.autoParallel)
+    reason += ", without --auto-parallel";
+  RecordParallelLoop(context, loop, context.options.autoParallel, reason);
+  return context.options.autoParallel;
+}
+
+llvm::Value *ForStmt::codeGen(CodeGenContext &context) {
+    Function *currentFuction = context.blocksStack.top()->function;
+    if (context.isLoopVariable(loopId)) {
+        std::cerr << "for-loop control variable is already in use: " << loopId << std::endl;
+        std::exit(1);
+    }
+    CodeGenBlock *b = context.isVariable(loopId);
+    if (!b || context.constTable.isConst(loopId)) {
+        std::cerr << "for-loop control variable must be a variable: " << loopId << std::endl;
+        std::exit(1);
+    }
+    Value *var = b->locals[loopId];
+    if (context.isReference(loopId))
+        var = CreateLoad(context, var);
+
+    // both bounds are evaluated exactly once, before the loop
+    Value *first = firstBound->codeGen(context);
+    Value *last = secondBound->codeGen(context);
+    Type *type = b->varTypes[loopId]->getType(context, "");
+    if (!type->isIntegerTy() || first->getType() != type || last->getType() != type) {
+        std::cerr << "for-loop bounds must have the ordinal type of " << loopId << std::endl;
+        std::exit(1);
+    }
+    Value *entryStore = context.builder.CreateStore(first, var);
+
+    bool up = direction->type == Direction::T_TO;
+    // an empty range skips the loop; otherwise it runs |last - first| + 1 times. Chars and booleans are unsigned
+    bool isSigned = type->getIntegerBitWidth() >= 32;
+    auto predicate = up ? (isSigned ? llvm::CmpInst::ICMP_SGT : llvm::CmpInst::ICMP_UGT)
+                        : (isSigned ? llvm::CmpInst::ICMP_SLT : llvm::CmpInst::ICMP_ULT);
+    Value *empty = context.builder.CreateICmp(predicate, first, last);
+    auto constantEmpty = llvm::dyn_cast<ConstantInt>(empty);
+    if (constantEmpty && constantEmpty->isOne()) {
+        GenerateDeadCode(context, stmt);
+        return entryStore;
+    }
+    std::map<std::string, std::string> reductions;
+    std::set<std::string> privates;
+    if (parallel) {
+        if (context.options.autoParallel || context.options.parallelReport)
+            RecordParallelLoop(context, this, true, "parallel for");
+        GetParallelClauses(context, this, reductions, privates);
+        EmitParallelFor(context, this, first, last, reductions, privates, 1);
+        return context.builder.CreateStore(context.builder.CreateSelect(empty, first, last), var);
+    }
+    if ((context.options.autoParallel || context.options.parallelReport) &&
+        IsAutoParallel(context, this, first, last, reductions, privates)) {
+        EmitParallelFor(context, this, first, last, reductions, privates, context.options.parallelThreshold);
+        return context.builder.CreateStore(context.builder.CreateSelect(empty, first, last), var);
+    }
+    BasicBlock *preheader = context.currentBlock();
+    BasicBlock *bloop = BasicBlock::Create(MyContext, "loopStmt", currentFuction);
+    BasicBlock *bexit = BasicBlock::Create(MyContext, "eixtStmt", currentFuction);
+    BasicBlock *entry = preheader;
+    if (context.options.checkBounds) {
+      BasicBlock *bcheck = BasicBlock::Create(MyContext, "boundsCheck", currentFuction, bloop);
+      context.builder.CreateCondBr(empty, bexit, bcheck);
+      context.builder.SetInsertPoint(bcheck);
+      HoistBoundsChecks(context, this, first, last);
+      entry = context.currentBlock();
+      context.builder.CreateBr(bloop);
+    } else {
+      context.builder.CreateCondBr(empty, bexit, bloop);
+    }
+
+    context.builder.SetInsertPoint(bloop);
+    // the control variable lives in SSA form inside the body; its memory copy is only written on entry and exit,
+    // unless the body calls routines that may read it there: as a global, through a var parameter or captured
+    PHINode *induction = context.builder.CreatePHI(type, 2, loopId);
+    induction->addIncoming(first, entry);
+    LoopBody body;
+    ScanLoopBody(context, stmt, body);
+    bool visible = !llvm::isa<AllocaInst>(var);
+    for (auto &routine : context.funcParams)
+        for (auto &capture : routine.second.captures)
+            visible |= capture.variable == b->locals[loopId];
+    if (visible && !body.calls.empty())
+        context.builder.CreateStore(induction, var);
+    context.loopVariables[loopId] = {induction, first, last};
     stmt->codeGen(context);
-    delete initial;
-    delete f;
-    delete int1;
-    delete f1;
-    return ret;
+    context.loopVariables.erase(loopId);
+
+    if (context.options.instrumentRoutines)
+        context.profileProbe("spl_prof_loop", context.addProfiledLoop(currentFuction, firstBound->line));
+
+    // exit when the bound itself has been processed, so a loop up to maxint never steps past it
+    BasicBlock *latch = context.currentBlock();
+    Value *done = context.builder.CreateICmpEQ(induction, last);
+    Value *next = up ? context.builder.CreateAdd(induction, ConstantInt::get(type, 1), "", !isSigned, isSigned)
+                     : context.builder.CreateSub(induction, ConstantInt::get(type, 1), "", !isSigned, isSigned);
+    induction->addIncoming(next, latch);
+    loopID = CreateLoopID({});
+    context.builder.CreateCondBr(done, bexit, bloop)->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+
+    context.builder.SetInsertPoint(bexit);
+    PHINode *final = context.builder.CreatePHI(type, 2);
+    final->addIncoming(first, preheader);
+    final->addIncoming(last, latch);
+    return context.builder.CreateStore(final, var);
 }
@@ -5,6 +5,7 @@
 #include <map>
 #include <regex>
 
+#include <llvm/IR/Metadata.h>
 #include <llvm/IR/Value.h>
 
 #include "ASTPredeclaration.h"
@@ -53,8 +54,14 @@ namespace AST {
 
         virtual std::string getInfo() { return ""; }
 
+        // where the grammar rule building the node starts, set by the parser before each action
+        static int sourceLine, sourceColumn;
+        int line, column;
+
         Node() {
           id = ++idCount;
+          line = sourceLine;
+          column = sourceColumn;
         }
 
     };
@@ -191,6 +198,16 @@ namespace AST {
         ConstValue(std::string value, decltype(type) type) : value(std::move(value)), type(type) {
           if (type == T_CHAR)
             this->value = this->value.substr(1, 1);
+          if (type == T_STRING) {
+            // drop the quotes and turn each doubled quote back into one
+            std::string text;
+            for (size_t i = 1; i + 1 < this->value.size(); i++) {
+              text += this->value[i];
+              if (this->value[i] == '\'')
+                i++;
+            }
+            this->value = text;
+          }
         }
 
         ConstValue *negate() {
@@ -253,11 +270,12 @@ namespace AST {
 
     class TypeDecl : public AbstractStatement {
     public:
-        enum {T_SIMPLE_TYPE_DECLARE, T_ARRAY_TYPE_DECLARE, T_RECORD_TYPE_DECLARE} type;
+        enum {T_SIMPLE_TYPE_DECLARE, T_ARRAY_TYPE_DECLARE, T_RECORD_TYPE_DECLARE, T_SET_TYPE_DECLARE} type;
 
         SimpleTypeDecl *simpleTypeDecl{};
         ArrayTypeDecl *arrayTypeDecl{};
         RecordTypeDecl *recordTypeDecl{};
+        SetTypeDecl *setTypeDecl{};
 
         explicit TypeDecl(SimpleTypeDecl *simpleTypeDecl) : simpleTypeDecl(simpleTypeDecl) {
           type = T_SIMPLE_TYPE_DECLARE;
@@ -274,6 +292,11 @@ namespace AST {
           _children.emplace_back(recordTypeDecl);
         }
 
+        explicit TypeDecl(SetTypeDecl *setTypeDecl) : setTypeDecl(setTypeDecl) {
+          type = T_SET_TYPE_DECLARE;
+          _children.emplace_back(setTypeDecl);
+        }
+
         llvm::Type *getType(CodeGen::CodeGenContext &context, std::string name);
 
     };
@@ -343,8 +366,11 @@ namespace AST {
 
     class ArrayTypeDecl : public AbstractStatement {
     public:
+        // null for a dynamic array (array of T), whose bounds are set at run time by setlength
         SimpleTypeDecl *range{};
         TypeDecl *elementType{};
+        // packed arrays of booleans are stored as bitsets, one bit per element
+        bool packed = false;
 
         ArrayTypeDecl(SimpleTypeDecl *range, TypeDecl *elementType) : range(range), elementType(elementType) {
           _children.emplace_back(range);
@@ -362,6 +388,8 @@ namespace AST {
     class RecordTypeDecl : public AbstractStatement {
     public:
         FieldDeclList *fieldDeclList{};
+        // packed records are laid out without padding between fields
+        bool packed = false;
 
         explicit RecordTypeDecl(FieldDeclList *fieldDeclList) : fieldDeclList(fieldDeclList) {
           _children.emplace_back(fieldDeclList);
@@ -372,6 +400,17 @@ namespace AST {
         TypeDecl *findName(const std::string &s);
     };
 
+    class SetTypeDecl : public AbstractStatement {
+    public:
+        SimpleTypeDecl *baseType{};
+
+        explicit SetTypeDecl(SimpleTypeDecl *baseType) : baseType(baseType) {
+          _children.emplace_back(baseType);
+        }
+
+        llvm::Type *getType(CodeGen::CodeGenContext &context);
+    };
+
     class FieldDeclList : public AbstractStatement {
     public:
         FieldDeclList *preList{};
@@ -489,11 +528,13 @@ namespace AST {
     class FunctionDecl : public AbstractStatement {
     public:
         FunctionHead *functionHead{};
+        DirectiveList *directives{};
         SubRoutine *subRoutine{};
 
-        FunctionDecl(FunctionHead *functionHead, SubRoutine *subRoutine) :
-                functionHead(functionHead), subRoutine(subRoutine) {
+        FunctionDecl(FunctionHead *functionHead, DirectiveList *directives, SubRoutine *subRoutine) :
+                functionHead(functionHead), directives(directives), subRoutine(subRoutine) {
           _children.emplace_back(functionHead);
+          _children.emplace_back(directives);
           _children.emplace_back(subRoutine);
         }
 
@@ -520,11 +561,13 @@ namespace AST {
     class ProcedureDecl : public AbstractStatement {
     public:
         ProcedureHead *procedureHead{};
+        DirectiveList *directives{};
         SubRoutine *subRoutine{};
 
-        ProcedureDecl(ProcedureHead *procedureHead, SubRoutine *subRoutine) :
-                procedureHead(procedureHead), subRoutine(subRoutine) {
+        ProcedureDecl(ProcedureHead *procedureHead, DirectiveList *directives, SubRoutine *subRoutine) :
+                procedureHead(procedureHead), directives(directives), subRoutine(subRoutine) {
           _children.emplace_back(procedureHead);
+          _children.emplace_back(directives);
           _children.emplace_back(subRoutine);
         }
 
@@ -546,6 +589,24 @@ namespace AST {
         }
     };
 
+    // `name;` or `name(arg, ...);` between a routine head and its body, e.g. `fastmath(reassoc, contract);`
+    class DirectiveList : public AbstractStatement {
+    public:
+        DirectiveList *preList{};
+        std::string name;
+        NameList *arguments{};
+
+        DirectiveList(DirectiveList *preList, std::string name, NameList *arguments) :
+                preList(preList), name(std::move(name)), arguments(arguments) {
+          _children.emplace_back(preList);
+          _children.emplace_back(arguments);
+        }
+
+        std::string getInfo() override {
+          return name;
+        }
+    };
+
     class Parameters : public AbstractStatement {
     public:
         ParaDeclList *paraDeclList{};
@@ -718,12 +779,14 @@ namespace AST {
 
         std::string id;
         Expression *rhs;
-        Expression *index{};
+        ExpressionList *index{};
         std::string recordId;
 
-        AssignStmt(std::string id, Expression *rhs) : id(std::move(id)), rhs(rhs), type(T_SIMPLE) {}
+        AssignStmt(std::string id, Expression *rhs) : id(std::move(id)), rhs(rhs), type(T_SIMPLE) {
+          _children.emplace_back(rhs);
+        }
 
-        AssignStmt(std::string id, Expression *index, Expression *rhs) :
+        AssignStmt(std::string id, ExpressionList *index, Expression *rhs) :
                 id(std::move(id)), rhs(rhs), index(index), type(T_ARRAY) {
           _children.emplace_back(rhs);
           _children.emplace_back(index);
@@ -772,7 +835,9 @@ namespace AST {
           _children.emplace_back(expressionList);
         }
 
-        explicit ProcStmt(Factor *factor) : factor(factor), type(T_READ) {}
+        explicit ProcStmt(Factor *factor) : factor(factor), type(T_READ) {
+          _children.emplace_back(factor);
+        }
 
         llvm::Value *codeGen(CodeGen::CodeGenContext &context) override;
 
@@ -847,6 +912,10 @@ namespace AST {
         Direction *direction;
         Expression *secondBound;
         Stmt *stmt;
+        llvm::MDNode *loopID{};
+        // `parallel for`: iterations run on the runtime's thread pool
+        bool parallel = false;
+        ParallelClause *parallelClauses{};
 
         ForStmt(std::string loopId, Expression *firstBound, Direction *direction,
                 Expression *secondBound, Stmt *stmt)
@@ -858,6 +927,12 @@ namespace AST {
           _children.emplace_back(stmt);
         }
 
+        void setParallel(ParallelClause *clauses) {
+          parallel = true;
+          parallelClauses = clauses;
+          _children.emplace_back(clauses);
+        }
+
         llvm::Value *codeGen(CodeGen::CodeGenContext &context) override;
 
         std::string getInfo() override {
@@ -872,15 +947,39 @@ namespace AST {
         explicit Direction(decltype(type) type) : type(type) { assert(type == T_TO || type == T_DOWNTO); }
     };
 
+    // `parallel(+: sum; max: m; private: t) for ...`: variables combined with +, *, min or max
+    // across iterations, and variables each iteration uses as scratch
+    class ParallelClause : public AbstractStatement {
+    public:
+        ParallelClause *preList{};
+        std::string kind;
+        NameList *names{};
+
+        ParallelClause(ParallelClause *preList, std::string kind, NameList *names) :
+                preList(preList), kind(std::move(kind)), names(names) {
+          _children.emplace_back(preList);
+          _children.emplace_back(names);
+        }
+
+        std::string getInfo() override {
+          return kind;
+        }
+    };
+
+    struct CaseLowering;
+
     class CaseStmt : public AbstractStatement {
     public:
         Expression *expression{};
         CaseExprList *caseExprList{};
+        Stmt *otherwise{};
 
-        CaseStmt(Expression *expression, CaseExprList *caseExprList) : expression(expression),
-                                                                       caseExprList(caseExprList) {
+        CaseStmt(Expression *expression, CaseExprList *caseExprList, Stmt *otherwise) : expression(expression),
+                                                                                        caseExprList(caseExprList),
+                                                                                        otherwise(otherwise) {
           _children.emplace_back(expression);
           _children.emplace_back(caseExprList);
+          _children.emplace_back(otherwise);
         }
 
         llvm::Value *codeGen(CodeGen::CodeGenContext &context) override;
@@ -897,36 +996,71 @@ namespace AST {
           _children.emplace_back(caseExpr);
         }
 
-        llvm::Value *codeGen(CodeGen::CodeGenContext &context, llvm::Value *condition, llvm::BasicBlock *bmerge);
+        llvm::Value *codeGen(CodeGen::CodeGenContext &context, CaseLowering &lowering);
     };
 
     class CaseExpr : public AbstractStatement {
     public:
-        enum {T_CONST, T_ID} type;
-
-        ConstValue *constValue{};
-        std::string id;
+        CaseLabelList *labelList{};
         Stmt *stmt;
 
-        CaseExpr(ConstValue *constValue, Stmt *stmt) : constValue(constValue), stmt(stmt), type(T_CONST) {}
+        CaseExpr(CaseLabelList *labelList, Stmt *stmt) : labelList(labelList), stmt(stmt) {
+          _children.emplace_back(labelList);
+          _children.emplace_back(stmt);
+        }
+
+        llvm::Value *codeGen(CodeGen::CodeGenContext &context, CaseLowering &lowering);
 
-        CaseExpr(std::string id, Stmt *stmt) : id(std::move(id)), stmt(stmt), type(T_ID) {}
+    };
+
+    class CaseLabelList : public AbstractStatement {
+    public:
+        enum {T_CONST, T_ID, T_CONST_RANGE, T_ID_RANGE} type;
+
+        CaseLabelList *preList{};
+        ConstValue *lowerValue{}, *upperValue{};
+        std::string lowerName, upperName;
 
+        CaseLabelList(CaseLabelList *preList, ConstValue *value) : preList(preList), lowerValue(value),
+                                                                   type(T_CONST) {}
+
+        CaseLabelList(CaseLabelList *preList, std::string name) : preList(preList), lowerName(std::move(name)),
+                                                                  type(T_ID) {}
+
+        CaseLabelList(CaseLabelList *preList, ConstValue *lowerValue, ConstValue *upperValue) :
+                preList(preList), lowerValue(lowerValue), upperValue(upperValue), type(T_CONST_RANGE) {}
+
+        CaseLabelList(CaseLabelList *preList, std::string lowerName, std::string upperName) :
+                preList(preList), lowerName(std::move(lowerName)), upperName(std::move(upperName)), type(T_ID_RANGE) {}
 
         std::vector<Node *> getChildren() override {
           auto ch = std::vector<Node *>();
-          ch.emplace_back(constValue);
-          ch.emplace_back(stmt);
+          ch.emplace_back(preList);
+          ch.emplace_back(lowerValue);
+          ch.emplace_back(upperValue);
           return ch;
         }
 
-
         std::string getInfo() override {
-          return id.empty() ? "" : id;
+          if (type == T_ID)
+            return lowerName;
+          if (type == T_ID_RANGE)
+            return lowerName + ".." + upperName;
+          return "";
         }
+    };
 
-        llvm::Value *codeGen(CodeGen::CodeGenContext &context, llvm::Value *condition, llvm::BasicBlock *bmerge);
+    class SetElementList : public AbstractExpression {
+    public:
+        SetElementList *preList{};
+        Expression *lower{}, *upper{};
 
+        SetElementList(SetElementList *preList, Expression *lower, Expression *upper) :
+                preList(preList), lower(lower), upper(upper) {
+          _children.emplace_back(preList);
+          _children.emplace_back(lower);
+          _children.emplace_back(upper);
+        }
     };
 
     class GotoStmt : public AbstractStatement {
@@ -948,11 +1082,21 @@ namespace AST {
           _children.emplace_back(preList);
           _children.emplace_back(expression);
         }
+
+        // put `front` before the first expression of this list, used for a[i][j] style indexing
+        ExpressionList *chain(ExpressionList *front) {
+          ExpressionList *first = this;
+          while (first->preList)
+            first = first->preList;
+          first->preList = front;
+          first->_children[0] = front;
+          return this;
+        }
     };
 
     class Expression : public AbstractExpression {
     public:
-        enum {T_EQ, T_NE, T_GE, T_GT, T_LE, T_LT, T_EXPR} type;
+        enum {T_EQ, T_NE, T_GE, T_GT, T_LE, T_LT, T_IN, T_EXPR} type;
 
         Expression *expression{};
         Expr *expr{};
@@ -962,7 +1106,9 @@ namespace AST {
           _children.emplace_back(expr);
         }
 
-        explicit Expression(Expr *expr) : expr(expr), type(T_EXPR) {}
+        explicit Expression(Expr *expr) : expr(expr), type(T_EXPR) {
+          _children.emplace_back(expr);
+        }
 
         llvm::Value *codeGen(CodeGen::CodeGenContext &context) override;
     };
@@ -974,7 +1120,10 @@ namespace AST {
         Expr *expr{};
         Term *term{};
 
-        Expr(decltype(type) type, Expr *expr, Term *term) : type(type), expr(expr), term(term) {}
+        Expr(decltype(type) type, Expr *expr, Term *term) : type(type), expr(expr), term(term) {
+          _children.emplace_back(expr);
+          _children.emplace_back(term);
+        }
 
         explicit Expr(Term *term) : term(term), type(T_TERM) {
           _children.emplace_back(expr);
@@ -1007,7 +1156,7 @@ namespace AST {
     public:
         enum {
             T_NAME, T_NAME_ARGS, T_SYS_FUNCT, T_SYS_FUNCT_ARGS, T_CONST, T_EXPR, T_NOT_FACTOR,
-            T_MINUS_FACTOR, T_ID_EXPR, T_ID_DOT_ID
+            T_MINUS_FACTOR, T_ID_EXPR, T_ID_DOT_ID, T_SET
         } type;
 
         std::string name;
@@ -1015,6 +1164,8 @@ namespace AST {
         std::string sysFunction;
         ConstValue *constValue{};
         Expression *expression{};
+        ExpressionList *indexList{};
+        SetElementList *setElements{};
         Factor *factor{};
         std::string id;
         std::string recordId;
@@ -1045,13 +1196,8 @@ namespace AST {
           assert(type == T_NAME_ARGS || type == T_SYS_FUNCT_ARGS);
           if (type == T_NAME_ARGS)
             name = st;
-          else {
+          else
             sysFunction = st;
-            if (st == "succ" || st == "abs" || st == "odd" || st == "pred" || st == "sqr" || st == "sqrt") {
-              name = st + "__";
-              this->type = T_NAME_ARGS;
-            }
-          }
         }
 
         explicit Factor(ConstValue *constValue) : constValue(constValue), type(T_CONST) {}
@@ -1062,8 +1208,11 @@ namespace AST {
           assert(type == T_NOT_FACTOR || type == T_MINUS_FACTOR);
         }
 
-        Factor(std::string id, Expression *expression) : expression(expression), id(std::move(id)),
-                                                         type(T_ID_EXPR) {}
+        Factor(std::string id, ExpressionList *indexList) : indexList(indexList), id(std::move(id)),
+                                                            type(T_ID_EXPR) {}
+
+        // [a, b..c]; setElements is null for []
+        explicit Factor(SetElementList *setElements) : type(T_SET), setElements(setElements) {}
 
         Factor(std::string id, std::string recordId) : id(std::move(id)), recordId(std::move(recordId)),
                                                        type(T_ID_DOT_ID) {}
@@ -1075,6 +1224,8 @@ namespace AST {
           ch.emplace_back(argsList);
           ch.emplace_back(constValue);
           ch.emplace_back(expression);
+          ch.emplace_back(indexList);
+          ch.emplace_back(setElements);
           ch.emplace_back(factor);
           return ch;
         }
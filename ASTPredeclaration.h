@@ -36,6 +36,8 @@ namespace AST {
 
     class RecordTypeDecl;
 
+    class SetTypeDecl;
+
     class FieldDeclList;
 
     class FieldDecl;
@@ -58,6 +60,8 @@ namespace AST {
 
     class ProcedureHead;
 
+    class DirectiveList;
+
     class Parameters;
 
     class ParaDeclList;
@@ -94,12 +98,18 @@ namespace AST {
 
     class Direction;
 
+    class ParallelClause;
+
     class CaseStmt;
 
     class CaseExprList;
 
     class CaseExpr;
 
+    class CaseLabelList;
+
+    class SetElementList;
+
     class GotoStmt;
 
     class ExpressionList;
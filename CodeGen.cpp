@@ -1,18 +1,45 @@
 #include "CodeGen.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <tuple>
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Analysis/CFG.h>
 #include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Regex.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/DiagnosticHandler.h>
+#include <llvm/IR/DiagnosticInfo.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Operator.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/MCAsmInfo.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Config/llvm-config.h>
+#if LLVM_VERSION_MAJOR >= 11
+#include <llvm/IR/LLVMRemarkStreamer.h>
+#include <llvm/Remarks/RemarkStreamer.h>
+#else
+#include <llvm/IR/RemarkStreamer.h>
+#endif
+#include <llvm/Support/Host.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO/HotColdSplitting.h>
 
 using namespace llvm;
 using namespace CodeGen;
 
+llvm::LLVMContext CodeGen::MyContext;
+
 void CodeGenContext::readFunc() {
   std::vector<llvm::Type *> arg_types;
   arg_types.push_back(llvm::Type::getInt8PtrTy(MyContext));
@@ -31,9 +58,824 @@ void CodeGenContext::printFunc() {
   print->setCallingConv(llvm::CallingConv::C);
 }
 
+llvm::Function *CodeGenContext::boundsErrorFunc() {
+  if (boundsError)
+    return boundsError;
+  std::vector<llvm::Type *> argTypes = {llvm::Type::getInt8PtrTy(MyContext), llvm::Type::getInt32Ty(MyContext),
+                                        llvm::Type::getInt32Ty(MyContext), llvm::Type::getInt32Ty(MyContext)};
+  auto funcType = llvm::FunctionType::get(llvm::Type::getVoidTy(MyContext), argTypes, false);
+  boundsError = llvm::Function::Create(funcType, llvm::GlobalValue::InternalLinkage, "spl.bounds.error", module);
+  boundsError->addFnAttr(llvm::Attribute::NoReturn);
+  boundsError->addFnAttr(llvm::Attribute::Cold);
+  boundsError->addFnAttr(llvm::Attribute::NoInline);
+
+  auto fprintfType = llvm::FunctionType::get(llvm::Type::getInt32Ty(MyContext),
+                                             {llvm::Type::getInt8PtrTy(MyContext), llvm::Type::getInt8PtrTy(MyContext)},
+                                             true);
+  auto fprintfFunc = llvm::Function::Create(fprintfType, llvm::Function::ExternalLinkage, "fprintf", module);
+  auto exitType = llvm::FunctionType::get(llvm::Type::getVoidTy(MyContext), {llvm::Type::getInt32Ty(MyContext)},
+                                          false);
+  auto exitFunc = module->getFunction("exit");
+  if (!exitFunc)
+    exitFunc = llvm::Function::Create(exitType, llvm::Function::ExternalLinkage, "exit", module);
+  auto stderrVar = new llvm::GlobalVariable(*module, llvm::Type::getInt8PtrTy(MyContext), false,
+                                            llvm::GlobalValue::ExternalLinkage, nullptr, "stderr");
+
+  std::string message = "index %d out of range %d..%d of array %s\n";
+  auto messageConst = llvm::ConstantDataArray::getString(MyContext, message, true);
+  auto messageVar = new llvm::GlobalVariable(*module, messageConst->getType(), true,
+                                             llvm::GlobalValue::PrivateLinkage, messageConst, ".str");
+  auto zero = llvm::Constant::getNullValue(llvm::Type::getInt32Ty(MyContext));
+  std::vector<llvm::Constant *> indices = {zero, zero};
+  auto messageRef = llvm::ConstantExpr::getGetElementPtr(messageConst->getType(), messageVar, indices);
+
+  auto block = llvm::BasicBlock::Create(MyContext, "entry", boundsError);
+  auto args = boundsError->arg_begin();
+  llvm::Value *name = args++;
+  llvm::Value *index = args++;
+  llvm::Value *lower = args++;
+  llvm::Value *upper = args;
+  auto stream = new llvm::LoadInst(llvm::Type::getInt8PtrTy(MyContext), stderrVar, "", false, block);
+  llvm::CallInst::Create(fprintfFunc, {stream, messageRef, index, lower, upper, name}, "", block);
+  llvm::CallInst::Create(exitFunc, {llvm::ConstantInt::get(llvm::Type::getInt32Ty(MyContext), 1)}, "", block);
+  new llvm::UnreachableInst(MyContext, block);
+  return boundsError;
+}
+
+static Value *UnderlyingObject(Value *v) {
+  while (true) {
+    if (auto gep = dyn_cast<GEPOperator>(v))
+      v = gep->getPointerOperand();
+    else if (auto cast = dyn_cast<BitCastOperator>(v))
+      v = cast->getOperand(0);
+    else
+      return v;
+  }
+}
+
+// Every pointer parameter is dereferenceable for its whole type and never captured. It is readonly if
+// the routine never writes through it, and noalias if at every call its argument is a local of the
+// caller that no other argument shares for writing. Routines reach outer locals only through
+// their captured-variable arguments, so those are all the paths there are.
+void CodeGenContext::addParameterAttributes() {
+  auto &layout = module->getDataLayout();
+  for (auto &entry : funcParams) {
+    Function *function = module->getFunction(entry.first);
+    if (!function)
+      continue;
+    auto &params = entry.second;
+    auto readOnly = [&](unsigned i) {
+      return std::find(params.readOnly.begin(), params.readOnly.end(), (int) i) != params.readOnly.end();
+    };
+    for (auto &arg : function->args()) {
+      auto pointer = dyn_cast<PointerType>(arg.getType());
+      unsigned i = arg.getArgNo();
+      // a dynamic array handle may be null and is copied into the callee's frame
+      if (!pointer || std::find(params.arrays.begin(), params.arrays.end(), (int) i) != params.arrays.end())
+        continue;
+      function->addParamAttr(i, Attribute::NoCapture);
+      function->addDereferenceableParamAttr(i, layout.getTypeStoreSize(pointer->getElementType()));
+      if (readOnly(i))
+        function->addParamAttr(i, Attribute::ReadOnly);
+
+      bool noAlias = true;
+      for (auto user : function->users()) {
+        auto call = dyn_cast<CallInst>(user);
+        if (!call || call->getCalledFunction() != function) {
+          noAlias = false;
+          break;
+        }
+        auto base = dyn_cast<AllocaInst>(UnderlyingObject(call->getArgOperand(i)));
+        if (!base) {
+          noAlias = false;
+          break;
+        }
+        for (unsigned j = 0; j < call->arg_size() && noAlias; j++)
+          if (j != i && call->getArgOperand(j)->getType()->isPointerTy() &&
+              UnderlyingObject(call->getArgOperand(j)) == base)
+            noAlias = readOnly(i) && readOnly(j);
+        if (!noAlias)
+          break;
+      }
+      if (noAlias)
+        function->addParamAttr(i, Attribute::NoAlias);
+    }
+  }
+}
+
+// Memory in the function's own frame or its part of the arena, or constant data, which it may use and
+// stay readnone.
+static bool IsPrivateMemory(Function *function, Value *pointer) {
+  Value *base = UnderlyingObject(pointer);
+  if (auto alloca = dyn_cast<AllocaInst>(base))
+    return alloca->getFunction() == function;
+  if (auto call = dyn_cast<CallInst>(base)) {
+    Function *callee = call->getCalledFunction();
+    return callee && callee->getName() == "spl_arena_alloc" && call->getFunction() == function;
+  }
+  if (auto global = dyn_cast<GlobalVariable>(base))
+    return global->isConstant();
+  return false;
+}
+
+class ComponentEffects {
+public:
+  bool reads = false, writes = false, recursive = false, returns = true;
+};
+
+// What the functions of one call graph component do to memory outside their own frames. Callees
+// outside the component count by their attributes, or as pure if listed in pure; the arena only
+// hands out and takes back memory private to the calling function.
+static ComponentEffects ScanComponent(const std::set<Function *> &functions, const std::set<Function *> &pure) {
+  ComponentEffects effects;
+  effects.recursive = functions.size() > 1;
+  for (Function *function : functions) {
+    for (auto &block : *function) {
+      for (auto &inst : block) {
+        if (auto load = dyn_cast<LoadInst>(&inst)) {
+          effects.reads |= !IsPrivateMemory(function, load->getPointerOperand());
+        } else if (auto store = dyn_cast<StoreInst>(&inst)) {
+          effects.writes |= !IsPrivateMemory(function, store->getPointerOperand());
+        } else if (auto transfer = dyn_cast<MemTransferInst>(&inst)) {
+          effects.writes |= !IsPrivateMemory(function, transfer->getRawDest());
+          effects.reads |= !IsPrivateMemory(function, transfer->getRawSource());
+        } else if (auto call = dyn_cast<CallInst>(&inst)) {
+          Function *callee = call->getCalledFunction();
+          if (callee && functions.count(callee)) {
+            effects.recursive = true;
+            continue;
+          }
+          if (callee && callee->getName().startswith("spl_arena_"))
+            continue;
+          if (!callee || (!callee->doesNotAccessMemory() && !pure.count(callee))) {
+            effects.reads = true;
+            effects.writes |= !callee || !callee->onlyReadsMemory();
+          }
+#if LLVM_VERSION_MAJOR >= 10
+          effects.returns &= callee && callee->hasFnAttribute(Attribute::WillReturn);
+#endif
+        }
+      }
+    }
+  }
+  return effects;
+}
+
+// Whether a routine and every routine it calls leave all memory outside their own frames alone. A
+// routine still being generated has a block without a terminator and is not known to be pure.
+// Routines on a cycle are assumed pure while they are scanned, so the cycle is pure unless one of
+// them does something impure. Bounds errors end the program, the profiling runtime keeps its
+// counts per thread and the arena hands each call memory of its own, so calls to them do not count.
+static bool IsPureRoutine(Function *function, Function *boundsError, std::set<Function *> &visiting) {
+  if (function->isDeclaration())
+    return function->doesNotAccessMemory();
+  if (!visiting.insert(function).second)
+    return true;
+  for (auto &block : *function) {
+    if (!block.getTerminator())
+      return false;
+    for (auto &inst : block) {
+      if (auto load = dyn_cast<LoadInst>(&inst)) {
+        if (!IsPrivateMemory(function, load->getPointerOperand()))
+          return false;
+      } else if (auto store = dyn_cast<StoreInst>(&inst)) {
+        if (!IsPrivateMemory(function, store->getPointerOperand()))
+          return false;
+      } else if (auto intrinsic = dyn_cast<MemIntrinsic>(&inst)) {
+        if (!IsPrivateMemory(function, intrinsic->getRawDest()))
+          return false;
+        auto transfer = dyn_cast<MemTransferInst>(intrinsic);
+        if (transfer && !IsPrivateMemory(function, transfer->getRawSource()))
+          return false;
+      } else if (auto call = dyn_cast<CallInst>(&inst)) {
+        Function *callee = call->getCalledFunction();
+        if (!callee)
+          return false;
+        if (callee == boundsError || callee->getName().startswith("spl_prof_") ||
+            callee->getName().startswith("spl_arena_"))
+          continue;
+        if (!IsPureRoutine(callee, boundsError, visiting))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool CodeGenContext::isPureRoutine(llvm::Function *function) const {
+  std::set<Function *> visiting;
+  return IsPureRoutine(function, boundsError, visiting);
+}
+
+// Whether code other than loads and stores at constant offsets reaches the memory pointer points to:
+// its address is passed on or stored, or it is indexed at run time.
+static bool AddressEscapes(Value *pointer) {
+  for (User *user : pointer->users()) {
+    if (isa<LoadInst>(user))
+      continue;
+    if (auto store = dyn_cast<StoreInst>(user)) {
+      if (store->getValueOperand() == pointer)
+        return true;
+      continue;
+    }
+    auto gep = dyn_cast<GetElementPtrInst>(user);
+    if (!gep || !gep->hasAllConstantIndices() || AddressEscapes(gep))
+      return true;
+  }
+  return false;
+}
+
+// Locals above --stack-threshold move from the frames of routines, which recursion multiplies, to
+// the per-thread arena of runtime/arena.c: the routine marks the arena on entry, takes its locals
+// from it and releases them on every way out, so the next call reuses the memory. Locals whose
+// address does not escape stay where they are, as SROA breaks them into scalars.
+void CodeGenContext::placeLargeLocals() {
+  std::map<Function *, std::vector<AllocaInst *>> moved;
+  for (AllocaInst *alloca : largeLocals)
+    if (AddressEscapes(alloca))
+      moved[alloca->getFunction()].push_back(alloca);
+  if (moved.empty())
+    return;
+
+  Type *bytes = Type::getInt8PtrTy(MyContext);
+  Type *i64 = Type::getInt64Ty(MyContext);
+  auto mark = module->getOrInsertFunction("spl_arena_mark", FunctionType::get(bytes, false));
+  auto allocate = module->getOrInsertFunction("spl_arena_alloc", FunctionType::get(bytes, {i64}, false));
+  auto release = module->getOrInsertFunction("spl_arena_release",
+                                             FunctionType::get(Type::getVoidTy(MyContext), {bytes}, false));
+  const DataLayout &layout = module->getDataLayout();
+  for (auto &entry : moved) {
+    Function *function = entry.first;
+    BasicBlock &entryBlock = function->getEntryBlock();
+    IRBuilder<> atEntry(&entryBlock, entryBlock.getFirstInsertionPt());
+    Value *top = atEntry.CreateCall(mark, {}, "arena");
+    for (AllocaInst *alloca : entry.second) {
+      uint64_t size = layout.getTypeAllocSize(alloca->getAllocatedType());
+      Value *memory = atEntry.CreateCall(allocate, {ConstantInt::get(i64, size)});
+      Value *local = atEntry.CreateBitCast(memory, alloca->getType());
+      local->takeName(alloca);
+      alloca->replaceAllUsesWith(local);
+      alloca->eraseFromParent();
+      arenaBytes[function] += size;
+    }
+    // a guaranteed tail call must come right before its return, so the arena is released ahead of it
+    for (auto &block : *function) {
+      auto ret = dyn_cast_or_null<ReturnInst>(block.getTerminator());
+      if (!ret)
+        continue;
+      Instruction *exit = ret;
+      auto call = dyn_cast_or_null<CallInst>(ret->getPrevNode());
+      if (call && call->isMustTailCall())
+        exit = call;
+      CallInst::Create(release, {top}, "", exit);
+    }
+  }
+}
+
+// --stats: bytes of stack each routine's frame takes as generated, before optimization, and those it
+// takes from the arena.
+void CodeGenContext::reportFrameSizes() const {
+  const DataLayout &layout = module->getDataLayout();
+  std::cout << "frame sizes:" << std::endl;
+  for (auto &function : *module) {
+    std::string name = function.getName().str();
+    if (function.isDeclaration() || (name != "main" && !funcParams.count(name)))
+      continue;
+    uint64_t stack = 0;
+    for (auto &block : function)
+      for (auto &inst : block)
+        if (auto alloca = dyn_cast<AllocaInst>(&inst))
+          if (alloca->isStaticAlloca())
+            stack += layout.getTypeAllocSize(alloca->getAllocatedType());
+    std::cout << "  " << (name == "main" ? "program" : name) << ": " << stack << " bytes on the stack";
+    auto arena = arenaBytes.find(const_cast<Function *>(&function));
+    if (arena != arenaBytes.end())
+      std::cout << ", " << arena->second << " in the arena";
+    std::cout << std::endl;
+  }
+}
+
+static std::set<Function *> DefinedFunctions(const std::vector<CallGraphNode *> &component) {
+  std::set<Function *> functions;
+  for (CallGraphNode *node : component)
+    if (node->getFunction() && !node->getFunction()->isDeclaration())
+      functions.insert(node->getFunction());
+  return functions;
+}
+
+// Walks the call graph bottom-up, one strongly connected component at a time, so callees are
+// done before their callers. Nothing in SPL or the C library it calls unwinds, so everything is
+// nounwind; a component that touches no outside memory is readnone, one that only reads it
+// readonly; a routine outside any cycle is norecurse, and also willreturn when it has no loops
+// and its callees are. Routines only called directly switch to fastcc.
+void CodeGenContext::inferFunctionAttributes() {
+  for (auto &function : *module)
+    if (!function.isIntrinsic())
+      function.setDoesNotThrow();
+
+  CallGraph graph(*module);
+  for (auto scc = scc_begin(&graph); !scc.isAtEnd(); ++scc) {
+    std::set<Function *> functions = DefinedFunctions(*scc);
+    if (functions.empty())
+      continue;
+    ComponentEffects effects = ScanComponent(functions, {});
+    for (Function *function : functions) {
+      if (!effects.reads && !effects.writes)
+        function->setDoesNotAccessMemory();
+      else if (!effects.writes)
+        function->setOnlyReadsMemory();
+      if (effects.recursive)
+        continue;
+      function->setDoesNotRecurse();
+#if LLVM_VERSION_MAJOR >= 10
+      SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> backEdges;
+      FindFunctionBackedges(*function, backEdges);
+      if (effects.returns && backEdges.empty())
+        function->addFnAttr(Attribute::WillReturn);
+#endif
+    }
+  }
+
+  for (auto &function : *module) {
+    if (!function.hasLocalLinkage() || function.isDeclaration())
+      continue;
+    bool directOnly = true;
+    for (auto user : function.users()) {
+      auto call = dyn_cast<CallInst>(user);
+      directOnly &= call && call->getCalledFunction() == &function;
+    }
+    if (!directOnly)
+      continue;
+    function.setCallingConv(CallingConv::Fast);
+    for (auto user : function.users())
+      cast<CallInst>(user)->setCallingConv(CallingConv::Fast);
+  }
+}
+
+// Moves the body of function into <name>.body and makes function look its arguments up in a memo
+// table first. Parameters with small declared ranges index a direct-mapped table of
+// valid flags and results; otherwise a hash of the arguments picks an entry of a table holding
+// the arguments too, and a colliding call overwrites it.
+static std::string Memoize(Module *module, Function *function, const std::map<int, std::pair<int64_t, int64_t>> &ranges,
+                           int size) {
+  auto &context = module->getContext();
+  Type *i8 = Type::getInt8Ty(context);
+  Type *i64 = Type::getInt64Ty(context);
+  Type *result = function->getReturnType();
+  Function *body = Function::Create(function->getFunctionType(), GlobalValue::InternalLinkage,
+                                    function->getName() + ".body", module);
+  body->getBasicBlockList().splice(body->begin(), function->getBasicBlockList());
+  // the debug info describes the code, which is in the body now
+  if (auto subprogram = function->getSubprogram()) {
+    function->setSubprogram(nullptr);
+    body->setSubprogram(subprogram);
+  }
+  std::vector<Value *> args;
+  for (auto from = function->arg_begin(), to = body->arg_begin(); from != function->arg_end(); ++from, ++to) {
+    to->setName(from->getName());
+    from->replaceAllUsesWith(&*to);
+    args.push_back(&*from);
+  }
+
+  BasicBlock *entry = BasicBlock::Create(context, "entry", function);
+  BasicBlock *lookup = BasicBlock::Create(context, "lookup", function);
+  BasicBlock *hit = BasicBlock::Create(context, "hit", function);
+  BasicBlock *miss = BasicBlock::Create(context, "miss", function);
+  auto zero = ConstantInt::get(Type::getInt32Ty(context), 0);
+
+  int64_t entries = 1;
+  bool direct = true;
+  for (unsigned i = 0; i < args.size() && direct; i++) {
+    auto range = ranges.find(i);
+    direct = range != ranges.end() && entries * (range->second.second - range->second.first + 1) <= size;
+    if (direct)
+      entries *= range->second.second - range->second.first + 1;
+  }
+
+  std::string kind;
+  Value *validRef, *resultRef;
+  std::vector<Value *> keyRefs;
+  if (direct) {
+    kind = "direct-mapped";
+    // arguments outside their declared range bypass the table
+    BasicBlock *uncached = BasicBlock::Create(context, "uncached", function);
+    Value *index = ConstantInt::get(i64, 0);
+    Value *inRange = ConstantInt::getTrue(context);
+    int64_t stride = 1;
+    for (int i = (int) args.size() - 1; i >= 0; i--) {
+      auto range = ranges.at(i);
+      int64_t count = range.second - range.first + 1;
+      Value *arg = args[i];
+      if (arg->getType()->getIntegerBitWidth() < 64)
+        arg = arg->getType()->getIntegerBitWidth() < 32 ? (Value *) new ZExtInst(arg, i64, "", entry)
+                                                        : (Value *) new SExtInst(arg, i64, "", entry);
+      Value *offset = BinaryOperator::Create(Instruction::Sub, arg, ConstantInt::get(i64, range.first), "", entry);
+      inRange = BinaryOperator::Create(Instruction::And, inRange,
+                                       CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_ULT, offset,
+                                                       ConstantInt::get(i64, count), "", entry), "", entry);
+      index = BinaryOperator::Create(Instruction::Add, index,
+                                     BinaryOperator::Create(Instruction::Mul, offset, ConstantInt::get(i64, stride),
+                                                            "", entry), "", entry);
+      stride *= count;
+    }
+    BranchInst::Create(lookup, uncached, inRange, entry);
+    ReturnInst::Create(context, CallInst::Create(body, args, "", uncached), uncached);
+
+    auto validType = ArrayType::get(i8, entries);
+    auto valid = new GlobalVariable(*module, validType, false, GlobalValue::InternalLinkage,
+                                    Constant::getNullValue(validType), function->getName() + ".memo.valid");
+    auto resultType = ArrayType::get(result, entries);
+    auto results = new GlobalVariable(*module, resultType, false, GlobalValue::InternalLinkage,
+                                      Constant::getNullValue(resultType), function->getName() + ".memo");
+    validRef = GetElementPtrInst::Create(validType, valid, {zero, index}, "", lookup);
+    resultRef = GetElementPtrInst::Create(resultType, results, {zero, index}, "", lookup);
+  } else {
+    kind = "hash table";
+    int bits = 1;
+    while ((int64_t(1) << bits) < size)
+      bits++;
+    entries = int64_t(1) << bits;
+    std::vector<Type *> fields = {i8};
+    for (auto arg : args)
+      fields.push_back(arg->getType());
+    fields.push_back(result);
+    auto entryType = StructType::create(context, fields, (function->getName() + ".memo.entry").str());
+    auto tableType = ArrayType::get(entryType, entries);
+    auto table = new GlobalVariable(*module, tableType, false, GlobalValue::InternalLinkage,
+                                    Constant::getNullValue(tableType), function->getName() + ".memo");
+    // Fibonacci hashing: the top bits of the mixed arguments times 2^64 / phi
+    Value *hash = ConstantInt::get(i64, 0);
+    for (auto arg : args) {
+      Value *key = arg;
+      if (key->getType()->getIntegerBitWidth() < 64)
+        key = new ZExtInst(key, i64, "", entry);
+      hash = BinaryOperator::Create(Instruction::Mul, BinaryOperator::Create(Instruction::Xor, hash, key, "", entry),
+                                    ConstantInt::get(i64, 0x9E3779B97F4A7C15ULL), "", entry);
+    }
+    Value *index = BinaryOperator::Create(Instruction::LShr, hash, ConstantInt::get(i64, 64 - bits), "", entry);
+    BranchInst::Create(lookup, entry);
+
+    auto field = [&](unsigned i) {
+      return GetElementPtrInst::Create(tableType, table, {zero, index, ConstantInt::get(Type::getInt32Ty(context), i)},
+                                       "", lookup);
+    };
+    validRef = field(0);
+    for (unsigned i = 0; i < args.size(); i++)
+      keyRefs.push_back(field(i + 1));
+    resultRef = field(args.size() + 1);
+  }
+
+  Value *found = CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_NE, new LoadInst(validRef, "", lookup),
+                                 ConstantInt::get(i8, 0), "", lookup);
+  for (unsigned i = 0; i < keyRefs.size(); i++)
+    found = BinaryOperator::Create(Instruction::And, found,
+                                   CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_EQ,
+                                                   new LoadInst(keyRefs[i], "", lookup), args[i], "", lookup),
+                                   "", lookup);
+  BranchInst::Create(hit, miss, found, lookup);
+  ReturnInst::Create(context, new LoadInst(resultRef, "", hit), hit);
+
+  Value *value = CallInst::Create(body, args, "", miss);
+  new StoreInst(value, resultRef, miss);
+  for (unsigned i = 0; i < keyRefs.size(); i++)
+    new StoreInst(args[i], keyRefs[i], miss);
+  new StoreInst(ConstantInt::get(i8, 1), validRef, miss);
+  ReturnInst::Create(context, value, miss);
+  return kind + ", " + std::to_string(entries) + " entries";
+}
+
+// The functions parallel loop bodies may call, which can run on several threads at once.
+static std::set<Function *> ParallelCallees(Module *module, CallGraph &graph) {
+  std::set<Function *> reached;
+  std::vector<Function *> work;
+  if (Function *run = module->getFunction("spl_parallel_for"))
+    for (User *user : run->users())
+      if (auto call = dyn_cast<CallInst>(user))
+        if (auto body = dyn_cast<Function>(call->getArgOperand(0)->stripPointerCasts()))
+          work.push_back(body);
+  while (!work.empty()) {
+    Function *function = work.back();
+    work.pop_back();
+    if (!reached.insert(function).second)
+      continue;
+    for (auto &callee : *graph[function])
+      if (Function *f = callee.second->getFunction())
+        work.push_back(f);
+  }
+  return reached;
+}
+
+// Functions whose call graph component touches no memory outside its own frames, take only
+// ordinal arguments and return an ordinal or real are memoized. The tables are shared and updated
+// without synchronization, so functions that parallel loops call are left alone.
+void CodeGenContext::memoizeFunctions() {
+  std::set<Function *> pure;
+  CallGraph graph(*module);
+  for (auto scc = scc_begin(&graph); !scc.isAtEnd(); ++scc) {
+    std::set<Function *> functions = DefinedFunctions(*scc);
+    ComponentEffects effects = ScanComponent(functions, pure);
+    if (!effects.reads && !effects.writes)
+      pure.insert(functions.begin(), functions.end());
+  }
+  std::set<Function *> parallel = ParallelCallees(module, graph);
+
+  int memoized = 0;
+  for (auto &entry : funcParams) {
+    Function *function = module->getFunction(entry.first);
+    if (!function || !pure.count(function) || function->arg_empty())
+      continue;
+    if (parallel.count(function)) {
+      std::cout << "not memoized: " << entry.first << " (called from a parallel loop)\n";
+      continue;
+    }
+    Type *result = function->getReturnType();
+    bool scalar = result->isIntegerTy() || result->isDoubleTy();
+    for (auto &arg : function->args())
+      scalar &= arg.getType()->isIntegerTy();
+    if (!scalar)
+      continue;
+    std::cout << "memoized: " << entry.first << " ("
+              << Memoize(module, function, entry.second.ranges, options.memoSize) << ")\n";
+    memoized++;
+  }
+  if (!memoized)
+    std::cout << "memoized: none\n";
+}
+
+int CodeGenContext::addProfiledRoutine(llvm::Function *function, const std::string &name, int line) {
+  routineIds[function] = profiledRoutines.size();
+  profiledRoutines.emplace_back(name, line);
+  return routineIds[function];
+}
+
+// A loop of the given routine, which must have been added already; loops outlined into a parallel
+// body belong to the body.
+int CodeGenContext::addProfiledLoop(llvm::Function *function, int line) {
+  profiledLoops.emplace_back(routineIds.at(function), line);
+  return profiledLoops.size() - 1;
+}
+
+// A call of void probe(i32 id) at the insertion point.
+llvm::CallInst *CodeGenContext::profileProbe(const std::string &probe, int id) {
+  auto type = FunctionType::get(Type::getVoidTy(MyContext), {Type::getInt32Ty(MyContext)}, false);
+  return builder.CreateCall(module->getOrInsertFunction(probe, type),
+                            {ConstantInt::get(Type::getInt32Ty(MyContext), id)});
+}
+
+// Hands the routine and loop tables to the runtime before anything else in main runs.
+void CodeGenContext::initProfile(llvm::Function *mainFunction) {
+  Type *i32 = Type::getInt32Ty(MyContext);
+  Type *i8ptr = Type::getInt8PtrTy(MyContext);
+  auto table = [&](Type *type, const std::vector<Constant *> &elements, const std::string &name) -> Constant * {
+    auto arrayType = ArrayType::get(type, elements.size());
+    auto var = new GlobalVariable(*module, arrayType, true, GlobalValue::PrivateLinkage,
+                                  ConstantArray::get(arrayType, elements), name);
+    return ConstantExpr::getBitCast(var, type->getPointerTo());
+  };
+  std::vector<Constant *> names, lines, loopRoutines, loopLines;
+  for (auto &routine : profiledRoutines) {
+    auto text = ConstantDataArray::getString(MyContext, routine.first);
+    auto var = new GlobalVariable(*module, text->getType(), true, GlobalValue::PrivateLinkage, text, ".str");
+    names.push_back(ConstantExpr::getBitCast(var, i8ptr));
+    lines.push_back(ConstantInt::get(i32, routine.second));
+  }
+  for (auto &loop : profiledLoops) {
+    loopRoutines.push_back(ConstantInt::get(i32, loop.first));
+    loopLines.push_back(ConstantInt::get(i32, loop.second));
+  }
+  std::vector<Type *> params = {i32, i8ptr->getPointerTo(), i32->getPointerTo(), i32, i32->getPointerTo(),
+                                i32->getPointerTo()};
+  auto init = module->getOrInsertFunction("spl_prof_init", FunctionType::get(Type::getVoidTy(MyContext), params, false));
+  std::vector<Value *> args = {ConstantInt::get(i32, names.size()), table(i8ptr, names, "spl.prof.names"),
+                               table(i32, lines, "spl.prof.lines"), ConstantInt::get(i32, loopLines.size()),
+                               table(i32, loopRoutines, "spl.prof.loop.routines"),
+                               table(i32, loopLines, "spl.prof.loop.lines")};
+  BasicBlock &entry = mainFunction->getEntryBlock();
+  IRBuilder<> atEntry(&entry, entry.getFirstInsertionPt());
+  atEntry.CreateCall(init, args);
+}
+
+bool CodeGen::AddFastMathFlag(llvm::FastMathFlags &flags, const std::string &name) {
+  if (name == "fast")
+    flags.setFast();
+  else if (name == "reassoc")
+    flags.setAllowReassoc();
+  else if (name == "contract")
+    flags.setAllowContract(true);
+  else if (name == "nnan")
+    flags.setNoNaNs();
+  else if (name == "ninf")
+    flags.setNoInfs();
+  else if (name == "nsz")
+    flags.setNoSignedZeros();
+  else if (name == "arcp")
+    flags.setAllowReciprocal();
+  else if (name == "afn")
+    flags.setApproxFunc();
+  else
+    return false;
+  return true;
+}
+
+// Real arithmetic of the routine is created with these flags from here on. The matching function
+// attributes let the backend and the older IR passes, which only look at those, use them too.
+void CodeGenContext::setFastMath(llvm::Function *function, llvm::FastMathFlags flags) {
+  builder.setFastMathFlags(flags);
+  if (flags.noNaNs())
+    function->addFnAttr("no-nans-fp-math", "true");
+  if (flags.noInfs())
+    function->addFnAttr("no-infs-fp-math", "true");
+  if (flags.noSignedZeros())
+    function->addFnAttr("no-signed-zeros-fp-math", "true");
+  if (flags.isFast())
+    function->addFnAttr("unsafe-fp-math", "true");
+}
+
+void CodeGenContext::initDebugInfo() {
+  SmallString<128> path(options.sourceFile);
+  sys::fs::make_absolute(path);
+  debugBuilder = new DIBuilder(*module);
+  debugFile = debugBuilder->createFile(sys::path::filename(path), sys::path::parent_path(path));
+  // --emit=asm alone only needs the line table
+  compileUnit = debugBuilder->createCompileUnit(dwarf::DW_LANG_Pascal83, debugFile, "splc", options.optLevel > 0, "",
+                                                0, "", options.debugInfo ? DICompileUnit::FullDebug
+                                                                         : DICompileUnit::LineTablesOnly);
+  module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+  module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+}
+
+void CodeGenContext::debugRoutine(llvm::Function *function, const std::string &name, int line) {
+  if (!debugBuilder)
+    return;
+  auto type = debugBuilder->createSubroutineType(debugBuilder->getOrCreateTypeArray(None));
+  auto flags = DISubprogram::SPFlagDefinition;
+  if (function->hasLocalLinkage())
+    flags |= DISubprogram::SPFlagLocalToUnit;
+  if (options.optLevel > 0)
+    flags |= DISubprogram::SPFlagOptimized;
+  function->setSubprogram(debugBuilder->createFunction(debugFile, name, function->getName(), debugFile, line, type,
+                                                       line, DINode::FlagZero, flags));
+}
+
+// Gives the code generated from here on node's position, until the next statement sets its own.
+void CodeGenContext::setDebugLocation(AST::Node *node) {
+  auto subprogram = blocksStack.top()->function->getSubprogram();
+  if (subprogram)
+    builder.SetCurrentDebugLocation(DILocation::get(MyContext, node->line, node->column, subprogram));
+}
+
+// Code outside any statement, such as a routine's prologue, belongs to the routine's first line.
+void CodeGenContext::finishDebugInfo() {
+  for (auto &function : *module) {
+    auto subprogram = function.getSubprogram();
+    if (!subprogram)
+      continue;
+    auto location = DILocation::get(MyContext, subprogram->getLine(), 0, subprogram);
+    for (auto &block : function)
+      for (auto &instruction : block)
+        if (!instruction.getDebugLoc())
+          instruction.setDebugLoc(location);
+  }
+  debugBuilder->finalize();
+}
+
+// Keeps the remarks of the passes the filter matches for the summary; the remark streamer writes
+// its own copy of them to the YAML file.
+class RemarkCollector : public DiagnosticHandler {
+public:
+  RemarkCollector(std::vector<Remark> &remarks, const std::string &filter) : remarks(remarks), all(filter.empty()),
+                                                                             filter(filter) {}
+
+  bool isAnalysisRemarkEnabled(StringRef pass) const override { return matches(pass); }
+
+  bool isMissedOptRemarkEnabled(StringRef pass) const override { return matches(pass); }
+
+  bool isPassedOptRemarkEnabled(StringRef pass) const override { return matches(pass); }
+
+  bool handleDiagnostics(const DiagnosticInfo &info) override {
+    auto remark = dyn_cast<DiagnosticInfoOptimizationBase>(&info);
+    if (!remark)
+      return false;
+    if (!matches(remark->getPassName()))
+      return true;
+    const Function &function = remark->getFunction();
+    DISubprogram *subprogram = function.getSubprogram();
+    std::string routine = (subprogram ? subprogram->getName() : function.getName()).str();
+    std::string kind = remark->isPassed() ? "passed" : remark->isMissed() ? "missed" : "analysis";
+    unsigned line = remark->isLocationAvailable() ? remark->getLocation().getLine() : 0;
+    remarks.push_back({kind, remark->getPassName().str(), routine, line, remark->getMsg()});
+    return true;
+  }
+
+private:
+  bool matches(StringRef pass) const { return all || filter.match(pass); }
+
+  std::vector<Remark> &remarks;
+  bool all;
+  mutable Regex filter;
+};
+
+// Remarks need debug locations to point at SPL lines, so --remarks also makes a line table.
+void CodeGenContext::initRemarks() {
+  // remarks are emitted on the context of the functions they are about, which is the module's
+  LLVMContext &llvmContext = module->getContext();
+  // with a profile, each remark carries how hot its code is
+#if LLVM_VERSION_MAJOR >= 11
+  auto output = setupLLVMOptimizationRemarks(llvmContext, options.remarksFile, options.remarksFilter, "yaml",
+                                             !options.profileUse.empty());
+#else
+  auto output = setupOptimizationRemarks(llvmContext, options.remarksFile, options.remarksFilter, "yaml",
+                                         !options.profileUse.empty());
+#endif
+  if (!output) {
+    std::cerr << "cannot write remarks: " << toString(output.takeError()) << std::endl;
+    std::exit(1);
+  }
+  remarksOutput = std::move(*output);
+  llvmContext.setDiagnosticHandler(std::make_unique<RemarkCollector>(remarks, options.remarksFilter));
+}
+
+// Stop collecting before the module is generated for a second target, close the YAML file and
+// print the remarks grouped by routine, each line of source followed by the remarks made on it.
+void CodeGenContext::finishRemarks() {
+  LLVMContext &llvmContext = module->getContext();
+  llvmContext.setDiagnosticHandler(std::make_unique<DiagnosticHandler>());
+#if LLVM_VERSION_MAJOR >= 11
+  llvmContext.setLLVMRemarkStreamer(nullptr);
+  llvmContext.setMainRemarkStreamer(nullptr);
+#else
+  llvmContext.setRemarkStreamer(nullptr);
+#endif
+  remarksOutput->keep();
+  remarksOutput.reset();
+
+  std::vector<std::string> source;
+  std::ifstream in(options.sourceFile);
+  for (std::string line; std::getline(in, line);)
+    source.push_back(line);
+  std::map<std::string, int> counts;
+  for (auto &remark : remarks)
+    counts[remark.kind]++;
+  std::cout << "optimization remarks: " << counts["passed"] << " passed, " << counts["missed"] << " missed, "
+            << counts["analysis"] << " analysis (" << options.remarksFile << ")\n";
+  std::stable_sort(remarks.begin(), remarks.end(), [](const Remark &a, const Remark &b) {
+    return std::tie(a.routine, a.line) < std::tie(b.routine, b.line);
+  });
+  for (size_t i = 0; i < remarks.size(); i++) {
+    const Remark &remark = remarks[i];
+    if (i == 0 || remark.routine != remarks[i - 1].routine)
+      std::cout << "  " << remark.routine << ":\n";
+    if (i == 0 || remark.routine != remarks[i - 1].routine || remark.line != remarks[i - 1].line) {
+      if (remark.line > 0 && remark.line <= source.size())
+        std::cout << "    " << remark.line << ": " << StringRef(source[remark.line - 1]).trim().str() << "\n";
+      else
+        std::cout << "    (no line)\n";
+    }
+    std::cout << "      " << remark.kind << " " << remark.pass << ": " << remark.message << "\n";
+  }
+}
+
+void CodeGenContext::reportBoundsChecks() const {
+  int eliminated = 0, hoisted = 0, remaining = 0;
+  for (auto &check : boundsChecks) {
+    if (check.kind == BoundsCheck::T_HOISTED)
+      hoisted++;
+    else if (check.kind == BoundsCheck::T_RUNTIME)
+      remaining++;
+    else
+      eliminated++;
+  }
+  std::cout << "bounds checks: " << eliminated << " eliminated, " << hoisted << " hoisted, "
+            << remaining << " remaining\n";
+  for (auto &check : boundsChecks) {
+    if (check.kind != BoundsCheck::T_HOISTED && check.kind != BoundsCheck::T_RUNTIME)
+      continue;
+    std::cout << "  " << check.routine << ": " << check.array << " index " << check.dimension + 1
+              << (check.kind == BoundsCheck::T_HOISTED ? " (checked once before its loop)" : "") << "\n";
+  }
+}
+
+void CodeGenContext::reportParallelLoops() const {
+  int parallel = 0;
+  for (auto &loop : parallelLoops)
+    parallel += loop.parallel;
+  std::cout << "parallel loops: " << parallel << " parallel, " << parallelLoops.size() - parallel
+            << " sequential\n";
+  for (auto &loop : parallelLoops)
+    std::cout << "  " << loop.routine << ":" << loop.line << " for " << loop.variable << ": "
+              << (loop.parallel ? "parallel" : "sequential") << ", " << loop.reason << "\n";
+}
+
 void CodeGenContext::generateCode(AST::Node *root, const std::string &outputFilename) {
   std::cout << "Generating code...\n";
 
+  // parameter attributes and aggregate copies need type sizes, so fix the layout first
+  auto hostMachine = createTargetMachine(sys::getDefaultTargetTriple(), "generic");
+  if (hostMachine) {
+    module->setTargetTriple(sys::getDefaultTargetTriple());
+    module->setDataLayout(hostMachine->createDataLayout());
+  }
+
   // Create the top level interpreter function to call as entry
   std::vector<llvm::Type *> argTypes;
   llvm::FunctionType *ftype = llvm::FunctionType::get(llvm::Type::getInt32Ty(MyContext), makeArrayRef(argTypes),
@@ -50,15 +892,41 @@ void CodeGenContext::generateCode(AST::Node *root, const std::string &outputFile
   // Push a new variable/basicBlock context
   pushBlock(bblock);
   blocksStack.top()->function = mainFunction;
+  setFastMath(mainFunction, options.fastMath);
+  if (options.debugInfo || options.emitAsm || !options.remarksFile.empty()) {
+    initDebugInfo();
+    debugRoutine(mainFunction, "main", root->line);
+  }
+  if (options.instrumentRoutines)
+    profileProbe("spl_prof_enter", addProfiledRoutine(mainFunction, "program", 1));
   root->codeGen(*this);
 
-  llvm::ReturnInst::Create(MyContext, ConstantInt::get(Type::getInt32Ty(MyContext), llvm::APInt(32, 0, false)),currentBlock());
+  if (options.instrumentRoutines) {
+    profileProbe("spl_prof_exit", routineIds[mainFunction]);
+    initProfile(mainFunction);
+  }
+  builder.CreateRet(ConstantInt::get(Type::getInt32Ty(MyContext), 0));
   popBlock();
 
-  while (!blocksStack.empty())
-    popBlock();
-
   std::cout << "Code is generated.\n";
+  if (options.checkBounds)
+    reportBoundsChecks();
+  if (options.parallelReport)
+    reportParallelLoops();
+  placeLargeLocals();
+  if (options.stats)
+    reportFrameSizes();
+
+  if (options.memoize)
+    memoizeFunctions();
+  addParameterAttributes();
+  inferFunctionAttributes();
+  if (debugBuilder)
+    finishDebugInfo();
+  if (!options.remarksFile.empty())
+    initRemarks();
+  optimize(hostMachine);
+  delete hostMachine;
 
   std::cout << "code is gen~~~\n";
   llvm::outs() << *module;
@@ -75,33 +943,106 @@ void CodeGenContext::generateCode(AST::Node *root, const std::string &outputFile
   // Initialize the target registry etc.
 
   outputCode("output.s", false);
+  if (remarksOutput)
+    finishRemarks();
   outputCode("aarch64.s", true);
 }
 
-void CodeGenContext::outputCode(const std::string& filename, bool aarch64) const {
+llvm::TargetMachine *CodeGenContext::createTargetMachine(const std::string &triple, const std::string &cpu) const {
   InitializeAllTargetInfos();
   InitializeAllTargets();
   InitializeAllTargetMCs();
   InitializeAllAsmParsers();
   InitializeAllAsmPrinters();
 
-  std::string CPU = aarch64 ? "" : "generic";
-  std::string TargetTriple = aarch64 ? "aarch64-pc-linux" : sys::getDefaultTargetTriple();
-  module->setTargetTriple(TargetTriple);
-
   std::string error;
-  auto target = TargetRegistry::lookupTarget(TargetTriple, error);
+  auto target = TargetRegistry::lookupTarget(triple, error);
 
   if (!target) {
     errs() << error;
-    return;
+    return nullptr;
   }
 
   auto Features = "";
 
   TargetOptions opt;
   auto RM = Optional<Reloc::Model>();
-  auto targetMachine = target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+  // the backend has always run at its default level; -O3 asks for more
+  auto level = options.optLevel >= 3 ? CodeGenOpt::Aggressive : CodeGenOpt::Default;
+  return target->createTargetMachine(triple, cpu, Features, opt, RM, None, level);
+}
+
+void CodeGenContext::optimize(llvm::TargetMachine *targetMachine) {
+  // instrumenting and applying a profile both happen in the optimization pipeline, so they
+  // run it at -O1 at least
+  Optional<PGOOptions> pgo;
+  if (options.profileGenerate)
+    pgo = PGOOptions(options.profileFile, "", "", PGOOptions::IRInstr);
+  else if (!options.profileUse.empty())
+    pgo = PGOOptions(options.profileUse, "", "", PGOOptions::IRUse);
+  int optLevel = pgo ? std::max(options.optLevel, 1) : options.optLevel;
+  if (optLevel <= 0)
+    return;
+
+  PassBuilder passBuilder(targetMachine, PipelineTuningOptions(), pgo);
+  LoopAnalysisManager loopAnalysisManager;
+  FunctionAnalysisManager functionAnalysisManager;
+  CGSCCAnalysisManager cgsccAnalysisManager;
+  ModuleAnalysisManager moduleAnalysisManager;
+
+  passBuilder.registerModuleAnalyses(moduleAnalysisManager);
+  passBuilder.registerCGSCCAnalyses(cgsccAnalysisManager);
+  passBuilder.registerFunctionAnalyses(functionAnalysisManager);
+  passBuilder.registerLoopAnalyses(loopAnalysisManager);
+  passBuilder.crossRegisterProxies(loopAnalysisManager, functionAnalysisManager, cgsccAnalysisManager,
+                                   moduleAnalysisManager);
+
+  auto level = PassBuilder::OptimizationLevel::O2;
+  if (optLevel == 1)
+    level = PassBuilder::OptimizationLevel::O1;
+  else if (optLevel >= 3)
+    level = PassBuilder::OptimizationLevel::O3;
+
+  ModulePassManager modulePassManager = passBuilder.buildPerModuleDefaultPipeline(level);
+  // with real counts, move the code that never ran out of the hot routines
+  if (!options.profileUse.empty())
+    modulePassManager.addPass(HotColdSplittingPass());
+  modulePassManager.run(*module, moduleAnalysisManager);
+}
+
+// Puts each source line, as a comment, in front of the first .loc directive that moves to it.
+static std::string AnnotateAssembly(StringRef assembly, const std::string &sourceFile, StringRef comment) {
+  std::vector<std::string> source;
+  std::ifstream in(sourceFile);
+  for (std::string line; std::getline(in, line);)
+    source.push_back(line);
+
+  std::string result;
+  unsigned current = 0;
+  while (!assembly.empty()) {
+    StringRef line;
+    std::tie(line, assembly) = assembly.split('\n');
+    StringRef directive = line.ltrim();
+    unsigned file, number;
+    if (directive.consume_front(".loc") && sscanf(directive.str().c_str(), "%u %u", &file, &number) == 2 &&
+        number != current && number > 0 && number <= source.size()) {
+      current = number;
+      result += (comment + " " + Twine(number) + ": " + StringRef(source[number - 1]).trim() + "\n").str();
+    }
+    result += line;
+    result += '\n';
+  }
+  return result;
+}
+
+void CodeGenContext::outputCode(const std::string& filename, bool aarch64) const {
+  std::string CPU = aarch64 ? "" : "generic";
+  std::string TargetTriple = aarch64 ? "aarch64-pc-linux" : sys::getDefaultTargetTriple();
+  module->setTargetTriple(TargetTriple);
+
+  auto targetMachine = createTargetMachine(TargetTriple, CPU);
+  if (!targetMachine)
+    return;
 
   module->setDataLayout(targetMachine->createDataLayout());
 
@@ -113,14 +1054,20 @@ void CodeGenContext::outputCode(const std::string& filename, bool aarch64) const
     return;
   }
 
+  SmallString<0> assembly;
+  raw_svector_ostream assemblyStream(assembly);
   legacy::PassManager pass;
   auto fileType = LLVMTargetMachine::CodeGenFileType::CGFT_AssemblyFile;
-  if (targetMachine->addPassesToEmitFile(pass, dest, nullptr, fileType)) {
+  if (targetMachine->addPassesToEmitFile(pass, assemblyStream, nullptr, fileType)) {
     errs() << "targetMachine can't emit a file of this type";
     return;
   }
 
   pass.run(*module);
+  if (options.emitAsm)
+    dest << AnnotateAssembly(assembly, options.sourceFile, targetMachine->getMCAsmInfo()->getCommentString());
+  else
+    dest << assembly;
   dest.flush();
   outs() << "Wrote " << filename << "\n";
-}
\ No newline at end of file
+}
@@ -3,25 +3,145 @@
 
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 #include <stack>
 #include <utility>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Analysis/TargetFolder.h>
 
 #include "ASTPredeclaration.h"
 #include "AST.h"
 #include "ConstTable.h"
 
 namespace CodeGen {
-    static llvm::LLVMContext MyContext;
+    // the one context of the module, shared by every translation unit
+    extern llvm::LLVMContext MyContext;
+
+    // folds instructions whose operands are all constants as they are created, with the target's type sizes
+    typedef llvm::IRBuilder<llvm::TargetFolder> Builder;
+
+    class Options {
+    public:
+        // the program being compiled, named in debug info and source listings
+        std::string sourceFile;
+        // -O<n>: level of the LLVM optimization pipeline run before emitting code
+        int optLevel = 0;
+        // --ffast-math, --fast-math=<flag,...>: fast-math flags on real arithmetic in every routine
+        llvm::FastMathFlags fastMath;
+        // -g: emit DWARF debug info: routines, variables and line locations
+        bool debugInfo = false;
+        // --emit=asm: interleave the source lines with the assembly written to output.s
+        bool emitAsm = false;
+        // --check-bounds: check array indices against their declared subranges
+        bool checkBounds = false;
+        // --memoize: give pure functions with scalar parameters a memo table
+        bool memoize = false;
+        // --memo-size=<n>: entries per memo table
+        int memoSize = 4096;
+        // --profile-generate[=<file>]: instrument the program to write a raw profile, to <file> if given
+        bool profileGenerate = false;
+        std::string profileFile;
+        // --profile-use=<file>: optimize with a profile merged by llvm-profdata
+        std::string profileUse;
+        // --instrument=routines: count and time routine calls and loop iterations (runtime/profile.c)
+        bool instrumentRoutines = false;
+        // --auto-parallel: run for loops without loop-carried dependences on the thread pool of runtime/parallel.c
+        bool autoParallel = false;
+        // --parallel-threshold=<n>: fewest iterations worth running in parallel
+        int parallelThreshold = 1000;
+        // --parallel-report: list every for loop with whether it runs in parallel, and why not
+        bool parallelReport = false;
+        // --remarks=<file>: write LLVM optimization remarks to <file> as YAML and summarize them by routine
+        std::string remarksFile;
+        // --remarks-filter=<pass>: only the remarks of passes matching this regular expression
+        std::string remarksFilter;
+        // --stack-threshold=<n>: largest variable in bytes kept on the stack; larger ones of the main program
+        // are static and those of routines go to the arena of runtime/arena.c
+        int64_t stackThreshold = 64 * 1024;
+        // --stats: report the stack and arena bytes of every routine's frame
+        bool stats = false;
+    };
+
+    // Set the fast-math flag named as in LLVM IR (fast, reassoc, contract, nnan, ninf, nsz, arcp, afn).
+    bool AddFastMathFlag(llvm::FastMathFlags &flags, const std::string &name);
+
+    class LoopVariable {
+    public:
+        llvm::PHINode *induction;
+        llvm::Value *first, *last;
+    };
+
+    // An array assigned a whole-array expression element by element: the extents every array in the
+    // expression must have, and the flat index of the element being computed.
+    class ElementLoop {
+    public:
+        std::vector<int64_t> extents;
+        llvm::Value *index;
+    };
+
+    class BoundsCheck {
+    public:
+        enum {T_CONSTANT, T_RANGE, T_HOISTED, T_RUNTIME} kind;
+        std::string routine;
+        std::string array;
+        int dimension;
+    };
+
+    class ParallelLoop {
+    public:
+        std::string routine;
+        int line;
+        std::string variable;
+        bool parallel;
+        std::string reason;
+    };
+
+    // An optimization remark, at the SPL line of its debug location (0 when it has none).
+    class Remark {
+    public:
+        // passed, missed or analysis
+        std::string kind;
+        std::string pass;
+        std::string routine;
+        unsigned line;
+        std::string message;
+    };
+
+    // A variable of an enclosing routine that a nested routine uses: the value its owner keeps
+    // it in, which holds its address instead when it is a reference there.
+    class Capture {
+    public:
+        llvm::Value *variable;
+        bool reference;
+        // the name it is used by in the nested routine, empty when only passed on to other routines
+        std::string name;
+        AST::TypeDecl *type;
+    };
 
     class FuncParams {
     public:
+        // var parameters
         std::vector<int> position;
+        // array and record value parameters, passed by address
+        std::vector<int> aggregates;
+        // pointer parameters the routine never writes through
+        std::vector<int> readOnly;
+        // dynamic array value parameters, passed as the caller's handle
+        std::vector<int> arrays;
+        // declared value ranges of subrange, char and boolean value parameters
+        std::map<int, std::pair<int64_t, int64_t>> ranges;
+        // variables of enclosing routines, passed by address after the declared parameters
+        std::vector<Capture> captures;
     };
 
     class CodeGenBlock {
@@ -33,7 +153,17 @@ namespace CodeGen {
         std::map<std::string, AST::TypeDecl *> varTypes;
         std::map<std::string, AST::TypeDecl *> types;
         std::set<std::string> references;
+        // captured variable -> local slot holding its address
+        std::map<llvm::Value *, llvm::Value *> captures;
         std::string outputFilename;
+        // the statements of the routine, for analyses that need to see past the code being generated
+        AST::Node *body = nullptr;
+        // handles of the dynamic arrays the routine declares, released when it returns
+        std::vector<llvm::Value *> dynamicArrays;
+        // dynamic array value parameters, whose blocks belong to the caller
+        std::set<std::string> borrowedArrays;
+        // variables and value parameters of the routine holding strings, whose heap bytes are freed when it returns
+        std::vector<llvm::Value *> strings;
 
         explicit CodeGenBlock(llvm::BasicBlock *block, CodeGenBlock *preBlock) : basicBlock(block), preBlock(preBlock) {}
     };
@@ -42,22 +172,67 @@ namespace CodeGen {
     public:
         std::stack<CodeGenBlock *> blocksStack;
         llvm::Module *module;
+        // every instruction is created at its insertion point
+        Builder builder;
         std::map<std::string, FuncParams> funcParams;
+        // for-loop control variables of the loops being generated, bound to their induction PHIs
+        std::map<std::string, LoopVariable> loopVariables;
+        // the element-wise assignment whose right-hand side is being generated
+        ElementLoop *elementLoop = nullptr;
+        // index expressions whose bounds check was already emitted in front of their loop
+        std::set<AST::Expression *> hoistedBoundsChecks;
+        std::vector<BoundsCheck> boundsChecks;
+        // for loops met with --auto-parallel or --parallel-report, and what became of them
+        std::vector<ParallelLoop> parallelLoops;
+        // code being outlined into the body of a parallel loop, whose own loops stay sequential
+        bool inParallelBody = false;
+        // self-recursive calls in tail position, emitted as guaranteed tail calls
+        std::set<AST::Node *> tailCalls;
+        // string literals, each placed once in read-only data
+        std::map<std::string, llvm::Constant *> stringLiterals;
+        // array names for bounds errors, as C strings placed once in read-only data
+        std::map<std::string, llvm::Constant *> arrayNames;
+        // main-program variables some routine uses by name, which stay globals
+        std::set<std::string> sharedGlobals;
+        // routine locals above --stack-threshold, and the arena bytes of the routines they were moved out of
+        std::vector<llvm::AllocaInst *> largeLocals;
+        std::map<llvm::Function *, uint64_t> arenaBytes;
+        // --instrument=routines: routine names and lines, loops as routine index and line
+        std::vector<std::pair<std::string, int>> profiledRoutines;
+        std::vector<std::pair<int, int>> profiledLoops;
+        std::map<llvm::Function *, int> routineIds;
+        // -g and --emit=asm: debug info for the whole program, types described once per declaration
+        llvm::DIBuilder *debugBuilder = nullptr;
+        llvm::DICompileUnit *compileUnit = nullptr;
+        llvm::DIFile *debugFile = nullptr;
+        std::map<AST::TypeDecl *, llvm::DIType *> debugTypes;
+        // --remarks: the YAML file being written, and the remarks collected for the summary
+        std::unique_ptr<llvm::ToolOutputFile> remarksOutput;
+        std::vector<Remark> remarks;
         ConstTable constTable;
+        Options options;
         bool isGlobal;
 
         llvm::Function *print;
         llvm::Function *read;
+        llvm::Function *boundsError;
 
-        CodeGenContext() : module(new llvm::Module("main", MyContext)), print(nullptr), isGlobal(true) {}
+        CodeGenContext() : module(new llvm::Module("main", MyContext)),
+                           builder(MyContext, llvm::TargetFolder(module->getDataLayout())), isGlobal(true),
+                           print(nullptr), read(nullptr), boundsError(nullptr) {}
 
         ~CodeGenContext() {
+          delete debugBuilder;
           delete module;
         }
 
+        // enters the scope of a routine, generating code from its entry block
         void pushBlock(llvm::BasicBlock *block) {
           CodeGenBlock *top = blocksStack.empty() ? nullptr : blocksStack.top();
           blocksStack.push(new CodeGenBlock(block, top));
+          builder.SetInsertPoint(block);
+          // a new routine must not inherit the position of the statement that encloses it
+          builder.SetCurrentDebugLocation(llvm::DebugLoc());
         }
 
         void popBlock() {
@@ -67,12 +242,9 @@ namespace CodeGen {
         }
 
         CodeGenBlock *isReference(const std::string &var) {
-          CodeGenBlock *p = blocksStack.top();
-          while (p) {
-            if (p->references.find(var) != p->references.end())
-              return p;
-            p = p->preBlock;
-          }
+          CodeGenBlock *p = isVariable(var);
+          if (p && p->references.find(var) != p->references.end())
+            return p;
           return nullptr;
         }
 
@@ -96,6 +268,10 @@ namespace CodeGen {
           return nullptr;
         }
 
+        bool isLoopVariable(const std::string &v) const {
+          return loopVariables.find(v) != loopVariables.end();
+        }
+
         std::map<std::string, llvm::Value *> &local() { return blocksStack.top()->locals; };
 
         std::map<std::string, AST::TypeDecl *> &varType() { return blocksStack.top()->varTypes; };
@@ -104,13 +280,37 @@ namespace CodeGen {
 
         std::map<std::string, AST::TypeDecl *> &type() { return blocksStack.top()->types; };
 
-        llvm::BasicBlock *currentBlock() { return blocksStack.top()->basicBlock; }
+        llvm::BasicBlock *currentBlock() { return builder.GetInsertBlock(); }
 
         void generateCode(AST::Node *root, const std::string &outputFilename);
 
+        llvm::TargetMachine *createTargetMachine(const std::string &triple, const std::string &cpu) const;
+
+        void optimize(llvm::TargetMachine *targetMachine);
+
         void outputCode(const std::string& filename, bool mips) const;
         void readFunc();
         void printFunc();
+        llvm::Function *boundsErrorFunc();
+        void reportBoundsChecks() const;
+        void reportParallelLoops() const;
+        bool isPureRoutine(llvm::Function *function) const;
+        void placeLargeLocals();
+        void reportFrameSizes() const;
+        int addProfiledRoutine(llvm::Function *function, const std::string &name, int line);
+        int addProfiledLoop(llvm::Function *function, int line);
+        llvm::CallInst *profileProbe(const std::string &probe, int id);
+        void initProfile(llvm::Function *mainFunction);
+        void initDebugInfo();
+        void debugRoutine(llvm::Function *function, const std::string &name, int line);
+        void setFastMath(llvm::Function *function, llvm::FastMathFlags flags);
+        void setDebugLocation(AST::Node *node);
+        void finishDebugInfo();
+        void initRemarks();
+        void finishRemarks();
+        void memoizeFunctions();
+        void addParameterAttributes();
+        void inferFunctionAttributes();
     };
 }
 
@@ -14,8 +14,8 @@
 class ConstTable {
 public:
   struct ConstValueUnion {
-    enum {INTEGER, REAL, CHAR} type;
-    std::variant<double, int, char> val;
+    enum {INTEGER, REAL, CHAR, STRING} type;
+    std::variant<double, int, char, std::string> val;
   };
 
 	std::map<std::string, std::list<ConstValueUnion>> table;
@@ -40,6 +40,9 @@ public:
 					case ConstValueUnion::CHAR:
 						std::cout << std::get<char>(item.val)  << ", ";
 						break;
+					case ConstValueUnion::STRING:
+						std::cout << std::get<std::string>(item.val)  << ", ";
+						break;
 				}
 			std::cout << std::endl;
 		}
@@ -63,6 +66,11 @@ public:
 		return std::get<char>(table.at(name).back().val);
 	}
 
+	const std::string &getString(const std::string &name) const {
+		assert(table.at(name).back().type == ConstValueUnion::STRING);
+		return std::get<std::string>(table.at(name).back().val);
+	}
+
 	void addInt(const std::string &name, int i) {
 		if (table.find(name) != table.end()) {
       table.at(name).push_back( {ConstValueUnion::INTEGER, i});
@@ -85,7 +93,16 @@ public:
     if (table.find(name) != table.end()) {
       table.at(name).push_back( {ConstValueUnion::CHAR, c});
     } else {
-      std::list<ConstValueUnion> tmp = {{ConstValueUnion::REAL, c}};
+      std::list<ConstValueUnion> tmp = {{ConstValueUnion::CHAR, c}};
+      table.insert(std::make_pair(name, tmp));
+    }
+	}
+
+	void addString(const std::string &name, const std::string &s) {
+    if (table.find(name) != table.end()) {
+      table.at(name).push_back( {ConstValueUnion::STRING, s});
+    } else {
+      std::list<ConstValueUnion> tmp = {{ConstValueUnion::STRING, s}};
       table.insert(std::make_pair(name, tmp));
     }
 	}
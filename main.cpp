@@ -1,5 +1,7 @@
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
+#include <algorithm>
 
 #include <fmt/core.h>
 #include <fmt/printf.h>
@@ -15,6 +17,8 @@ extern int yyparse();
 
 std::ofstream astOut;
 int AST::Node::idCount = 0;
+int AST::Node::sourceLine = 1;
+int AST::Node::sourceColumn = 1;
 
 void printAST(AST::Node *node) {
   auto children = node->getChildren();
@@ -32,9 +36,102 @@ void printAST(AST::Node *node) {
   }
 }
 
+static bool parseOptions(int argc, char **argv, CodeGen::Options &options, std::string &sourceFile) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && arg[2] >= '0' && arg[2] <= '3') {
+      options.optLevel = arg[2] - '0';
+    } else if (arg == "-g") {
+      options.debugInfo = true;
+    } else if (arg == "--emit=asm") {
+      options.emitAsm = true;
+    } else if (arg == "--ffast-math") {
+      options.fastMath.setFast();
+    } else if (arg.compare(0, 12, "--fast-math=") == 0) {
+      std::string flags = arg.substr(12);
+      for (size_t start = 0, end; start <= flags.size(); start = end + 1) {
+        end = std::min(flags.find(',', start), flags.size());
+        if (!CodeGen::AddFastMathFlag(options.fastMath, flags.substr(start, end - start))) {
+          std::cerr << "unknown fast-math flag in " << arg << std::endl;
+          return false;
+        }
+      }
+    } else if (arg == "--check-bounds") {
+      options.checkBounds = true;
+    } else if (arg == "--memoize") {
+      options.memoize = true;
+    } else if (arg.compare(0, 12, "--memo-size=") == 0) {
+      options.memoSize = std::atoi(arg.c_str() + 12);
+      if (options.memoSize <= 0) {
+        std::cerr << "invalid memo table size: " << arg << std::endl;
+        return false;
+      }
+    } else if (arg == "--profile-generate") {
+      options.profileGenerate = true;
+    } else if (arg.compare(0, 19, "--profile-generate=") == 0) {
+      options.profileGenerate = true;
+      options.profileFile = arg.substr(19);
+    } else if (arg.compare(0, 14, "--profile-use=") == 0) {
+      options.profileUse = arg.substr(14);
+      if (!std::ifstream(options.profileUse)) {
+        std::cerr << "cannot open profile: " << options.profileUse << std::endl;
+        return false;
+      }
+    } else if (arg == "--instrument=routines") {
+      options.instrumentRoutines = true;
+    } else if (arg == "--auto-parallel") {
+      options.autoParallel = true;
+    } else if (arg.compare(0, 21, "--parallel-threshold=") == 0) {
+      options.parallelThreshold = std::atoi(arg.c_str() + 21);
+      if (options.parallelThreshold <= 0) {
+        std::cerr << "invalid parallel threshold: " << arg << std::endl;
+        return false;
+      }
+    } else if (arg == "--parallel-report") {
+      options.parallelReport = true;
+    } else if (arg.compare(0, 10, "--remarks=") == 0) {
+      options.remarksFile = arg.substr(10);
+    } else if (arg.compare(0, 17, "--remarks-filter=") == 0) {
+      options.remarksFilter = arg.substr(17);
+    } else if (arg.compare(0, 18, "--stack-threshold=") == 0) {
+      options.stackThreshold = std::atoll(arg.c_str() + 18);
+      if (options.stackThreshold <= 0) {
+        std::cerr << "invalid stack threshold: " << arg << std::endl;
+        return false;
+      }
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg[0] == '-') {
+      std::cerr << "unknown option: " << arg << std::endl;
+      return false;
+    } else {
+      sourceFile = arg;
+      options.sourceFile = arg;
+    }
+  }
+  if (options.profileGenerate && !options.profileUse.empty()) {
+    std::cerr << "--profile-generate and --profile-use cannot be combined" << std::endl;
+    return false;
+  }
+  if (!options.remarksFilter.empty() && options.remarksFile.empty()) {
+    std::cerr << "--remarks-filter needs --remarks=<file>" << std::endl;
+    return false;
+  }
+  return !sourceFile.empty();
+}
+
 int main(int argc, char **argv) {
-  std::string sourcePath;
-  auto sourceFile = sourcePath + argv[1];
+  CodeGen::Options options;
+  std::string sourceFile;
+  if (!parseOptions(argc, argv, options, sourceFile)) {
+    std::cerr << "usage: " << argv[0] << " [-O0|-O1|-O2|-O3] [-g] [--emit=asm] [--ffast-math] [--fast-math=<flag,...>]"
+              << " [--check-bounds] [--memoize] [--memo-size=<n>] [--profile-generate[=<file>]]"
+              << " [--profile-use=<file>] [--instrument=routines] [--auto-parallel] [--parallel-threshold=<n>]"
+              << " [--parallel-report] [--remarks=<file>] [--remarks-filter=<pass>] [--stack-threshold=<n>]"
+              << " [--stats] input.spl"
+              << std::endl;
+    return 1;
+  }
   std::cout << "input file: " << sourceFile << std::endl;
   yyin = fopen(sourceFile.c_str(), "r");
   yyparse();
@@ -52,6 +149,7 @@ int main(int argc, char **argv) {
   astOut.close();
 
   CodeGen::CodeGenContext context;
+  context.options = options;
   context.generateCode(root, "output.ll");
   return 0;
 }
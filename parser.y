@@ -5,8 +5,26 @@
     extern int yylineno;
     extern int yylex();
     void yyerror(const char *s)	{ printf("ERROR: %s\n at line:%d\n", s, yylineno); }
+
+    /* the usual span of a rule, which also becomes the position of the nodes its action builds */
+    #define YYLLOC_DEFAULT(Current, Rhs, N) \
+        do { \
+            if (N) { \
+                (Current).first_line = YYRHSLOC(Rhs, 1).first_line; \
+                (Current).first_column = YYRHSLOC(Rhs, 1).first_column; \
+                (Current).last_line = YYRHSLOC(Rhs, N).last_line; \
+                (Current).last_column = YYRHSLOC(Rhs, N).last_column; \
+            } else { \
+                (Current).first_line = (Current).last_line = YYRHSLOC(Rhs, 0).last_line; \
+                (Current).first_column = (Current).last_column = YYRHSLOC(Rhs, 0).last_column; \
+            } \
+            AST::Node::sourceLine = (Current).first_line; \
+            AST::Node::sourceColumn = (Current).first_column; \
+        } while (0)
 %}
 
+%locations
+
 /* Represents the many different ways we can access our data */
 %union	{
     AST::Node *node;
@@ -37,6 +55,7 @@
     AST::FunctionHead *functionHead;
     AST::ProcedureDecl *procedureDecl;
     AST::ProcedureHead *procedureHead;
+    AST::DirectiveList *directiveList;
     AST::Parameters *parameters;
     AST::ParaDeclList *paraDeclList;
     AST::ParaTypeList *paraTypeList;
@@ -55,9 +74,12 @@
     AST::WhileStmt *whileStmt;
     AST::ForStmt *forStmt;
     AST::Direction *direction;
+    AST::ParallelClause *parallelClause;
     AST::CaseStmt *caseStmt;
     AST::CaseExprList *caseExprList;
     AST::CaseExpr *caseExpr;
+    AST::CaseLabelList *caseLabelList;
+    AST::SetElementList *setElementList;
     AST::GotoStmt *gotoStmt;
     AST::ExpressionList *expressionList;
     AST::Expression *expression;
@@ -79,7 +101,7 @@
 %token <token> N_LP RP LB RB DOT COMMA COLON
 %token <token> ASSIGN DOTDOT SEMI ARRAY BBEGIN CASE
 %token <token> CONST DO DOWNTO ELSE END FOR FUNCTION
-%token <token> GOTO IF IN OF PACKED PROCEDURE
+%token <token> GOTO IF IN OF PACKED PARALLEL PROCEDURE
 %token <token> PROGRAM RECORD REPEAT SET THEN TO TYPE
 %token <token> UNTIL VAR WHILE WITH
 %token <token> NOT
@@ -104,6 +126,8 @@
 %type <typeDecl> type_decl
 %type <simpleTypeDecl> simple_type_decl
 %type <arrayTypeDecl> array_type_decl
+%type <typeDecl> array_type_tail
+%type <setElementList> set_element_list
 %type <recordTypeDecl> record_type_decl
 %type <fieldDeclList> field_decl_list
 %type <fieldDecl> field_decl
@@ -116,6 +140,7 @@
 %type <functionHead> function_head
 %type <procedureDecl> procedure_decl
 %type <procedureHead> procedure_head
+%type <directiveList> directive_list
 %type <parameters> parameters
 %type <paraDeclList> para_decl_list
 %type <paraTypeList> para_type_list
@@ -134,11 +159,14 @@
 %type <whileStmt> while_stmt
 %type <forStmt> for_stmt
 %type <direction> direction
+%type <parallelClause> parallel_part parallel_clause_list
+%type <string> parallel_kind
 %type <caseStmt> case_stmt
 %type <caseExprList> case_expr_list
 %type <caseExpr> case_expr
+%type <caseLabelList> case_label_list
 %type <gotoStmt> goto_stmt
-%type <expressionList> expression_list
+%type <expressionList> expression_list index_list
 %type <expression> expression
 %type <expr> expr
 %type <term> term
@@ -173,6 +201,9 @@ type_definition: 	NAME EQ type_decl SEMI		{ $$ = new TypeDefinition(*$1, $3); }
 type_decl: 			simple_type_decl		{ $$ = new TypeDecl($1); }
         |		    array_type_decl		{ $$ = new TypeDecl($1); }
         |		    record_type_decl		{ $$ = new TypeDecl($1); }
+        |		    PACKED array_type_decl		{ $2->packed = true; $$ = new TypeDecl($2); }
+        |		    PACKED record_type_decl		{ $2->packed = true; $$ = new TypeDecl($2); }
+        |		    SET OF simple_type_decl		{ $$ = new TypeDecl(new SetTypeDecl($3)); }
 simple_type_decl: 	SYS_TYPE		{ $$ = new SimpleTypeDecl(SimpleTypeDecl::T_SYS_TYPE, *$1); }
         |			NAME		{ $$ = new SimpleTypeDecl(SimpleTypeDecl::T_TYPE_NAME, *$1); }
         |			N_LP name_list RP		{ $$ = new SimpleTypeDecl($2); }
@@ -180,7 +211,10 @@ simple_type_decl: 	SYS_TYPE		{ $$ = new SimpleTypeDecl(SimpleTypeDecl::T_SYS_TYP
         |			MINUS const_value DOTDOT const_value		{ $$ = new SimpleTypeDecl($2->negate(), $4); }
         |			MINUS const_value DOTDOT MINUS const_value		{ $$ = new SimpleTypeDecl($2->negate(), $5->negate()); }
         |			NAME DOTDOT NAME		{ $$ = new SimpleTypeDecl(*$1, *$3); }
-array_type_decl: 	ARRAY LB simple_type_decl RB OF type_decl		{ $$ = new ArrayTypeDecl($3, $6); }
+array_type_decl: 	ARRAY LB simple_type_decl array_type_tail		{ $$ = new ArrayTypeDecl($3, $4); }
+        |			ARRAY OF type_decl		{ $$ = new ArrayTypeDecl(nullptr, $3); }
+array_type_tail: 	RB OF type_decl		{ $$ = $3; }
+        |			COMMA simple_type_decl array_type_tail		{ $$ = new TypeDecl(new ArrayTypeDecl($2, $3)); }
 record_type_decl: 	RECORD field_decl_list END		{ $$ = new RecordTypeDecl($2); }
 field_decl_list: 	field_decl_list field_decl		{ $$ = new FieldDeclList($1, $2); }
         |			field_decl		{ $$ = new FieldDeclList(nullptr, $1); }
@@ -198,10 +232,13 @@ routine_part: 		routine_part function_decl		{ $$ = new RoutinePart($1, $2); }
         |			function_decl		{ $$ = new RoutinePart($1); }
         |			procedure_decl		{ $$ = new RoutinePart($1); }
         |			empty		{ $$ = new RoutinePart(RoutinePart::T_EMPTY); }
-function_decl: 		function_head SEMI sub_routine SEMI		{ $$ = new FunctionDecl($1, $3); }
+function_decl: 		function_head SEMI directive_list sub_routine SEMI		{ $$ = new FunctionDecl($1, $3, $4); }
 function_head: 		FUNCTION NAME parameters COLON simple_type_decl		{ $$ = new FunctionHead(*$2, $3, $5); }
-procedure_decl: 	procedure_head SEMI sub_routine SEMI		{ $$ = new ProcedureDecl($1, $3); }
+procedure_decl: 	procedure_head SEMI directive_list sub_routine SEMI		{ $$ = new ProcedureDecl($1, $3, $4); }
 procedure_head: 	PROCEDURE NAME parameters		{ $$ = new ProcedureHead(*$2, $3); }
+directive_list: 	directive_list NAME SEMI		{ $$ = new DirectiveList($1, *$2, nullptr); }
+        |			directive_list NAME N_LP name_list RP SEMI		{ $$ = new DirectiveList($1, *$2, $4); }
+        |			empty		{ $$ = nullptr; }
 parameters: 		N_LP para_decl_list RP		{ $$ = new Parameters($2); }
         |			empty		{ $$ = new Parameters(nullptr); }
 para_decl_list: 	para_decl_list SEMI para_type_list		{ $$ = new ParaDeclList($1, $3); }
@@ -227,7 +264,7 @@ non_label_stmt: 	assign_stmt		{ $$ = new NonLabelStmt($1); }
         |			case_stmt		{ $$ = new NonLabelStmt($1); }
         |			goto_stmt		{ $$ = new NonLabelStmt($1); }
 assign_stmt: 		N_ID ASSIGN expression		{ $$ = new AssignStmt(*$1, $3); }
-        |			N_ID LB expression RB ASSIGN expression		{ $$ = new AssignStmt(*$1, $3, $6); }
+        |			N_ID index_list ASSIGN expression		{ $$ = new AssignStmt(*$1, $2, $4); }
         |			N_ID DOT N_ID ASSIGN expression		{ $$ = new AssignStmt(*$1, *$3, $5); }
 proc_stmt: 			N_ID		{ $$ = new ProcStmt(ProcStmt::T_SIMPLE, *$1); }
         |			N_ID N_LP args_list RP		{ $$ = new ProcStmt(*$1, $3); }
@@ -240,13 +277,29 @@ else_clause: 		ELSE stmt		{ $$ = new ElseClause($2); }
 repeat_stmt: 		REPEAT stmt_list UNTIL expression		{ $$ = new RepeatStmt($2, $4); }
 while_stmt: 		WHILE expression DO stmt		{ $$ = new WhileStmt($2, $4); }
 for_stmt: 			FOR N_ID ASSIGN expression direction expression DO stmt		{ $$ = new ForStmt(*$2, $4, $5, $6, $8); }
+        |			PARALLEL parallel_part FOR N_ID ASSIGN expression direction expression DO stmt		{ $$ = new ForStmt(*$4, $6, $7, $8, $10); $$->setParallel($2); }
+parallel_part: 		N_LP parallel_clause_list RP		{ $$ = $2; }
+        |			empty		{ $$ = nullptr; }
+parallel_clause_list: 	parallel_clause_list SEMI parallel_kind COLON name_list		{ $$ = new ParallelClause($1, *$3, $5); }
+        |			parallel_kind COLON name_list		{ $$ = new ParallelClause(nullptr, *$1, $3); }
+parallel_kind: 		PLUS		{ $$ = new std::string("+"); }
+        |			MUL		{ $$ = new std::string("*"); }
+        |			NAME		{ $$ = $1; }
 direction: 			TO		{ $$ = new Direction(Direction::T_TO); }
         |			DOWNTO		{ $$ = new Direction(Direction::T_DOWNTO); }
-case_stmt: 			CASE expression OF case_expr_list END		{ $$ = new CaseStmt($2, $4); }
+case_stmt: 			CASE expression OF case_expr_list END		{ $$ = new CaseStmt($2, $4, nullptr); }
+        |			CASE expression OF case_expr_list ELSE stmt SEMI END		{ $$ = new CaseStmt($2, $4, $6); }
 case_expr_list: 	case_expr_list case_expr		{ $$ = new CaseExprList($1, $2); }
         |			case_expr		{ $$ = new CaseExprList(nullptr, $1); }
-case_expr: 			const_value COLON stmt SEMI		{ $$ = new CaseExpr($1, $3); }
-        |			N_ID COLON stmt SEMI		{ $$ = new CaseExpr(*$1, $3); }
+case_expr: 			case_label_list COLON stmt SEMI		{ $$ = new CaseExpr($1, $3); }
+case_label_list: 	case_label_list COMMA const_value		{ $$ = new CaseLabelList($1, $3); }
+        |			case_label_list COMMA N_ID		{ $$ = new CaseLabelList($1, *$3); }
+        |			case_label_list COMMA const_value DOTDOT const_value		{ $$ = new CaseLabelList($1, $3, $5); }
+        |			case_label_list COMMA N_ID DOTDOT N_ID		{ $$ = new CaseLabelList($1, *$3, *$5); }
+        |			const_value		{ $$ = new CaseLabelList(nullptr, $1); }
+        |			N_ID		{ $$ = new CaseLabelList(nullptr, *$1); }
+        |			const_value DOTDOT const_value		{ $$ = new CaseLabelList(nullptr, $1, $3); }
+        |			N_ID DOTDOT N_ID		{ $$ = new CaseLabelList(nullptr, *$1, *$3); }
 goto_stmt: 			GOTO INTEGER		{ $$ = new GotoStmt(*$2); }
 expression_list: 	expression_list COMMA expression		{ $$ = new ExpressionList($1, $3); }
         |			expression		{ $$ = new ExpressionList(nullptr, $1); }
@@ -256,6 +309,7 @@ expression: 		expression GE expr		{ $$ = new Expression(Expression::T_GE, $1, $3
         |			expression N_LT expr		{ $$ = new Expression(Expression::T_LT, $1, $3); }
         |			expression EQ expr		{ $$ = new Expression(Expression::T_EQ, $1, $3); }
         |			expression NE expr		{ $$ = new Expression(Expression::T_NE, $1, $3); }
+        |			expression IN expr		{ $$ = new Expression(Expression::T_IN, $1, $3); }
         |			expr		{ $$ = new Expression($1); }
 expr: 			    expr PLUS term		{ $$ = new Expr(Expr::T_PLUS, $1, $3); }
         |			expr MINUS term		{ $$ = new Expr(Expr::T_MINUS, $1, $3); }
@@ -274,8 +328,16 @@ factor: 			NAME		{ $$ = new Factor(Factor::T_NAME, *$1); }
         |			N_LP expression RP		{ $$ = new Factor($2); }
         |			NOT factor		{ $$ = new Factor(Factor::T_NOT_FACTOR, $2); }
         |			MINUS factor		{ $$ = new Factor(Factor::T_MINUS_FACTOR, $2); }
-        |			N_ID LB expression RB		{ $$ = new Factor(*$1, $3); }
+        |			N_ID index_list		{ $$ = new Factor(*$1, $2); }
         |			N_ID DOT N_ID		{ $$ = new Factor(*$1, *$3); }
+        |			LB set_element_list RB		{ $$ = new Factor($2); }
+        |			LB RB		{ $$ = new Factor(static_cast<SetElementList *>(nullptr)); }
+set_element_list: 	set_element_list COMMA expression		{ $$ = new SetElementList($1, $3, nullptr); }
+        |			set_element_list COMMA expression DOTDOT expression		{ $$ = new SetElementList($1, $3, $5); }
+        |			expression		{ $$ = new SetElementList(nullptr, $1, nullptr); }
+        |			expression DOTDOT expression		{ $$ = new SetElementList(nullptr, $1, $3); }
+index_list: 		index_list LB expression_list RB		{ $$ = $3->chain($1); }
+        |			LB expression_list RB		{ $$ = $2; }
 args_list: 			args_list COMMA expression		{ $$ = new ArgsList($1, $3); }
         |			expression		{ $$ = new ArgsList(nullptr, $1); }
 NAME: 			    N_ID		{ $$ = $1; }
@@ -0,0 +1,199 @@
+/*
+ * Memory of splc's dynamic arrays and of routine locals too large for the stack. Link it with the
+ * generated assembly:
+ *   gcc -no-pie output.s runtime/arena.c
+ * A dynamic array is a handle to a block holding its lower bound and length, followed by the
+ * elements; the empty array is a null handle. Blocks come in power-of-two sizes. Each thread
+ * carves them out of large chunks and keeps the blocks it releases on a free list per size, from
+ * which later arrays of the same size are served. Blocks larger than a chunk go to malloc.
+ * Large locals come from a stack of chunks per thread instead: a routine marks the top on entry,
+ * bumps it for each local and moves it back to the mark on exit. Chunks stay allocated once the
+ * top has left them, for the next calls to reuse.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct array {
+  int64_t low, length;
+  char elements[];
+};
+
+struct block {
+  struct block *next;
+};
+
+#define MIN_CLASS 5
+#define CHUNK_CLASS 20
+
+static __thread struct block *freeBlocks[CHUNK_CLASS + 1];
+static __thread char *chunkNext, *chunkEnd;
+
+static void *checked(void *p) {
+  if (!p) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static size_t blockSize(int64_t length, int64_t elementSize) {
+  return sizeof(struct array) + (size_t) length * (size_t) elementSize;
+}
+
+/* The smallest class c whose blocks of 2^c bytes hold the given size. */
+static int sizeClass(size_t size) {
+  int c = MIN_CLASS;
+  while (((size_t) 1 << c) < size)
+    c++;
+  return c;
+}
+
+static void release(struct array *a, int64_t elementSize) {
+  if (!a)
+    return;
+  int c = sizeClass(blockSize(a->length, elementSize));
+  if (c > CHUNK_CLASS) {
+    free(a);
+    return;
+  }
+  struct block *b = (struct block *) a;
+  b->next = freeBlocks[c];
+  freeBlocks[c] = b;
+}
+
+/* Blocks above the chunk size are malloc'd at the full size of their class too, so that a resize
+ * within the class can keep them. */
+static struct array *allocate(size_t size) {
+  int c = sizeClass(size);
+  if (c > CHUNK_CLASS)
+    return checked(malloc((size_t) 1 << c));
+  if (freeBlocks[c]) {
+    struct block *b = freeBlocks[c];
+    freeBlocks[c] = b->next;
+    return (struct array *) b;
+  }
+  size_t bytes = (size_t) 1 << c;
+  if ((size_t) (chunkEnd - chunkNext) < bytes) {
+    /* what is left of the old chunk goes to the free lists, largest blocks first */
+    for (int k = CHUNK_CLASS; k >= MIN_CLASS; k--) {
+      while ((size_t) (chunkEnd - chunkNext) >= ((size_t) 1 << k)) {
+        struct block *b = (struct block *) chunkNext;
+        b->next = freeBlocks[k];
+        freeBlocks[k] = b;
+        chunkNext += (size_t) 1 << k;
+      }
+    }
+    chunkNext = checked(malloc((size_t) 1 << CHUNK_CLASS));
+    chunkEnd = chunkNext + ((size_t) 1 << CHUNK_CLASS);
+  }
+  struct array *a = (struct array *) chunkNext;
+  chunkNext += bytes;
+  return a;
+}
+
+/* Give the array the bounds low..high, keeping the elements within both the old and the new
+ * bounds and zeroing the rest. The block is reused when the new size falls in its class. */
+void *spl_array_resize(void *array, int64_t low, int64_t high, int64_t elementSize) {
+  struct array *old = array;
+  int64_t length = high >= low ? high - low + 1 : 0;
+  if (length == 0) {
+    release(old, elementSize);
+    return NULL;
+  }
+  size_t size = blockSize(length, elementSize);
+  if (old && old->low == low && sizeClass(blockSize(old->length, elementSize)) == sizeClass(size)) {
+    if (length > old->length)
+      memset(old->elements + old->length * elementSize, 0, (size_t) (length - old->length) * elementSize);
+    old->length = length;
+    return old;
+  }
+
+  struct array *a = allocate(size);
+  a->low = low;
+  a->length = length;
+  memset(a->elements, 0, (size_t) length * elementSize);
+  if (old) {
+    int64_t first = old->low > low ? old->low : low;
+    int64_t last = old->low + old->length - 1 < high ? old->low + old->length - 1 : high;
+    if (first <= last)
+      memcpy(a->elements + (first - low) * elementSize, old->elements + (first - old->low) * elementSize,
+             (size_t) (last - first + 1) * elementSize);
+    release(old, elementSize);
+  }
+  return a;
+}
+
+/* dest := src: a copy of src in dest's block when it is of the right class, in a new one otherwise. */
+void *spl_array_assign(void *dest, const void *src, int64_t elementSize) {
+  struct array *d = dest;
+  const struct array *s = src;
+  if (d == s)
+    return d;
+  if (!s) {
+    release(d, elementSize);
+    return NULL;
+  }
+  size_t size = blockSize(s->length, elementSize);
+  if (!d || sizeClass(blockSize(d->length, elementSize)) != sizeClass(size)) {
+    release(d, elementSize);
+    d = allocate(size);
+  }
+  memcpy(d, s, size);
+  return d;
+}
+
+void spl_array_free(void *array, int64_t elementSize) {
+  release(array, elementSize);
+}
+
+struct frameChunk {
+  struct frameChunk *prev, *next;
+  char *end;
+  char data[];
+};
+
+static __thread struct frameChunk *frameChunks, *frameChunk;
+static __thread char *frameTop;
+
+void *spl_arena_mark(void) {
+  return frameTop;
+}
+
+/* size bytes on top of the arena, 16-byte aligned. */
+void *spl_arena_alloc(int64_t size) {
+  size_t bytes = ((size_t) size + 15) & ~(size_t) 15;
+  if (!frameChunk || (size_t) (frameChunk->end - frameTop) < bytes) {
+    /* the next chunk large enough, or a new one put after the current */
+    struct frameChunk *c = frameChunk ? frameChunk->next : frameChunks;
+    while (c && (size_t) (c->end - c->data) < bytes)
+      c = c->next;
+    if (!c) {
+      size_t capacity = bytes > ((size_t) 1 << CHUNK_CLASS) ? bytes : (size_t) 1 << CHUNK_CLASS;
+      c = checked(malloc(sizeof(struct frameChunk) + capacity));
+      c->end = c->data + capacity;
+      c->prev = frameChunk;
+      c->next = frameChunk ? frameChunk->next : frameChunks;
+      if (c->next)
+        c->next->prev = c;
+      if (frameChunk)
+        frameChunk->next = c;
+      else
+        frameChunks = c;
+    }
+    frameChunk = c;
+    frameTop = c->data;
+  }
+  void *p = frameTop;
+  frameTop += bytes;
+  return p;
+}
+
+/* Free everything allocated since mark was taken. */
+void spl_arena_release(void *mark) {
+  char *top = mark;
+  while (frameChunk && !(top >= frameChunk->data && top <= frameChunk->end))
+    frameChunk = frameChunk->prev;
+  frameTop = frameChunk ? top : NULL;
+}
@@ -0,0 +1,164 @@
+/*
+ * Thread pool of splc's parallel for loops. Link it with the generated assembly:
+ *   gcc -no-pie output.s runtime/parallel.c -lpthread
+ * SPL_NUM_THREADS sets the number of threads, by default one per online processor.
+ * The iterations of a loop are split evenly between the threads. Each thread runs its
+ * share in chunks from the front and, once it runs out, steals the back half of what
+ * another thread has left. Loops started from inside a parallel loop, and loops of fewer
+ * iterations than the grain the compiler passes, run sequentially.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef void (*loop_body)(void *env, int64_t lo, int64_t hi);
+
+/* iterations next..end - 1 a thread has left */
+struct share {
+  pthread_mutex_t lock;
+  int64_t next, end;
+};
+
+static int threadCount;
+static struct share *shares;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+/* the loop being run, and the helper threads still working on it */
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t started = PTHREAD_COND_INITIALIZER, finished = PTHREAD_COND_INITIALIZER;
+static unsigned long generation;
+static int busy;
+static loop_body body;
+static void *env;
+static int64_t chunk;
+
+static __thread int inLoop;
+static pthread_mutex_t reductionLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The next chunk of the thread's own share, lo..hi - 1. */
+static int take(int self, int64_t *lo, int64_t *hi) {
+  struct share *s = &shares[self];
+  int found = 0;
+  pthread_mutex_lock(&s->lock);
+  if (s->next < s->end) {
+    *lo = s->next;
+    *hi = s->end - s->next > chunk ? s->next + chunk : s->end;
+    s->next = *hi;
+    found = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return found;
+}
+
+/* Move the back half of another thread's share into the thread's own, which is used up. */
+static int steal(int self) {
+  for (int k = 1; k < threadCount; k++) {
+    struct share *victim = &shares[(self + k) % threadCount];
+    int64_t begin = 0, end = 0;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->next < victim->end) {
+      end = victim->end;
+      begin = end - (end - victim->next + 1) / 2;
+      victim->end = begin;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (begin < end) {
+      pthread_mutex_lock(&shares[self].lock);
+      shares[self].next = begin;
+      shares[self].end = end;
+      pthread_mutex_unlock(&shares[self].lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void work(int self) {
+  int64_t lo, hi;
+  do {
+    while (take(self, &lo, &hi))
+      body(env, lo, hi - 1);
+  } while (steal(self));
+}
+
+static void *helper(void *arg) {
+  int self = (int) (intptr_t) arg;
+  unsigned long seen = 0;
+  inLoop = 1;
+  pthread_mutex_lock(&poolLock);
+  for (;;) {
+    while (generation == seen)
+      pthread_cond_wait(&started, &poolLock);
+    seen = generation;
+    pthread_mutex_unlock(&poolLock);
+    work(self);
+    pthread_mutex_lock(&poolLock);
+    if (--busy == 0)
+      pthread_cond_signal(&finished);
+  }
+  return NULL;
+}
+
+static void startPool(void) {
+  const char *setting = getenv("SPL_NUM_THREADS");
+  long n = setting ? atol(setting) : sysconf(_SC_NPROCESSORS_ONLN);
+  threadCount = n < 1 ? 1 : (int) n;
+  shares = calloc(threadCount, sizeof *shares);
+  for (int i = 0; i < threadCount; i++)
+    pthread_mutex_init(&shares[i].lock, NULL);
+  for (int i = 1; i < threadCount; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, helper, (void *) (intptr_t) i) != 0) {
+      threadCount = i;
+      break;
+    }
+    pthread_detach(thread);
+  }
+}
+
+/* Run body(env, lo, hi) over chunks covering first..last; the calling thread takes part. */
+void spl_parallel_for(loop_body loopBody, void *loopEnv, int64_t first, int64_t last, int64_t grain) {
+  if (first > last)
+    return;
+  pthread_once(&poolOnce, startPool);
+  int64_t count = last - first + 1;
+  if (inLoop || threadCount == 1 || count == 1 || count < grain) {
+    loopBody(loopEnv, first, last);
+    return;
+  }
+
+  pthread_mutex_lock(&poolLock);
+  body = loopBody;
+  env = loopEnv;
+  chunk = count / ((int64_t) threadCount * 8);
+  if (chunk < 1)
+    chunk = 1;
+  for (int i = 0; i < threadCount; i++) {
+    shares[i].next = first + count * i / threadCount;
+    shares[i].end = first + count * (i + 1) / threadCount;
+  }
+  busy = threadCount - 1;
+  generation++;
+  pthread_cond_broadcast(&started);
+  pthread_mutex_unlock(&poolLock);
+
+  inLoop = 1;
+  work(0);
+  inLoop = 0;
+
+  pthread_mutex_lock(&poolLock);
+  while (busy > 0)
+    pthread_cond_wait(&finished, &poolLock);
+  pthread_mutex_unlock(&poolLock);
+}
+
+/* Held while a chunk folds its reduction variables into the shared ones. */
+void spl_parallel_lock(void) {
+  pthread_mutex_lock(&reductionLock);
+}
+
+void spl_parallel_unlock(void) {
+  pthread_mutex_unlock(&reductionLock);
+}
@@ -0,0 +1,231 @@
+/*
+ * Runtime of splc --instrument=routines. Link it with the generated assembly:
+ *   gcc -no-pie output.s runtime/profile.c -lpthread
+ * Each thread counts into its own buffer; at exit the buffers are merged into
+ * spl-profile.txt and the calls written as Chrome trace events to spl-trace.json
+ * (chrome://tracing, Perfetto or speedscope show it as a flame chart).
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAX_EVENTS (1 << 20)
+
+struct frame {
+  int routine;
+  uint64_t start, children;
+};
+
+struct event {
+  int routine, depth;
+  uint64_t start, duration;
+};
+
+struct buffer {
+  uint64_t *calls, *total, *self, *iterations;
+  int *active;
+  struct frame *stack;
+  int depth, capacity;
+  struct event *events;
+  size_t eventCount, eventCapacity;
+  int thread;
+  struct buffer *next;
+};
+
+static int routineCount, loopCount;
+static const char **routineNames;
+static const int *routineLines, *loopRoutines, *loopLines;
+static uint64_t startTicks;
+static struct timespec startTime;
+
+static pthread_mutex_t buffersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *buffers;
+static int threadCount;
+static __thread struct buffer *current;
+
+static uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000u + t.tv_nsec;
+#endif
+}
+
+static struct buffer *buffer(void) {
+  if (current)
+    return current;
+  struct buffer *b = calloc(1, sizeof(struct buffer));
+  b->calls = calloc(routineCount, sizeof(uint64_t));
+  b->total = calloc(routineCount, sizeof(uint64_t));
+  b->self = calloc(routineCount, sizeof(uint64_t));
+  b->active = calloc(routineCount, sizeof(int));
+  b->iterations = calloc(loopCount, sizeof(uint64_t));
+  b->capacity = 64;
+  b->stack = malloc(b->capacity * sizeof(struct frame));
+  pthread_mutex_lock(&buffersLock);
+  b->thread = threadCount++;
+  b->next = buffers;
+  buffers = b;
+  pthread_mutex_unlock(&buffersLock);
+  return current = b;
+}
+
+void spl_prof_enter(int routine) {
+  struct buffer *b = buffer();
+  if (b->depth == b->capacity) {
+    b->capacity *= 2;
+    b->stack = realloc(b->stack, b->capacity * sizeof(struct frame));
+  }
+  b->calls[routine]++;
+  b->active[routine]++;
+  struct frame *f = &b->stack[b->depth++];
+  f->routine = routine;
+  f->children = 0;
+  f->start = ticks();
+}
+
+void spl_prof_exit(int routine) {
+  uint64_t now = ticks();
+  struct buffer *b = buffer();
+  if (b->depth == 0 || b->stack[b->depth - 1].routine != routine)
+    return;
+  struct frame *f = &b->stack[--b->depth];
+  uint64_t elapsed = now - f->start;
+  b->self[routine] += elapsed - f->children;
+  /* recursive calls are inside the outermost one's total already */
+  if (--b->active[routine] == 0)
+    b->total[routine] += elapsed;
+  if (b->depth > 0)
+    b->stack[b->depth - 1].children += elapsed;
+  /* the event buffer grows with use, up to MAX_EVENTS per thread */
+  if (b->eventCount == b->eventCapacity && b->eventCapacity < MAX_EVENTS) {
+    size_t capacity = b->eventCapacity ? b->eventCapacity * 2 : 1024;
+    struct event *events = realloc(b->events, capacity * sizeof(struct event));
+    if (events) {
+      b->events = events;
+      b->eventCapacity = capacity;
+    }
+  }
+  if (b->eventCount < b->eventCapacity)
+    b->events[b->eventCount++] = (struct event) {routine, b->depth, f->start, elapsed};
+}
+
+void spl_prof_loop(int loop) {
+  buffer()->iterations[loop]++;
+}
+
+/* ticks per microsecond, measured over the whole run */
+static double tickRate(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double us = (now.tv_sec - startTime.tv_sec) * 1e6 + (now.tv_nsec - startTime.tv_nsec) / 1e3;
+  uint64_t elapsed = ticks() - startTicks;
+  return us > 0 && elapsed > 0 ? elapsed / us : 1e3;
+}
+
+static uint64_t *sortKey;
+
+/* descending self time */
+static int compareRoutines(const void *a, const void *b) {
+  uint64_t x = sortKey[*(const int *) a], y = sortKey[*(const int *) b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void report(void) {
+  double rate = tickRate();
+  uint64_t *calls = calloc(routineCount, sizeof(uint64_t));
+  uint64_t *total = calloc(routineCount, sizeof(uint64_t));
+  uint64_t *self = calloc(routineCount, sizeof(uint64_t));
+  uint64_t *iterations = calloc(loopCount, sizeof(uint64_t));
+  for (struct buffer *b = buffers; b; b = b->next) {
+    /* routines still running, main among them, count up to now */
+    uint64_t now = ticks();
+    for (int d = b->depth - 1; d >= 0; d--) {
+      struct frame *f = &b->stack[d];
+      uint64_t elapsed = now - f->start;
+      b->self[f->routine] += elapsed - f->children;
+      if (--b->active[f->routine] == 0)
+        b->total[f->routine] += elapsed;
+      if (d > 0)
+        b->stack[d - 1].children += elapsed;
+    }
+    b->depth = 0;
+    for (int i = 0; i < routineCount; i++) {
+      calls[i] += b->calls[i];
+      total[i] += b->total[i];
+      self[i] += b->self[i];
+    }
+    for (int i = 0; i < loopCount; i++)
+      iterations[i] += b->iterations[i];
+  }
+
+  FILE *out = fopen("spl-profile.txt", "w");
+  if (out) {
+    int *order = malloc(routineCount * sizeof(int));
+    for (int i = 0; i < routineCount; i++)
+      order[i] = i;
+    sortKey = self;
+    qsort(order, routineCount, sizeof(int), compareRoutines);
+    fprintf(out, "%-24s %6s %12s %14s %14s\n", "routine", "line", "calls", "total ms", "self ms");
+    for (int k = 0; k < routineCount; k++) {
+      int i = order[k];
+      if (!calls[i])
+        continue;
+      fprintf(out, "%-24s %6d %12llu %14.3f %14.3f\n", routineNames[i], routineLines[i],
+              (unsigned long long) calls[i], total[i] / rate / 1e3, self[i] / rate / 1e3);
+    }
+    fprintf(out, "\n%-24s %6s %14s %14s\n", "loop in", "line", "iterations", "per call");
+    for (int i = 0; i < loopCount; i++) {
+      int r = loopRoutines[i];
+      fprintf(out, "%-24s %6d %14llu %14.1f\n", routineNames[r], loopLines[i], (unsigned long long) iterations[i],
+              calls[r] ? (double) iterations[i] / calls[r] : 0.0);
+    }
+    fclose(out);
+    free(order);
+  }
+
+  out = fopen("spl-trace.json", "w");
+  if (out) {
+    fprintf(out, "{\"traceEvents\":[\n");
+    int first = 1;
+    for (struct buffer *b = buffers; b; b = b->next) {
+      for (size_t e = 0; e < b->eventCount; e++) {
+        struct event *ev = &b->events[e];
+        fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"args\":{\"line\":%d}}",
+                first ? "" : ",\n", routineNames[ev->routine], b->thread, (ev->start - startTicks) / rate,
+                ev->duration / rate, routineLines[ev->routine]);
+        first = 0;
+      }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+  }
+  fprintf(stderr, "profile written to spl-profile.txt and spl-trace.json\n");
+  free(calls);
+  free(total);
+  free(self);
+  free(iterations);
+}
+
+void spl_prof_init(int routines, const char **names, const int *lines, int loops, const int *loopRoutineIds,
+                   const int *loopLineNumbers) {
+  routineCount = routines;
+  routineNames = names;
+  routineLines = lines;
+  loopCount = loops;
+  loopRoutines = loopRoutineIds;
+  loopLines = loopLineNumbers;
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  startTicks = ticks();
+  atexit(report);
+}